@@ -0,0 +1,308 @@
+/**
+ * @file aesd-circular-buffer-bench.c
+ * @brief Userspace microbenchmark of aesd-circular-buffer.c
+ *
+ * Times aesd_circular_buffer_add_entry() on a full buffer and
+ * aesd_circular_buffer_find_entry_offset_for_fpos() with sequential and
+ * random offsets, for a range of capacities and entry size distributions,
+ * and prints ns/op.  Where perf_event_open() is allowed the cache misses of
+ * each run are printed as well, "-" otherwise (see
+ * /proc/sys/kernel/perf_event_paranoid).  Built by the CMake project next to
+ * the autotests, run it before and after changing the buffer on the target
+ * hardware to compare.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "aesd-circular-buffer.h"
+
+#define DEFAULT_OPS 1000000
+// Offsets and sizes are generated up front, in tables of this many entries
+#define TABLE_SIZE 4096
+#define MAX_ENTRY_SIZE 4096
+
+static const size_t default_capacities[] = { 10, 64, 256, 1024, 4096 };
+
+struct size_distribution {
+    const char *name;
+    size_t (*next)(void);
+};
+
+static uint64_t g_rng = 0x9e3779b97f4a7c15ull;
+
+// xorshift64*, plenty for picking sizes and offsets
+static uint64_t rng_next(void)
+{
+    g_rng ^= g_rng >> 12;
+    g_rng ^= g_rng << 25;
+    g_rng ^= g_rng >> 27;
+    return g_rng * 0x2545f4914f6cdd1dull;
+}
+
+static size_t size_fixed(void)
+{
+    return 64;
+}
+
+static size_t size_uniform(void)
+{
+    return 1 + rng_next() % 1024;
+}
+
+// Mostly short commands with the odd large one, like the socket server's log
+static size_t size_bimodal(void)
+{
+    return rng_next() % 16 == 0 ? MAX_ENTRY_SIZE : 16 + rng_next() % 48;
+}
+
+static const struct size_distribution distributions[] = {
+    { "fixed64", size_fixed },
+    { "uniform", size_uniform },
+    { "bimodal", size_bimodal },
+};
+
+static char g_data[MAX_ENTRY_SIZE];
+static volatile size_t g_sink;
+
+/**
+ * Cache miss counter of the calling thread, -1 if perf events aren't
+ * available
+ */
+static int perf_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+struct measurement {
+    uint64_t ns;
+    long long misses;   // -1 without a counter
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void measure_start(int perf_fd, struct measurement *m)
+{
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    m->ns = now_ns();
+}
+
+static void measure_stop(int perf_fd, struct measurement *m)
+{
+    m->ns = now_ns() - m->ns;
+    m->misses = -1;
+    if (perf_fd >= 0) {
+        long long count;
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd, &count, sizeof(count)) == sizeof(count)) {
+            m->misses = count;
+        }
+    }
+}
+
+static void report(size_t capacity, const char *sizes, const char *op,
+                   const struct measurement *m, long ops)
+{
+    char misses[32] = "-";
+    if (m->misses >= 0) {
+        snprintf(misses, sizeof(misses), "%.3f", (double)m->misses / ops);
+    }
+    printf("%8zu  %-8s  %-11s  %9.1f  %12s\n", capacity, sizes, op,
+           (double)m->ns / ops, misses);
+}
+
+/**
+ * Fill @param buffer with entries sized from @param sizes until it is full
+ */
+static void fill(struct aesd_circular_buffer *buffer, const size_t *sizes)
+{
+    size_t i;
+    for (i = 0; i < buffer->capacity; i++) {
+        struct aesd_buffer_entry entry = { g_data, sizes[i % TABLE_SIZE] };
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+static void bench_add(struct aesd_circular_buffer *buffer, const size_t *sizes,
+                      long ops, int perf_fd, struct measurement *m)
+{
+    long i;
+    measure_start(perf_fd, m);
+    for (i = 0; i < ops; i++) {
+        struct aesd_buffer_entry entry = { g_data, sizes[i % TABLE_SIZE] };
+        g_sink += (size_t)aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+    measure_stop(perf_fd, m);
+}
+
+/**
+ * Walk the contents one entry per lookup, the way the driver's read path
+ * does, starting over at the end
+ */
+static void bench_find_sequential(struct aesd_circular_buffer *buffer, long ops,
+                                  int perf_fd, struct measurement *m)
+{
+    size_t total = aesd_circular_buffer_bytes(buffer);
+    size_t offset = 0;
+    long i;
+
+    measure_start(perf_fd, m);
+    for (i = 0; i < ops; i++) {
+        size_t entry_offset;
+        struct aesd_buffer_entry *entry =
+            aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offset, &entry_offset);
+        offset += entry->size - entry_offset;
+        if (offset >= total) {
+            offset = 0;
+        }
+    }
+    measure_stop(perf_fd, m);
+    g_sink += offset;
+}
+
+static void bench_find_random(struct aesd_circular_buffer *buffer, const size_t *offsets,
+                              long ops, int perf_fd, struct measurement *m)
+{
+    long i;
+    measure_start(perf_fd, m);
+    for (i = 0; i < ops; i++) {
+        size_t entry_offset;
+        aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offsets[i % TABLE_SIZE],
+                                                        &entry_offset);
+        g_sink += entry_offset;
+    }
+    measure_stop(perf_fd, m);
+}
+
+static void bench_capacity(size_t capacity, const struct size_distribution *dist,
+                           long ops, int perf_fd)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entry = calloc(capacity, sizeof(*entry));
+    size_t *entry_start = calloc(capacity, sizeof(*entry_start));
+    size_t sizes[TABLE_SIZE];
+    size_t offsets[TABLE_SIZE];
+    struct measurement m;
+    size_t total;
+    size_t i;
+
+    if (entry == NULL || entry_start == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (i = 0; i < TABLE_SIZE; i++) {
+        sizes[i] = dist->next();
+    }
+
+    aesd_circular_buffer_init_storage(&buffer, entry, entry_start, capacity);
+    fill(&buffer, sizes);
+    bench_add(&buffer, sizes, ops, perf_fd, &m);
+    report(capacity, dist->name, "add", &m, ops);
+
+    total = aesd_circular_buffer_bytes(&buffer);
+    for (i = 0; i < TABLE_SIZE; i++) {
+        offsets[i] = rng_next() % total;
+    }
+    bench_find_sequential(&buffer, ops, perf_fd, &m);
+    report(capacity, dist->name, "find-seq", &m, ops);
+    bench_find_random(&buffer, offsets, ops, perf_fd, &m);
+    report(capacity, dist->name, "find-random", &m, ops);
+
+    free(entry);
+    free(entry_start);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n ops] [-c capacity[,capacity...]]\n"
+            "  -n ops       operations per measurement (default %d)\n"
+            "  -c capacity  buffer capacities to run (default 10,64,256,1024,4096)\n",
+            prog, DEFAULT_OPS);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t capacities[32];
+    size_t ncapacities = 0;
+    long ops = DEFAULT_OPS;
+    int perf_fd;
+    size_t c, d;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:c:")) != -1) {
+        switch (opt) {
+            case 'n':
+                ops = atol(optarg);
+                break;
+            case 'c': {
+                char *token = strtok(optarg, ",");
+                while (token != NULL && ncapacities < sizeof(capacities) / sizeof(capacities[0])) {
+                    capacities[ncapacities++] = strtoul(token, NULL, 10);
+                    token = strtok(NULL, ",");
+                }
+                break;
+            }
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (ops <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (ncapacities == 0) {
+        ncapacities = sizeof(default_capacities) / sizeof(default_capacities[0]);
+        memcpy(capacities, default_capacities, sizeof(default_capacities));
+    }
+    for (c = 0; c < ncapacities; c++) {
+        if (capacities[c] == 0) {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    perf_fd = perf_open();
+    if (perf_fd < 0) {
+        fprintf(stderr, "perf events unavailable, cache misses not counted\n");
+    }
+
+    printf("%8s  %-8s  %-11s  %9s  %12s\n", "capacity", "sizes", "operation", "ns/op",
+           "misses/op");
+    for (c = 0; c < ncapacities; c++) {
+        for (d = 0; d < sizeof(distributions) / sizeof(distributions[0]); d++) {
+            bench_capacity(capacities[c], &distributions[d], ops, perf_fd);
+        }
+    }
+
+    if (perf_fd >= 0) {
+        close(perf_fd);
+    }
+    return 0;
+}
@@ -16,6 +16,38 @@
 
 #include "aesd-circular-buffer.h"
 
+/**
+ * @return the number of bytes @param entry contributes to the buffer contents
+ */
+static size_t aesd_circular_buffer_entry_size(const struct aesd_buffer_entry *entry)
+{
+    return entry->buffptr != NULL ? entry->size : 0;
+}
+
+/**
+ * @return the number of valid entries in @param buffer
+ */
+size_t aesd_circular_buffer_entries(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full) {
+        return buffer->capacity;
+    }
+    return (buffer->in_offs + buffer->capacity - buffer->out_offs) %
+           buffer->capacity;
+}
+
+/**
+ * @return true if @param char_offset lies within the entry at @param index
+ */
+static bool aesd_circular_buffer_entry_holds(const struct aesd_circular_buffer *buffer,
+            size_t index, size_t char_offset)
+{
+    // Unsigned arithmetic keeps this right when the stream offsets wrap
+    size_t start = buffer->entry_start[index] - buffer->entry_start[buffer->out_offs];
+    return char_offset >= start &&
+           char_offset - start < aesd_circular_buffer_entry_size(&buffer->entry[index]);
+}
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -25,54 +57,78 @@
  *      in aesd_buffer.
  * @return the struct aesd_buffer_entry structure representing the position described by char_offset, or
  * NULL if this position is not available in the buffer (not enough data is written).
+ *
+ * A lookup continuing where the previous one left off (the same or the next entry) takes constant
+ * time, anything else is a binary search over the cumulative offset index.
  */
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    uint8_t index;
-    size_t current_offset = 0;
-    struct aesd_buffer_entry *entry = NULL;
+    if (buffer == NULL) {
+        return NULL;
+    }
+    return aesd_circular_buffer_find_entry_hinted(buffer, char_offset, entry_offset_byte_rtn,
+                                                  &buffer->last_index);
+}
+
+/**
+ * aesd_circular_buffer_find_entry_offset_for_fpos() with the sequential read hint kept by the
+ * caller instead of in @param buffer, so concurrent readers don't write shared state.
+ * @param hint is the index of the entry found by the caller's previous lookup, tried first and
+ *      updated to the entry found.  Any value is safe, it is only a guess.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_find_entry_hinted(const struct aesd_circular_buffer *buffer,
+            size_t char_offset, size_t *entry_offset_byte_rtn, size_t *hint)
+{
+    size_t count;
+    size_t base;
+    size_t index;
+    size_t low, high;
+    int i;
     
-    if (buffer == NULL || entry_offset_byte_rtn == NULL) {
+    if (buffer == NULL || entry_offset_byte_rtn == NULL || hint == NULL) {
         return NULL;
     }
     
-    // Start from out_offs and iterate through entries
-    index = buffer->out_offs;
-    uint8_t entries_to_process;
-    uint8_t i;
+    count = aesd_circular_buffer_entries(buffer);
+    if (count == 0) {
+        return NULL;
+    }
+    base = buffer->entry_start[buffer->out_offs];
+    if (char_offset >= buffer->end_offset - base) {
+        return NULL;
+    }
     
-    // Calculate how many entries we need to process
-    if (buffer->full) {
-        entries_to_process = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    } else {
-        if (buffer->in_offs >= buffer->out_offs) {
-            entries_to_process = buffer->in_offs - buffer->out_offs;
-        } else {
-            entries_to_process = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs + buffer->in_offs;
+    // Sequential reads: try the last entry found and the one after it
+    index = *hint % buffer->capacity;
+    for (i = 0; i < 2; i++) {
+        size_t position = (index + buffer->capacity - buffer->out_offs) %
+                          buffer->capacity;
+        if (position < count && aesd_circular_buffer_entry_holds(buffer, index, char_offset)) {
+            goto found;
         }
+        index = (index + 1) % buffer->capacity;
     }
     
-    // Process each entry
-    for (i = 0; i < entries_to_process; i++) {
-        entry = &buffer->entry[index];
-        
-        // Only process valid entries
-        if (entry->buffptr != NULL && entry->size > 0) {
-            // Check if char_offset is within this entry
-            if (char_offset < current_offset + entry->size) {
-                *entry_offset_byte_rtn = char_offset - current_offset;
-                return entry;
-            }
-            
-            current_offset += entry->size;
+    // Find the last entry starting at or before char_offset.  Empty entries share their start
+    // with the next one, so the last match is the entry holding the byte.
+    low = 0;
+    high = count - 1;
+    while (low < high) {
+        size_t mid = low + (high - low + 1) / 2;
+        index = (buffer->out_offs + mid) % buffer->capacity;
+        if (buffer->entry_start[index] - base <= char_offset) {
+            low = mid;
+        } else {
+            high = mid - 1;
         }
-        
-        // Move to next index
-        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
     }
+    index = (buffer->out_offs + low) % buffer->capacity;
     
-    return NULL;
+found:
+    *hint = index;
+    *entry_offset_byte_rtn = char_offset - (buffer->entry_start[index] - base);
+    return &buffer->entry[index];
 }
 
 /**
@@ -81,35 +137,94 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 * new start location.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* @return the buffptr of the entry that was overwritten, for the caller to free, or NULL
 */
-void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
+    const char *evicted = NULL;
+    
     if (buffer == NULL || add_entry == NULL) {
-        return;
+        return NULL;
     }
     
     // If buffer is full, we need to overwrite the oldest entry
     if (buffer->full) {
-        // Advance out_offs to the next oldest entry
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        evicted = buffer->entry[buffer->out_offs].buffptr;
+        // Advance out_offs to the next oldest entry; its start becomes offset 0
+        buffer->out_offs = (buffer->out_offs + 1) % buffer->capacity;
     }
     
-    // Add entry at in_offs
+    // Add entry at in_offs and index where it starts
     buffer->entry[buffer->in_offs] = *add_entry;
+    buffer->entry_start[buffer->in_offs] = buffer->end_offset;
+    buffer->end_offset += aesd_circular_buffer_entry_size(add_entry);
     
     // Advance in_offs
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->in_offs = (buffer->in_offs + 1) % buffer->capacity;
     
     // Check if buffer is now full
     if (buffer->in_offs == buffer->out_offs) {
         buffer->full = true;
     }
+    return evicted;
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Removes the oldest entry of @param buffer, e.g. to keep the buffer within a byte budget.
+* Any necessary locking must be handled by the caller
+* @return the buffptr of the removed entry, for the caller to free, or NULL if the buffer is empty
+*/
+const char *aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *oldest;
+    const char *removed;
+    
+    if (buffer == NULL || aesd_circular_buffer_entries(buffer) == 0) {
+        return NULL;
+    }
+    
+    // Clear the slot so AESD_CIRCULAR_BUFFER_FOREACH no longer sees the memory
+    oldest = &buffer->entry[buffer->out_offs];
+    removed = oldest->buffptr;
+    oldest->buffptr = NULL;
+    oldest->size = 0;
+    buffer->out_offs = (buffer->out_offs + 1) % buffer->capacity;
+    buffer->full = false;
+    return removed;
+}
+
+/**
+* @return the number of bytes held by @param buffer, all entries concatenated
+*/
+size_t aesd_circular_buffer_bytes(const struct aesd_circular_buffer *buffer)
+{
+    if (aesd_circular_buffer_entries(buffer) == 0) {
+        return 0;
+    }
+    return buffer->end_offset - buffer->entry_start[buffer->out_offs];
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct holding up to
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->default_entry;
+    buffer->entry_start = buffer->default_entry_start;
+    buffer->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+* Initializes @param buffer to an empty buffer of @param capacity entries stored in the caller
+* allocated, zeroed arrays @param entry and @param entry_start, which must outlive the buffer
+*/
+void aesd_circular_buffer_init_storage(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *entry, size_t *entry_start, size_t capacity)
+{
+    aesd_circular_buffer_init(buffer);
+    buffer->entry = entry;
+    buffer->entry_start = entry_start;
+    buffer->capacity = capacity;
 }
@@ -0,0 +1,144 @@
+/**
+ * @file aesd-mirror.c
+ * @brief Page-backed copy of the circular buffer contents exported through mmap
+ *
+ * Every command stored in the circular buffer is also copied into a ring in
+ * vmalloc_user() memory, laid out as described in aesd_mmap.h, so readers can
+ * map it and copy history without a read() per dump.  The mirror holds the
+ * newest commands, the same ones as the device unless a command is larger
+ * than the ring.  All updates happen under the device lock and are bracketed
+ * by the generation counter for lockless readers.
+ */
+
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/version.h>
+#include <asm/barrier.h>
+#include "aesd-mirror.h"
+
+/**
+ * Allocate a mirror with a ring of @param data_size bytes (rounded up to pages) and
+ * @param max_entries entry slots.  A @param data_size of 0 leaves the mirror disabled.
+ */
+int aesd_mirror_init(struct aesd_mirror *mirror, size_t data_size, u32 max_entries)
+{
+    size_t header_size;
+    struct aesd_mmap_header *header;
+
+    memset(mirror, 0, sizeof(*mirror));
+    if (data_size == 0) {
+        return 0;
+    }
+
+    header_size = PAGE_ALIGN(sizeof(*header) + (size_t)max_entries * sizeof(header->entries[0]));
+    data_size = PAGE_ALIGN(data_size);
+    mirror->area_size = header_size + data_size;
+    mirror->area = vmalloc_user(mirror->area_size);
+    if (mirror->area == NULL) {
+        return -ENOMEM;
+    }
+
+    header = mirror->area;
+    header->magic = AESD_MMAP_MAGIC;
+    header->version = AESD_MMAP_VERSION;
+    header->complete = 1;
+    header->map_size = mirror->area_size;
+    header->data_offset = header_size;
+    header->data_size = data_size;
+    header->max_entries = max_entries;
+    mirror->header = header;
+    mirror->data = (char *)mirror->area + header_size;
+    return 0;
+}
+
+void aesd_mirror_free(struct aesd_mirror *mirror)
+{
+    vfree(mirror->area);
+    memset(mirror, 0, sizeof(*mirror));
+}
+
+/**
+ * Copy the command @param buffptr of @param size bytes just added to the device into
+ * the mirror, dropping old commands so it holds at most the @param device_entries
+ * the device now keeps.  Caller holds the device lock.
+ */
+void aesd_mirror_add(struct aesd_mirror *mirror, const char *buffptr, size_t size,
+            size_t device_entries)
+{
+    struct aesd_mmap_header *header = mirror->header;
+    struct aesd_mmap_entry *entry;
+    u64 pos, end;
+    u64 offset;
+
+    if (header == NULL) {
+        return;
+    }
+
+    WRITE_ONCE(header->generation, header->generation + 1);
+    smp_wmb();
+
+    if (size > header->data_size) {
+        // Can't be mirrored: drop everything, readers have to use read()
+        mirror->next_start += size;
+        header->head = mirror->tail;
+        header->count = 0;
+        header->complete = 0;
+        goto out;
+    }
+
+    // Keep every payload contiguous, skipping the end of the ring if needed
+    pos = mirror->tail;
+    offset = pos % header->data_size;
+    if (offset + size > header->data_size) {
+        pos += header->data_size - offset;
+    }
+    end = pos + size;
+
+    // Make room for the entry and its bytes
+    while (header->count > 0 &&
+           (header->count + 1 > device_entries ||
+            header->entries[header->first].pos + header->data_size < end)) {
+        header->first = (header->first + 1) % header->max_entries;
+        header->count--;
+    }
+    if (end > header->data_size) {
+        header->head = end - header->data_size;
+    }
+    smp_wmb();
+
+    memcpy(mirror->data + pos % header->data_size, buffptr, size);
+
+    entry = &header->entries[(header->first + header->count) % header->max_entries];
+    entry->pos = pos;
+    entry->start = mirror->next_start;
+    entry->size = size;
+    header->count++;
+    header->complete = header->count == device_entries;
+    mirror->next_start += size;
+    mirror->tail = end;
+
+out:
+    smp_wmb();
+    WRITE_ONCE(header->generation, header->generation + 1);
+}
+
+/**
+ * Map the mirror read-only into @param vma
+ */
+int aesd_mirror_mmap(struct aesd_mirror *mirror, struct vm_area_struct *vma)
+{
+    if (mirror->area == NULL) {
+        return -ENODEV;
+    }
+    if (vma->vm_flags & VM_WRITE) {
+        return -EPERM;
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    return remap_vmalloc_range(vma, mirror->area, vma->vm_pgoff);
+}
@@ -0,0 +1,33 @@
+/*
+ * aesd-mirror.h
+ *
+ * Page-backed copy of the circular buffer contents exported through mmap
+ */
+
+#ifndef AESD_CHAR_DRIVER_AESD_MIRROR_H_
+#define AESD_CHAR_DRIVER_AESD_MIRROR_H_
+
+#include <linux/types.h>
+#include <linux/mm_types.h>
+#include "aesd_mmap.h"
+
+struct aesd_mirror
+{
+    void *area;                         /* vmalloc_user() mapping, NULL when disabled */
+    size_t area_size;
+    struct aesd_mmap_header *header;    /* at the start of area */
+    char *data;                         /* ring of header->data_size bytes */
+    u64 tail;                           /* ring position of the next command */
+    u64 next_start;                     /* command offset of the next command */
+};
+
+int aesd_mirror_init(struct aesd_mirror *mirror, size_t data_size, u32 max_entries);
+
+void aesd_mirror_free(struct aesd_mirror *mirror);
+
+void aesd_mirror_add(struct aesd_mirror *mirror, const char *buffptr, size_t size,
+            size_t device_entries);
+
+int aesd_mirror_mmap(struct aesd_mirror *mirror, struct vm_area_struct *vma);
+
+#endif /* AESD_CHAR_DRIVER_AESD_MIRROR_H_ */
@@ -0,0 +1,342 @@
+/**
+ * @file aesd-read-bench.c
+ * @brief Measure concurrent read throughput of /dev/aesdchar
+ *
+ * Starts a number of reader threads, each dumping the whole device from
+ * offset 0 in a loop, optionally alongside a writer appending commands,
+ * and reports dumps and bytes per second.  By default the run is repeated
+ * with the lockless_reads module parameter set and cleared, so the lockless
+ * read path can be compared with the mutex.  Needs write access to the
+ * parameter in sysfs to switch modes.  With -S the readers splice() the
+ * device through a pipe into /dev/null instead of copying it to user space.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define DEFAULT_DEVICE "/dev/aesdchar"
+#define LOCKLESS_PARAM "/sys/module/aesdchar/parameters/lockless_reads"
+#define READ_SIZE (64 * 1024)
+#define COMMAND_SIZE 100
+
+static const char *g_device = DEFAULT_DEVICE;
+static int g_splice;
+static atomic_int g_stop;
+
+struct counters {
+    unsigned long long dumps;
+    unsigned long long bytes;
+};
+
+/**
+ * Dump @param fd from offset 0 into @param pipe_fds and on to @param sink
+ * @return the bytes dumped, -1 on error
+ */
+static ssize_t splice_dump(int fd, const int pipe_fds[2], int sink)
+{
+    loff_t offset = 0;
+    ssize_t n;
+
+    while ((n = splice(fd, &offset, pipe_fds[1], NULL, READ_SIZE, 0)) > 0) {
+        while (n > 0) {
+            ssize_t drained = splice(pipe_fds[0], NULL, sink, NULL, n, 0);
+            if (drained <= 0) {
+                return -1;
+            }
+            n -= drained;
+        }
+    }
+    return n < 0 ? -1 : offset;
+}
+
+static void *splice_reader_thread(void *arg)
+{
+    struct counters *counters = arg;
+    int pipe_fds[2];
+    int fd = open(g_device, O_RDONLY);
+    int sink = open("/dev/null", O_WRONLY);
+
+    if (fd < 0 || sink < 0 || pipe(pipe_fds) != 0) {
+        perror(g_device);
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (sink >= 0) {
+            close(sink);
+        }
+        return NULL;
+    }
+
+    while (!atomic_load(&g_stop)) {
+        ssize_t n = splice_dump(fd, pipe_fds, sink);
+        if (n < 0 && errno != EINTR) {
+            perror("splice");
+            break;
+        }
+        counters->dumps++;
+        counters->bytes += n > 0 ? n : 0;
+    }
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    close(sink);
+    close(fd);
+    return NULL;
+}
+
+static void *reader_thread(void *arg)
+{
+    struct counters *counters = arg;
+    char *buf = malloc(READ_SIZE);
+    int fd = open(g_device, O_RDONLY);
+
+    if (buf == NULL || fd < 0) {
+        perror(g_device);
+        free(buf);
+        return NULL;
+    }
+
+    while (!atomic_load(&g_stop)) {
+        off_t offset = 0;
+        ssize_t n;
+        while ((n = pread(fd, buf, READ_SIZE, offset)) > 0) {
+            offset += n;
+        }
+        if (n < 0 && errno != EINTR) {
+            perror("pread");
+            break;
+        }
+        counters->dumps++;
+        counters->bytes += offset;
+    }
+
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Write one newline terminated command of COMMAND_SIZE bytes to @param fd
+ */
+static int write_command(int fd, unsigned long long seq)
+{
+    char line[COMMAND_SIZE];
+
+    memset(line, 'x', sizeof(line));
+    snprintf(line, sizeof(line), "%llu ", seq);
+    line[strlen(line)] = 'x';
+    line[sizeof(line) - 1] = '\n';
+    return write(fd, line, sizeof(line)) == (ssize_t)sizeof(line) ? 0 : -1;
+}
+
+static void *writer_thread(void *arg)
+{
+    struct counters *counters = arg;
+    int fd = open(g_device, O_WRONLY);
+
+    if (fd < 0) {
+        perror(g_device);
+        return NULL;
+    }
+    while (!atomic_load(&g_stop)) {
+        if (write_command(fd, counters->dumps) != 0) {
+            perror("write");
+            break;
+        }
+        counters->dumps++;
+        counters->bytes += COMMAND_SIZE;
+    }
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Set the lockless_reads parameter to @param value
+ * @return 0 on success, -1 if it can't be written
+ */
+static int set_lockless(int value)
+{
+    int fd = open(LOCKLESS_PARAM, O_WRONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    int result = write(fd, value ? "1" : "0", 1) == 1 ? 0 : -1;
+    close(fd);
+    return result;
+}
+
+/**
+ * @return the current lockless_reads setting, -1 if unknown
+ */
+static int get_lockless(void)
+{
+    char value = 0;
+    int fd = open(LOCKLESS_PARAM, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (read(fd, &value, 1) != 1) {
+        value = 0;
+    }
+    close(fd);
+    return value == 'Y' || value == '1' ? 1 : value == 'N' || value == '0' ? 0 : -1;
+}
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int run(const char *label, int nreaders, int seconds, int with_writer)
+{
+    pthread_t *threads = calloc(nreaders + 1, sizeof(pthread_t));
+    struct counters *counters = calloc(nreaders + 1, sizeof(struct counters));
+    struct counters total = { 0, 0 };
+    struct timespec start;
+    int started = 0;
+
+    if (threads == NULL || counters == NULL) {
+        perror("calloc");
+        free(threads);
+        free(counters);
+        return -1;
+    }
+
+    atomic_store(&g_stop, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < nreaders; i++) {
+        if (pthread_create(&threads[started++], NULL,
+                           g_splice ? splice_reader_thread : reader_thread, &counters[i]) != 0) {
+            started--;
+            break;
+        }
+    }
+    int writer_started = with_writer &&
+        pthread_create(&threads[nreaders], NULL, writer_thread, &counters[nreaders]) == 0;
+
+    sleep(seconds);
+    atomic_store(&g_stop, 1);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        total.dumps += counters[i].dumps;
+        total.bytes += counters[i].bytes;
+    }
+    if (writer_started) {
+        pthread_join(threads[nreaders], NULL);
+    }
+    double secs = elapsed(&start);
+
+    printf("%-8s readers=%d dumps/s=%.0f MB/s=%.1f writes/s=%.0f\n", label, started,
+           total.dumps / secs, total.bytes / secs / 1e6,
+           writer_started ? counters[nreaders].dumps / secs : 0.0);
+    free(threads);
+    free(counters);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-d device] [-t readers] [-s seconds] [-n seed] [-w] [-S] "
+            "[-m lockless|mutex|both|current]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int nreaders = 8;
+    int seconds = 5;
+    int seed = 10;
+    int with_writer = 0;
+    const char *mode = "both";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:t:s:n:wSm:")) != -1) {
+        switch (opt) {
+            case 'd':
+                g_device = optarg;
+                break;
+            case 't':
+                nreaders = atoi(optarg);
+                break;
+            case 's':
+                seconds = atoi(optarg);
+                break;
+            case 'n':
+                seed = atoi(optarg);
+                break;
+            case 'w':
+                with_writer = 1;
+                break;
+            case 'S':
+                g_splice = 1;
+                break;
+            case 'm':
+                mode = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (nreaders < 1 || seconds < 1 || seed < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Give the readers some history to dump
+    int fd = open(g_device, O_WRONLY);
+    if (fd < 0) {
+        perror(g_device);
+        return 1;
+    }
+    for (int i = 0; i < seed; i++) {
+        if (write_command(fd, i) != 0) {
+            perror("write");
+            close(fd);
+            return 1;
+        }
+    }
+    close(fd);
+
+    if (strcmp(mode, "current") == 0) {
+        return run("current", nreaders, seconds, with_writer) == 0 ? 0 : 1;
+    }
+
+    int original = get_lockless();
+    int result = 0;
+    int modes[2];
+    int nmodes = 0;
+    if (strcmp(mode, "lockless") == 0 || strcmp(mode, "both") == 0) {
+        modes[nmodes++] = 1;
+    }
+    if (strcmp(mode, "mutex") == 0 || strcmp(mode, "both") == 0) {
+        modes[nmodes++] = 0;
+    }
+    if (nmodes == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (int i = 0; i < nmodes && result == 0; i++) {
+        if (set_lockless(modes[i]) != 0) {
+            fprintf(stderr, "Can't write %s: %s\n", LOCKLESS_PARAM, strerror(errno));
+            result = -1;
+            break;
+        }
+        result = run(modes[i] ? "lockless" : "mutex", nreaders, seconds, with_writer);
+    }
+
+    if (original >= 0) {
+        set_lockless(original);
+    }
+    return result == 0 ? 0 : 1;
+}
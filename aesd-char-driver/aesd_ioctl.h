@@ -0,0 +1,34 @@
+/*
+ * aesd_ioctl.h
+ *
+ * ioctl commands of /dev/aesdchar, shared by the driver and userspace
+ */
+
+#ifndef AESD_IOCTL_H
+#define AESD_IOCTL_H
+
+#ifdef __KERNEL__
+#include <asm-generic/ioctl.h>
+#include <linux/types.h>
+#else
+#include <sys/ioctl.h>
+#include <stdint.h>
+typedef uint32_t __u32;
+#endif
+
+#define AESD_IOC_MAGIC 0x16
+
+/**
+ * Follow the command stream on this open file: with a non-zero argument,
+ * a read at the end of the data waits for the next command instead of
+ * returning 0 (or fails with EAGAIN for O_NONBLOCK), and poll() reports
+ * the file readable only once there is unread data.  The position is kept
+ * in the stream, so evicting old commands doesn't move it; if commands are
+ * evicted before they are read, reading continues at the oldest one left.
+ * Following starts at the current file position.  Zero turns it off again.
+ */
+#define AESDCHAR_IOCFOLLOW _IOW(AESD_IOC_MAGIC, 1, __u32)
+
+#define AESDCHAR_IOC_MAXNR 1
+
+#endif /* AESD_IOCTL_H */
@@ -0,0 +1,72 @@
+/*
+ * aesd_mmap.h
+ *
+ * Layout of the read-only mapping of /dev/aesdchar, shared by the driver
+ * and userspace readers.  The driver only offers the mapping when loaded
+ * with a non-zero mmap_size.
+ *
+ * The mapping starts with struct aesd_mmap_header, followed at data_offset
+ * by a ring of data_size bytes holding the command payloads.  Each command
+ * is stored contiguously at data_offset + pos % data_size.
+ *
+ * Readers snapshot with the generation counter: read it (retry while odd),
+ * read what they need, then read it again and retry if it changed.
+ */
+
+#ifndef AESD_MMAP_H
+#define AESD_MMAP_H
+
+#include <linux/types.h>
+
+#define AESD_MMAP_MAGIC 0x414d4150 /* "AMAP" */
+#define AESD_MMAP_VERSION 1
+
+struct aesd_mmap_entry
+{
+    /**
+     * Position of the first byte in the ring's stream; the payload is at
+     * data_offset + pos % data_size and never wraps
+     */
+    __u64 pos;
+    /**
+     * Offset of the first byte among all commands ever written, so the
+     * offset within the current history is start - entries[first].start
+     */
+    __u64 start;
+    __u64 size;
+};
+
+struct aesd_mmap_header
+{
+    __u32 magic;
+    __u32 version;
+    /**
+     * Incremented before and after every update, odd while one is in progress
+     */
+    __u32 generation;
+    /**
+     * Non-zero when the mapping holds every command the device holds; a
+     * command larger than the ring makes it fall behind until old ones age out
+     */
+    __u32 complete;
+    /**
+     * Bytes to map to see everything: header, entries and ring
+     */
+    __u64 map_size;
+    __u64 data_offset;
+    __u64 data_size;
+    /**
+     * Ring positions below this may be overwritten already
+     */
+    __u64 head;
+    /**
+     * Slots in entries[], the oldest command in slot first
+     */
+    __u32 max_entries;
+    __u32 first;
+    __u32 count;
+    __u32 reserved;
+    struct aesd_mmap_entry entries[];
+};
+
+#endif /* AESD_MMAP_H */
@@ -10,7 +10,13 @@
 
 #ifdef __KERNEL__
 #include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/srcu.h>
+#include <linux/wait.h>
+#include <linux/percpu.h>
 #include "aesd-circular-buffer.h"
+#include "aesd-mirror.h"
+#include "aesd-stats.h"
 #endif
 
 #define AESD_DEBUG 1  //Remove comment on this line to enable debug
@@ -32,9 +38,26 @@ struct aesd_dev
 {
     struct cdev cdev;     /* Char device structure      */
     struct aesd_circular_buffer circular_buffer; /* Circular buffer for write commands */
-    struct mutex lock;    /* Mutex for thread-safe access */
+    struct mutex lock;    /* Mutex serializing writers (and readers without lockless_reads) */
+    seqcount_mutex_t seq; /* Bumped by writers around circular buffer updates */
+    struct srcu_struct srcu; /* Keeps evicted commands alive for lockless readers */
+    wait_queue_head_t wait; /* Readers following the stream, woken by writers */
+    struct aesd_stats __percpu *stats; /* Performance counters, see aesd-stats.h */
+    struct dentry *debugfs; /* aesdchar directory in debugfs */
     char *partial_write_buffer; /* Buffer for unterminated write commands */
     size_t partial_write_size;  /* Size of partial write buffer */
+    struct aesd_mirror mirror;  /* Copy of the commands for mmap() readers */
+};
+
+/**
+ * State of one open file of the device
+ */
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    bool follow;          /* Reads at the end wait for new commands (AESDCHAR_IOCFOLLOW) */
+    size_t stream_pos;    /* With follow, stream offset of the next byte to read */
+    size_t last_index;    /* Entry of the last lookup, tried first by the next one */
 };
 
 
@@ -0,0 +1,194 @@
+/**
+ * @file systemcalls-bench.c
+ * @brief Launch latency of the systemcalls.c helpers against fork()
+ *
+ * Runs /bin/true repeatedly with fork(), execv() and waitpid() (what
+ * do_exec() used to do), with do_exec() on posix_spawn(), and with
+ * do_exec_batch() starting several at a time, and prints the wall time
+ * per launch.  fork() has to copy the page tables of the caller, so each
+ * run is repeated with the parent holding increasingly large touched
+ * heaps.  Built by the CMake project next to the autotests.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "systemcalls.h"
+
+#define DEFAULT_LAUNCHES 1000
+#define DEFAULT_BATCH 16
+#define COMMAND "/bin/true"
+#define MAX_BATCH 1024
+
+static const size_t default_heaps_mb[] = { 0, 64, 512 };
+
+static char *const g_command[] = { COMMAND, NULL };
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * The old do_exec(): fork(), execv() in the child, waitpid() in the parent
+ */
+static bool fork_exec(void)
+{
+    int status;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (pid == 0) {
+        execv(g_command[0], g_command);
+        _exit(127);
+    }
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool bench_fork(long launches)
+{
+    long i;
+    for (i = 0; i < launches; i++) {
+        if (!fork_exec()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool bench_spawn(long launches)
+{
+    long i;
+    for (i = 0; i < launches; i++) {
+        if (!do_exec(1, COMMAND)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool bench_batch(long launches, size_t batch)
+{
+    struct exec_command commands[MAX_BATCH];
+    long done = 0;
+    size_t i;
+
+    for (i = 0; i < batch; i++) {
+        commands[i].argv = g_command;
+        commands[i].outputfile = NULL;
+    }
+    while (done < launches) {
+        size_t count = launches - done < (long)batch ? (size_t)(launches - done) : batch;
+        if (!do_exec_batch(commands, count)) {
+            return false;
+        }
+        done += count;
+    }
+    return true;
+}
+
+static void report(size_t heap_mb, const char *mode, uint64_t start, long launches, bool ok)
+{
+    if (!ok) {
+        printf("%7zu  %-9s  %12s\n", heap_mb, mode, "failed");
+        return;
+    }
+    printf("%7zu  %-9s  %12.1f\n", heap_mb, mode,
+           (double)(now_ns() - start) / launches / 1000.0);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-n launches] [-b batch] [-m heap_mb]...\n"
+            "  -n launches  commands started per run (default %d)\n"
+            "  -b batch     commands started at once by do_exec_batch() (default %d)\n"
+            "  -m heap_mb   touched heap of the parent, repeatable (default 0, 64, 512)\n",
+            prog, DEFAULT_LAUNCHES, DEFAULT_BATCH);
+}
+
+int main(int argc, char *argv[])
+{
+    long launches = DEFAULT_LAUNCHES;
+    size_t batch = DEFAULT_BATCH;
+    size_t heaps_mb[16];
+    size_t heap_count = 0;
+    size_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:b:m:")) != -1) {
+        switch (opt) {
+            case 'n':
+                launches = atol(optarg);
+                break;
+            case 'b':
+                batch = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                if (heap_count == sizeof(heaps_mb) / sizeof(heaps_mb[0])) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                heaps_mb[heap_count++] = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (launches < 1 || batch < 1 || batch > MAX_BATCH) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (heap_count == 0) {
+        heap_count = sizeof(default_heaps_mb) / sizeof(default_heaps_mb[0]);
+        memcpy(heaps_mb, default_heaps_mb, sizeof(default_heaps_mb));
+    }
+
+    printf("%7s  %-9s  %12s\n", "heap_mb", "mode", "us/launch");
+    for (i = 0; i < heap_count; i++) {
+        char *heap = NULL;
+        uint64_t start;
+        bool ok;
+
+        if (heaps_mb[i] > 0) {
+            // Touch every page so each one is mapped in the parent
+            heap = malloc(heaps_mb[i] << 20);
+            if (heap == NULL) {
+                perror("malloc");
+                return 1;
+            }
+            memset(heap, 1, heaps_mb[i] << 20);
+        }
+
+        start = now_ns();
+        ok = bench_fork(launches);
+        report(heaps_mb[i], "fork", start, launches, ok);
+        start = now_ns();
+        ok = bench_spawn(launches);
+        report(heaps_mb[i], "spawn", start, launches, ok);
+        start = now_ns();
+        ok = bench_batch(launches, batch);
+        report(heaps_mb[i], "batch", start, launches, ok);
+
+        free(heap);
+    }
+    return 0;
+}
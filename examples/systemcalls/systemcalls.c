@@ -1,4 +1,107 @@
+/**
+ * Commands are started with posix_spawn() rather than fork() and execv():
+ * glibc starts the child with clone(CLONE_VM | CLONE_VFORK), so nothing of
+ * the caller's address space is copied or marked copy-on-write, which is
+ * what makes fork() slow from a large multithreaded process.  The stdout
+ * redirect is a spawn file action, applied in the child before exec.
+ */
+
+#define _GNU_SOURCE
 #include "systemcalls.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+// Optional: use these functions to add debug or error prints to your application
+#define DEBUG_LOG(msg,...)
+//#define DEBUG_LOG(msg,...) printf("systemcalls: " msg "\n" , ##__VA_ARGS__)
+#define ERROR_LOG(msg,...) printf("systemcalls ERROR: " msg "\n" , ##__VA_ARGS__)
+
+/**
+ * Start @param command (command[0] the full path, NULL terminated) with
+ * posix_spawn(), its stdout going to @param outputfile unless it is NULL
+ * @return 0 with the child in @param pid, an errno value otherwise
+ */
+static int spawn_command(pid_t *pid, char *const command[], const char *outputfile)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_t *file_actions = NULL;
+    int result;
+
+    if (outputfile != NULL) {
+        result = posix_spawn_file_actions_init(&actions);
+        if (result != 0) {
+            return result;
+        }
+        result = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, outputfile,
+                                                  O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (result != 0) {
+            posix_spawn_file_actions_destroy(&actions);
+            return result;
+        }
+        file_actions = &actions;
+    }
+
+    // Flush stdio first so our own buffered output comes out ahead of the
+    // child's
+    fflush(stdout);
+    result = posix_spawn(pid, command[0], file_actions, NULL, command, environ);
+    if (file_actions != NULL) {
+        posix_spawn_file_actions_destroy(file_actions);
+    }
+    return result;
+}
+
+/**
+ * @return true if @param status is that of a child exiting with 0
+ */
+static bool exited_ok(int status)
+{
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Reap @param pid, storing its waitpid() status in @param status
+ * @return true on success
+ */
+static bool wait_child(pid_t pid, int *status)
+{
+    while (waitpid(pid, status, 0) < 0) {
+        if (errno != EINTR) {
+            ERROR_LOG("waitpid %d failed: %s", (int)pid, strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Run @param command and wait for it, see do_exec()
+ */
+static bool run_command(char *const command[], const char *outputfile)
+{
+    pid_t pid;
+    int status;
+
+    int result = spawn_command(&pid, command, outputfile);
+    if (result != 0) {
+        ERROR_LOG("posix_spawn %s failed: %s", command[0], strerror(result));
+        return false;
+    }
+    if (!wait_child(pid, &status)) {
+        return false;
+    }
+    DEBUG_LOG("%s exited with status %d", command[0], status);
+    return exited_ok(status);
+}
 
 /**
  * @param cmd the command to execute with system()
@@ -10,14 +113,16 @@
 bool do_system(const char *cmd)
 {
 
-/*
- * TODO  add your code here
- *  Call the system() function with the command set in the cmd
- *   and return a boolean true if the system() call completed with success
- *   or false() if it returned a failure
-*/
-
-    return true;
+    int status = system(cmd);
+    if (status < 0) {
+        ERROR_LOG("system failed: %s", strerror(errno));
+        return false;
+    }
+    // With a NULL cmd, system() only tells whether a shell is available
+    if (cmd == NULL) {
+        return status != 0;
+    }
+    return exited_ok(status);
 }
 
 /**
@@ -45,23 +150,9 @@ bool do_exec(int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
-    // this line is to avoid a compile warning before your implementation is complete
-    // and may be removed
-    command[count] = command[count];
-
-/*
- * TODO:
- *   Execute a system command by calling fork, execv(),
- *   and wait instead of system (see LSP page 161).
- *   Use the command[0] as the full path to the command to execute
- *   (first argument to execv), and use the remaining arguments
- *   as second argument to the execv() command.
- *
-*/
-
     va_end(args);
 
-    return true;
+    return run_command(command, NULL);
 }
 
 /**
@@ -80,20 +171,101 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
-    // this line is to avoid a compile warning before your implementation is complete
-    // and may be removed
-    command[count] = command[count];
+    va_end(args);
 
+    return run_command(command, outputfile);
+}
 
-/*
- * TODO
- *   Call execv, but first using https://stackoverflow.com/a/13784315/1446624 as a refernce,
- *   redirect standard out to a file specified by outputfile.
- *   The rest of the behaviour is same as do_exec()
- *
+/**
+ * Open a pidfd for @param pid, which becomes readable once the child exits
+ * @return the descriptor, -1 if the kernel has no pidfd_open()
+ */
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+* @param commands - The commands to run, see struct exec_command
+* @param count - The number of entries in @param commands
+* @return true if every command was started and exited with 0, false otherwise.
+*   All of them are started before any is waited for, and every one that
+*   was started is reaped before returning.  Children are reaped as their
+*   pidfd becomes readable, in whatever order they exit; without pidfds
+*   they are waited for in order.
 */
+bool do_exec_batch(struct exec_command *commands, size_t count)
+{
+    struct pollfd *fds = calloc(count ? count : 1, sizeof(struct pollfd));
+    pid_t *pids = calloc(count ? count : 1, sizeof(pid_t));
+    size_t pending = 0;
+    size_t i;
+    bool success = true;
 
-    va_end(args);
+    if (fds == NULL || pids == NULL) {
+        ERROR_LOG("calloc failed for %zu commands", count);
+        free(fds);
+        free(pids);
+        return false;
+    }
 
-    return true;
+    for (i = 0; i < count; i++) {
+        commands[i].status = -1;
+        fds[i].fd = -1;
+        int result = spawn_command(&pids[i], commands[i].argv, commands[i].outputfile);
+        if (result != 0) {
+            ERROR_LOG("posix_spawn %s failed: %s", commands[i].argv[0], strerror(result));
+            pids[i] = -1;
+            success = false;
+            continue;
+        }
+        fds[i].fd = open_pidfd(pids[i]);
+        fds[i].events = POLLIN;
+        if (fds[i].fd >= 0) {
+            pending++;
+        }
+    }
+
+    // poll() skips the entries without a pidfd
+    while (pending > 0) {
+        if (poll(fds, count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERROR_LOG("poll failed: %s", strerror(errno));
+            break;
+        }
+        for (i = 0; i < count; i++) {
+            if (fds[i].fd >= 0 && fds[i].revents != 0) {
+                if (wait_child(pids[i], &commands[i].status)) {
+                    pids[i] = -1;
+                }
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                pending--;
+            }
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (fds[i].fd >= 0) {
+            close(fds[i].fd);
+        }
+        if (pids[i] > 0 && !wait_child(pids[i], &commands[i].status)) {
+            commands[i].status = -1;
+        }
+        if (commands[i].status == -1 || !exited_ok(commands[i].status)) {
+            success = false;
+        }
+    }
+
+    free(fds);
+    free(pids);
+    return success;
 }
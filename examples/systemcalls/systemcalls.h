@@ -7,3 +7,17 @@ bool do_system(const char *command);
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/**
+ * One command of do_exec_batch()
+ */
+struct exec_command {
+    // Full path of the command followed by its arguments, NULL terminated
+    char *const *argv;
+    // File stdout is redirected to, NULL to keep the caller's
+    const char *outputfile;
+    // Set to the waitpid() status of the command, -1 if it did not run
+    int status;
+};
+
+bool do_exec_batch(struct exec_command *commands, size_t count);
@@ -0,0 +1,128 @@
+/**
+ * @file aesd-stats.c
+ * @brief Per-CPU performance counters of the aesdchar device
+ *
+ * Counters are only ever added to on the local CPU, so the read and write
+ * paths share no cacheline for them; debugfs sums them over all CPUs when
+ * aesdchar/stats is read.  Writing 1 to aesdchar/timing also accumulates
+ * the time spent waiting for the device lock and in offset lookups.
+ */
+
+#include <linux/kernel.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/cdev.h>
+#include "aesdchar.h"
+#include "aesd-stats.h"
+
+DEFINE_STATIC_KEY_FALSE(aesd_stats_timing);
+
+static const char *const aesd_stat_names[AESD_STAT_COUNT] = {
+    [AESD_STAT_WRITES] = "writes",
+    [AESD_STAT_BYTES_WRITTEN] = "bytes_written",
+    [AESD_STAT_COMMANDS] = "commands",
+    [AESD_STAT_READS] = "reads",
+    [AESD_STAT_BYTES_READ] = "bytes_read",
+    [AESD_STAT_EVICTIONS] = "evictions",
+    [AESD_STAT_EVICTED_BYTES] = "evicted_bytes",
+    [AESD_STAT_ALLOC_FAILURES] = "alloc_failures",
+    [AESD_STAT_LOCK_CONTENDED] = "lock_contended",
+    [AESD_STAT_LOCK_WAIT_NS] = "lock_wait_ns",
+    [AESD_STAT_LOOKUPS] = "lookups",
+    [AESD_STAT_LOOKUP_NS] = "lookup_ns",
+};
+
+static int aesd_stats_show(struct seq_file *m, void *v)
+{
+    struct aesd_dev *dev = m->private;
+    u64 totals[AESD_STAT_COUNT] = { 0 };
+    int cpu, i;
+
+    for_each_possible_cpu(cpu) {
+        struct aesd_stats *stats = per_cpu_ptr(dev->stats, cpu);
+        for (i = 0; i < AESD_STAT_COUNT; i++) {
+            totals[i] += READ_ONCE(stats->counter[i]);
+        }
+    }
+    for (i = 0; i < AESD_STAT_COUNT; i++) {
+        seq_printf(m, "%s %llu\n", aesd_stat_names[i], totals[i]);
+    }
+
+    // Gauges, read without the lock so looking never slows the device down
+    seq_printf(m, "partial_bytes %zu\n", READ_ONCE(dev->partial_write_size));
+    seq_printf(m, "entries %zu\n", aesd_circular_buffer_entries(&dev->circular_buffer));
+    seq_printf(m, "bytes %zu\n", aesd_circular_buffer_bytes(&dev->circular_buffer));
+    return 0;
+}
+
+static int aesd_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, aesd_stats_show, inode->i_private);
+}
+
+static const struct file_operations aesd_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = aesd_stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static ssize_t aesd_timing_read(struct file *file, char __user *buf, size_t count,
+            loff_t *ppos)
+{
+    char value[2] = { aesd_stats_timed() ? '1' : '0', '\n' };
+
+    return simple_read_from_buffer(buf, count, ppos, value, sizeof(value));
+}
+
+static ssize_t aesd_timing_write(struct file *file, const char __user *buf, size_t count,
+            loff_t *ppos)
+{
+    bool enable;
+    int result = kstrtobool_from_user(buf, count, &enable);
+
+    if (result) {
+        return result;
+    }
+    if (enable) {
+        static_branch_enable(&aesd_stats_timing);
+    } else {
+        static_branch_disable(&aesd_stats_timing);
+    }
+    return count;
+}
+
+static const struct file_operations aesd_timing_fops = {
+    .owner = THIS_MODULE,
+    .read = aesd_timing_read,
+    .write = aesd_timing_write,
+    .llseek = default_llseek,
+};
+
+/**
+ * Allocate the counters of @param dev and publish them in debugfs.  Without
+ * debugfs the counters are still kept, only not shown.
+ */
+int aesd_stats_init(struct aesd_dev *dev)
+{
+    dev->stats = alloc_percpu(struct aesd_stats);
+    if (dev->stats == NULL) {
+        return -ENOMEM;
+    }
+
+    dev->debugfs = debugfs_create_dir("aesdchar", NULL);
+    debugfs_create_file("stats", 0444, dev->debugfs, dev, &aesd_stats_fops);
+    debugfs_create_file("timing", 0644, dev->debugfs, NULL, &aesd_timing_fops);
+    return 0;
+}
+
+void aesd_stats_free(struct aesd_dev *dev)
+{
+    debugfs_remove_recursive(dev->debugfs);
+    dev->debugfs = NULL;
+    static_branch_disable(&aesd_stats_timing);
+    free_percpu(dev->stats);
+    dev->stats = NULL;
+}
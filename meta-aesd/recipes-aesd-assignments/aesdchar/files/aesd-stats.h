@@ -0,0 +1,57 @@
+/*
+ * aesd-stats.h
+ *
+ * Per-CPU performance counters of the aesdchar device, shown in debugfs
+ */
+
+#ifndef AESD_CHAR_DRIVER_AESD_STATS_H_
+#define AESD_CHAR_DRIVER_AESD_STATS_H_
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/jump_label.h>
+
+struct aesd_dev;
+
+enum aesd_stat {
+    AESD_STAT_WRITES,           /* write() calls */
+    AESD_STAT_BYTES_WRITTEN,
+    AESD_STAT_COMMANDS,         /* complete commands stored */
+    AESD_STAT_READS,            /* read() calls */
+    AESD_STAT_BYTES_READ,
+    AESD_STAT_EVICTIONS,        /* commands dropped for newer ones */
+    AESD_STAT_EVICTED_BYTES,
+    AESD_STAT_ALLOC_FAILURES,
+    AESD_STAT_LOCK_CONTENDED,   /* dev->lock acquisitions that had to wait */
+    AESD_STAT_LOCK_WAIT_NS,     /* time spent waiting for them, with timing on */
+    AESD_STAT_LOOKUPS,          /* circular buffer offset lookups */
+    AESD_STAT_LOOKUP_NS,        /* time spent in them, with timing on */
+    AESD_STAT_COUNT
+};
+
+struct aesd_stats {
+    u64 counter[AESD_STAT_COUNT];
+};
+
+/*
+ * Timing costs a clock read per event, so it is behind a static key that
+ * debugfs "timing" switches
+ */
+DECLARE_STATIC_KEY_FALSE(aesd_stats_timing);
+
+static inline bool aesd_stats_timed(void)
+{
+    return static_branch_unlikely(&aesd_stats_timing);
+}
+
+static inline void aesd_stat_add(struct aesd_stats __percpu *stats, enum aesd_stat stat,
+            u64 value)
+{
+    this_cpu_add(stats->counter[stat], value);
+}
+
+int aesd_stats_init(struct aesd_dev *dev);
+
+void aesd_stats_free(struct aesd_dev *dev);
+
+#endif /* AESD_CHAR_DRIVER_AESD_STATS_H_ */
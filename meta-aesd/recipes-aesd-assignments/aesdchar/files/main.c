@@ -18,10 +18,26 @@
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h> // kmalloc, kfree
-#include <linux/uaccess.h> // copy_from_user, copy_to_user
+#include <linux/mm.h> // kvcalloc, kvfree
+#include <linux/uaccess.h> // copy_from_user
+#include <linux/uio.h> // iov_iter, copy_to_iter
+#include <linux/splice.h> // copy_splice_read
 #include <linux/mutex.h> // mutex
+#include <linux/seqlock.h> // seqcount_mutex_t
+#include <linux/srcu.h> // srcu_read_lock, call_srcu
+#include <linux/wait.h> // wait_event_interruptible
+#include <linux/poll.h> // poll_wait
+#include <linux/version.h>
+#include <linux/sched/clock.h> // local_clock
+#include <linux/moduleparam.h>
 #include "aesdchar.h"
 #include "aesd-circular-buffer.h"
+#include "aesd-mirror.h"
+#include "aesd_ioctl.h"
+#include "aesd-stats.h"
+
+#define CREATE_TRACE_POINTS
+#include "aesd-trace.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
@@ -30,13 +46,249 @@ MODULE_LICENSE("Dual BSD/GPL");
 
 struct aesd_dev aesd_device;
 
+/**
+ * Number of write commands the device keeps, oldest evicted first
+ */
+static unsigned int max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(max_entries, uint, 0444);
+MODULE_PARM_DESC(max_entries, "Number of write commands kept (default 10)");
+
+/**
+ * Optional cap on the bytes held by all commands together, 0 for none.  The
+ * newest command is always kept, even if it is larger on its own.
+ */
+static unsigned long max_bytes;
+module_param(max_bytes, ulong, 0444);
+MODULE_PARM_DESC(max_bytes, "Evict old commands beyond this many bytes (default 0, no limit)");
+
+/**
+ * Size of the ring mirroring command payloads for mmap() readers, 0 to
+ * disable mmap() (see aesd_mmap.h)
+ */
+static unsigned long mmap_size;
+module_param(mmap_size, ulong, 0444);
+MODULE_PARM_DESC(mmap_size, "Bytes of command data exported through mmap (default 0, disabled)");
+
+/**
+ * Read without taking dev->lock: readers snapshot the entry they need under
+ * dev->seq and copy from it inside an SRCU read section, which keeps evicted
+ * commands alive until they are done.  Clearing it makes reads take the
+ * mutex again, for comparison; it can be changed at any time.
+ */
+static bool lockless_reads = true;
+module_param(lockless_reads, bool, 0644);
+MODULE_PARM_DESC(lockless_reads, "Read without the device mutex (default 1)");
+
+/**
+ * Command buffers come from dedicated slab caches in a few size classes, or
+ * from kmalloc() beyond the largest one.  A header in front of the data
+ * records where the buffer came from and how much it can hold, so an entry
+ * handed to the circular buffer can be freed from its buffptr alone.
+ */
+struct aesd_buf_header {
+    size_t capacity;    /* bytes of data after the header */
+    int size_class;     /* index into aesd_buf_caches, -1 for kmalloc */
+    struct rcu_head rcu; /* for freeing after lockless readers are done */
+};
+
+#define AESD_BUF_CLASSES 4
+static const size_t aesd_buf_class_sizes[AESD_BUF_CLASSES] = { 64, 256, 1024, 4096 };
+static const char *const aesd_buf_class_names[AESD_BUF_CLASSES] = {
+    "aesdchar-64", "aesdchar-256", "aesdchar-1024", "aesdchar-4096",
+};
+static struct kmem_cache *aesd_buf_caches[AESD_BUF_CLASSES];
+
+static struct aesd_buf_header *aesd_buf_header(const char *data)
+{
+    return (struct aesd_buf_header *)data - 1;
+}
+
+static size_t aesd_buf_capacity(const char *data)
+{
+    return data != NULL ? aesd_buf_header(data)->capacity : 0;
+}
+
+/**
+ * @return a buffer for at least @param capacity bytes of data, NULL if out of memory
+ */
+static char *aesd_buf_alloc(size_t capacity)
+{
+    struct aesd_buf_header *header = NULL;
+    size_t size = sizeof(*header) + capacity;
+    int size_class;
+
+    for (size_class = 0; size_class < AESD_BUF_CLASSES; size_class++) {
+        if (size <= aesd_buf_class_sizes[size_class]) {
+            header = kmem_cache_alloc(aesd_buf_caches[size_class], GFP_KERNEL);
+            size = aesd_buf_class_sizes[size_class];
+            break;
+        }
+    }
+    if (size_class == AESD_BUF_CLASSES) {
+        size_class = -1;
+        header = kmalloc(size, GFP_KERNEL);
+    }
+    if (header == NULL) {
+        return NULL;
+    }
+    header->capacity = size - sizeof(*header);
+    header->size_class = size_class;
+    return (char *)(header + 1);
+}
+
+static void aesd_buf_free(const char *data)
+{
+    struct aesd_buf_header *header;
+
+    if (data == NULL) {
+        return;
+    }
+    header = aesd_buf_header(data);
+    if (header->size_class < 0) {
+        kfree(header);
+    } else {
+        kmem_cache_free(aesd_buf_caches[header->size_class], header);
+    }
+}
+
+static void aesd_buf_free_rcu(struct rcu_head *rcu)
+{
+    struct aesd_buf_header *header = container_of(rcu, struct aesd_buf_header, rcu);
+
+    aesd_buf_free((const char *)(header + 1));
+}
+
+/**
+ * Free @param data once every lockless reader of @param dev that might still
+ * see it has left its read section
+ */
+static void aesd_buf_free_deferred(struct aesd_dev *dev, const char *data)
+{
+    if (data == NULL) {
+        return;
+    }
+    call_srcu(&dev->srcu, &aesd_buf_header(data)->rcu, aesd_buf_free_rcu);
+}
+
+/**
+ * Make @param data (NULL for none) hold at least @param needed bytes, keeping the
+ * first @param used.  Capacity at least doubles so a command written in small pieces
+ * is copied a constant number of times per byte on average.
+ * @return the possibly moved buffer, NULL if out of memory (data is left untouched)
+ */
+static char *aesd_buf_grow(char *data, size_t used, size_t needed)
+{
+    size_t capacity = aesd_buf_capacity(data);
+    struct aesd_buf_header *header;
+    char *grown;
+
+    if (needed <= capacity) {
+        return data;
+    }
+    if (needed < 2 * capacity) {
+        needed = 2 * capacity;
+    }
+
+    if (data != NULL && aesd_buf_header(data)->size_class < 0) {
+        // Already past the slab classes: let krealloc() extend in place when it can
+        header = krealloc(aesd_buf_header(data), sizeof(*header) + needed, GFP_KERNEL);
+        if (header == NULL) {
+            return NULL;
+        }
+        header->capacity = needed;
+        return (char *)(header + 1);
+    }
+
+    grown = aesd_buf_alloc(needed);
+    if (grown == NULL) {
+        return NULL;
+    }
+    if (used > 0) {
+        memcpy(grown, data, used);
+    }
+    aesd_buf_free(data);
+    return grown;
+}
+
+static void aesd_buf_caches_destroy(void)
+{
+    int i;
+
+    for (i = 0; i < AESD_BUF_CLASSES; i++) {
+        kmem_cache_destroy(aesd_buf_caches[i]);
+        aesd_buf_caches[i] = NULL;
+    }
+}
+
+static int aesd_buf_caches_create(void)
+{
+    int i;
+
+    for (i = 0; i < AESD_BUF_CLASSES; i++) {
+        aesd_buf_caches[i] = kmem_cache_create(aesd_buf_class_names[i], aesd_buf_class_sizes[i],
+                                               0, 0, NULL);
+        if (aesd_buf_caches[i] == NULL) {
+            aesd_buf_caches_destroy();
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+/**
+ * mutex_lock_interruptible() on dev->lock, counting the acquisitions that wait
+ */
+static int aesd_lock(struct aesd_dev *dev)
+{
+    u64 start;
+    int result;
+    
+    if (mutex_trylock(&dev->lock)) {
+        return 0;
+    }
+    aesd_stat_add(dev->stats, AESD_STAT_LOCK_CONTENDED, 1);
+    if (!aesd_stats_timed()) {
+        return mutex_lock_interruptible(&dev->lock);
+    }
+    start = local_clock();
+    result = mutex_lock_interruptible(&dev->lock);
+    aesd_stat_add(dev->stats, AESD_STAT_LOCK_WAIT_NS, local_clock() - start);
+    return result;
+}
+
+/**
+ * aesd_circular_buffer_find_entry_hinted() on @param dev, counted.  @param hint
+ * belongs to the reader, so lookups never write to the device.
+ */
+static struct aesd_buffer_entry *aesd_find_entry(struct aesd_dev *dev, size_t char_offset,
+                size_t *entry_offset_byte, size_t *hint)
+{
+    struct aesd_buffer_entry *entry;
+    u64 start;
+    
+    aesd_stat_add(dev->stats, AESD_STAT_LOOKUPS, 1);
+    if (!aesd_stats_timed()) {
+        return aesd_circular_buffer_find_entry_hinted(&dev->circular_buffer,
+                    char_offset, entry_offset_byte, hint);
+    }
+    start = local_clock();
+    entry = aesd_circular_buffer_find_entry_hinted(&dev->circular_buffer,
+                char_offset, entry_offset_byte, hint);
+    aesd_stat_add(dev->stats, AESD_STAT_LOOKUP_NS, local_clock() - start);
+    return entry;
+}
+
 int aesd_open(struct inode *inode, struct file *filp)
 {
-    struct aesd_dev *dev;
+    struct aesd_file *file;
     PDEBUG("open");
     
-    dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-    filp->private_data = dev;
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (file == NULL) {
+        return -ENOMEM;
+    }
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    filp->private_data = file;
     
     return 0;
 }
@@ -44,176 +296,446 @@ int aesd_open(struct inode *inode, struct file *filp)
 int aesd_release(struct inode *inode, struct file *filp)
 {
     PDEBUG("release");
+    kfree(filp->private_data);
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
+/**
+ * @return the offset in @param buffer of the stream position *stream_pos of a
+ * following reader, moving *stream_pos to the oldest entry if what it points at
+ * has been evicted
+ */
+static loff_t aesd_follow_offset(const struct aesd_circular_buffer *buffer,
+                size_t *stream_pos)
+{
+    size_t bytes = aesd_circular_buffer_bytes(buffer);
+    size_t start = buffer->end_offset - bytes;
+    size_t offset = *stream_pos - start;
+    
+    if (offset > bytes) {
+        *stream_pos = start;
+        offset = 0;
+    }
+    return offset;
+}
+
+/**
+ * @return true once a following reader of @param file has data to read
+ */
+static bool aesd_follow_readable(struct aesd_dev *dev, struct aesd_file *file)
+{
+    return READ_ONCE(dev->circular_buffer.end_offset) != READ_ONCE(file->stream_pos);
+}
+
+/**
+ * Fill @param to from the entries at *f_pos, holding dev->lock
+ */
+static ssize_t aesd_read_locked(struct aesd_file *file, struct iov_iter *to, size_t count,
                 loff_t *f_pos)
 {
+    struct aesd_dev *dev = file->dev;
     ssize_t retval = 0;
-    struct aesd_dev *dev = filp->private_data;
     struct aesd_buffer_entry *entry = NULL;
     size_t entry_offset_byte = 0;
     size_t bytes_to_read;
+    size_t copied;
     
-    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
-    
-    if (dev == NULL || buf == NULL) {
-        return -EFAULT;
+    if (aesd_lock(dev)) {
+        return -ERESTARTSYS;
     }
     
-    if (mutex_lock_interruptible(&dev->lock)) {
-        return -ERESTARTSYS;
+    // Fill the user buffer from as many consecutive entries as fit
+    while ((size_t)retval < count) {
+        if (file->follow) {
+            *f_pos = aesd_follow_offset(&dev->circular_buffer, &file->stream_pos);
+        }
+        
+        // Find the entry corresponding to the file position; after the first one this
+        // hits the sequential fast path of the lookup
+        entry = aesd_find_entry(dev, *f_pos, &entry_offset_byte, &file->last_index);
+        if (entry == NULL || entry->buffptr == NULL) {
+            break; // EOF
+        }
+        
+        // Calculate how many bytes we can read from this entry
+        bytes_to_read = entry->size - entry_offset_byte;
+        if (bytes_to_read > count - retval) {
+            bytes_to_read = count - retval;
+        }
+        
+        // Copy data to user space, or to the pipe pages of a splice
+        copied = copy_to_iter(entry->buffptr + entry_offset_byte, bytes_to_read, to);
+        *f_pos += copied;
+        file->stream_pos += copied;
+        retval += copied;
+        if (copied < bytes_to_read) {
+            if (retval == 0) {
+                retval = -EFAULT;
+            }
+            break;
+        }
     }
     
-    // Find the entry corresponding to the file position
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->circular_buffer, *f_pos, &entry_offset_byte);
+    mutex_unlock(&dev->lock);
+    return retval;
+}
+
+/**
+ * Fill @param to from the entries at *f_pos without dev->lock.  Each lookup is
+ * retried until no writer ran during it; the command it found stays allocated
+ * until srcu_read_unlock(), even if a writer evicts it meanwhile, so it can be
+ * copied (and fault) outside the seqcount section.
+ */
+static ssize_t aesd_read_lockless(struct aesd_file *file, struct iov_iter *to, size_t count,
+                loff_t *f_pos)
+{
+    struct aesd_dev *dev = file->dev;
+    ssize_t retval = 0;
+    struct aesd_buffer_entry *entry;
+    const char *buffptr;
+    size_t size;
+    size_t stream_pos = file->stream_pos;
+    // Concurrent reads of one file may race on the hint, any value is safe
+    size_t hint = READ_ONCE(file->last_index);
+    size_t entry_offset_byte = 0;
+    size_t bytes_to_read;
+    size_t copied;
+    unsigned int seq;
+    int idx;
     
-    if (entry == NULL || entry->buffptr == NULL) {
-        mutex_unlock(&dev->lock);
-        return 0; // EOF
-    }
+    idx = srcu_read_lock(&dev->srcu);
     
-    // Calculate how many bytes we can read from this entry
-    bytes_to_read = entry->size - entry_offset_byte;
-    if (bytes_to_read > count) {
-        bytes_to_read = count;
+    while ((size_t)retval < count) {
+        do {
+            seq = read_seqcount_begin(&dev->seq);
+            if (file->follow) {
+                stream_pos = file->stream_pos;
+                *f_pos = aesd_follow_offset(&dev->circular_buffer, &stream_pos);
+            }
+            entry = aesd_find_entry(dev, *f_pos, &entry_offset_byte, &hint);
+            buffptr = entry != NULL ? READ_ONCE(entry->buffptr) : NULL;
+            size = entry != NULL ? READ_ONCE(entry->size) : 0;
+        } while (read_seqcount_retry(&dev->seq, seq));
+        
+        if (buffptr == NULL) {
+            break; // EOF
+        }
+        
+        bytes_to_read = size - entry_offset_byte;
+        if (bytes_to_read > count - retval) {
+            bytes_to_read = count - retval;
+        }
+        
+        copied = copy_to_iter(buffptr + entry_offset_byte, bytes_to_read, to);
+        *f_pos += copied;
+        stream_pos += copied;
+        file->stream_pos = stream_pos;
+        retval += copied;
+        if (copied < bytes_to_read) {
+            if (retval == 0) {
+                retval = -EFAULT;
+            }
+            break;
+        }
     }
     
-    // Copy data to user space
-    if (copy_to_user(buf, entry->buffptr + entry_offset_byte, bytes_to_read)) {
-        mutex_unlock(&dev->lock);
+    srcu_read_unlock(&dev->srcu, idx);
+    WRITE_ONCE(file->last_index, hint);
+    return retval;
+}
+
+/**
+ * read() and, through aesd_splice_read(), splice() and sendfile(): the
+ * entries are copied straight into the pipe pages, which the socket then
+ * sends without another pass through user space
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *filp = iocb->ki_filp;
+    struct aesd_file *file = filp->private_data;
+    loff_t *f_pos = &iocb->ki_pos;
+    loff_t pos = *f_pos;
+    size_t count = iov_iter_count(to);
+    ssize_t retval;
+    
+    if (file == NULL) {
         return -EFAULT;
     }
     
-    *f_pos += bytes_to_read;
-    retval = bytes_to_read;
+    if (count == 0) {
+        return 0;
+    }
+    
+    for (;;) {
+        if (READ_ONCE(lockless_reads)) {
+            retval = aesd_read_lockless(file, to, count, f_pos);
+        } else {
+            retval = aesd_read_locked(file, to, count, f_pos);
+        }
+        if (retval != 0 || !file->follow) {
+            break;
+        }
+        
+        // Following and at the end: wait for the next command
+        if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) {
+            retval = -EAGAIN;
+            break;
+        }
+        if (wait_event_interruptible(file->dev->wait, aesd_follow_readable(file->dev, file))) {
+            retval = -ERESTARTSYS;
+            break;
+        }
+    }
     
-    mutex_unlock(&dev->lock);
+    aesd_stat_add(file->dev->stats, AESD_STAT_READS, 1);
+    if (retval > 0) {
+        aesd_stat_add(file->dev->stats, AESD_STAT_BYTES_READ, retval);
+    }
+    trace_aesdchar_read(count, pos, retval);
     return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+__poll_t aesd_poll(struct file *filp, poll_table *wait)
 {
-    ssize_t retval = 0;
-    struct aesd_dev *dev = filp->private_data;
-    char *write_buffer = NULL;
-    char *newline_pos = NULL;
-    size_t total_size;
-    struct aesd_buffer_entry entry;
-    struct aesd_buffer_entry *old_entry;
+    struct aesd_file *file = filp->private_data;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
     
-    PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
+    poll_wait(filp, &file->dev->wait, wait);
     
-    if (dev == NULL || buf == NULL) {
-        return -EFAULT;
+    // Without follow a read never blocks, at the end it returns 0
+    if (!READ_ONCE(file->follow) || aesd_follow_readable(file->dev, file)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
     }
+    return mask;
+}
+
+long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    size_t bytes;
+    __u32 follow;
     
-    if (count == 0) {
-        return 0;
+    PDEBUG("ioctl %u", cmd);
+    
+    if (_IOC_TYPE(cmd) != AESD_IOC_MAGIC || _IOC_NR(cmd) > AESDCHAR_IOC_MAXNR) {
+        return -ENOTTY;
+    }
+    
+    switch (cmd) {
+        case AESDCHAR_IOCFOLLOW:
+            if (get_user(follow, (__u32 __user *)arg)) {
+                return -EFAULT;
+            }
+            if (aesd_lock(dev)) {
+                return -ERESTARTSYS;
+            }
+            if (follow && !file->follow) {
+                // Start at the current position, or the end if it is past it
+                bytes = aesd_circular_buffer_bytes(&dev->circular_buffer);
+                file->stream_pos = dev->circular_buffer.end_offset - bytes +
+                        min_t(size_t, filp->f_pos, bytes);
+            }
+            WRITE_ONCE(file->follow, follow != 0);
+            mutex_unlock(&dev->lock);
+            return 0;
+        default:
+            return -ENOTTY;
     }
+}
+
+/**
+ * Release the command @param buffptr of @param size bytes evicted from @param dev
+ */
+static void aesd_evict_command(struct aesd_dev *dev, const char *buffptr, size_t size)
+{
+    if (buffptr == NULL) {
+        return;
+    }
+    aesd_stat_add(dev->stats, AESD_STAT_EVICTIONS, 1);
+    aesd_stat_add(dev->stats, AESD_STAT_EVICTED_BYTES, size);
+    trace_aesdchar_evict(size);
+    aesd_buf_free_deferred(dev, buffptr);
+}
+
+/**
+ * Add the command @param buffptr of @param size bytes to the circular buffer of
+ * @param dev, freeing whatever it evicts once lockless readers are done with it.
+ * Caller holds dev->lock.
+ */
+static void aesd_add_command(struct aesd_dev *dev, const char *buffptr, size_t size)
+{
+    struct aesd_circular_buffer *buffer = &dev->circular_buffer;
+    struct aesd_buffer_entry entry;
+    size_t oldest_size;
+    
+    entry.buffptr = buffptr;
+    entry.size = size;
+    
+    write_seqcount_begin(&dev->seq);
+    
+    // Add entry to circular buffer, freeing the one it replaces when full
+    oldest_size = buffer->entry[buffer->out_offs].size;
+    aesd_evict_command(dev, aesd_circular_buffer_add_entry(buffer, &entry), oldest_size);
+    
+    // Then keep within the byte budget, if any
+    while (max_bytes != 0 && aesd_circular_buffer_entries(buffer) > 1 &&
+           aesd_circular_buffer_bytes(buffer) > max_bytes) {
+        oldest_size = buffer->entry[buffer->out_offs].size;
+        aesd_evict_command(dev, aesd_circular_buffer_remove_oldest(buffer), oldest_size);
+    }
+    
+    write_seqcount_end(&dev->seq);
+    aesd_stat_add(dev->stats, AESD_STAT_COMMANDS, 1);
+    
+    aesd_mirror_add(&dev->mirror, buffptr, size,
+                    aesd_circular_buffer_entries(&dev->circular_buffer));
+}
+
+/**
+ * Append @param count bytes at @param buf to the commands of @param dev
+ */
+static ssize_t aesd_write_commands(struct aesd_dev *dev, const char __user *buf, size_t count)
+{
+    ssize_t retval = 0;
+    char *partial;
+    char *newline_pos = NULL;
+    size_t used, end, start, scan;
     
-    if (mutex_lock_interruptible(&dev->lock)) {
+    if (aesd_lock(dev)) {
         return -ERESTARTSYS;
     }
     
-    // Allocate buffer for the write data
-    write_buffer = kmalloc(count, GFP_KERNEL);
-    if (write_buffer == NULL) {
+    // Make room after the unterminated command so far
+    used = dev->partial_write_size;
+    end = used + count;
+    partial = aesd_buf_grow(dev->partial_write_buffer, used, end);
+    if (partial == NULL) {
+        aesd_stat_add(dev->stats, AESD_STAT_ALLOC_FAILURES, 1);
         mutex_unlock(&dev->lock);
         return -ENOMEM;
     }
+    dev->partial_write_buffer = partial;
     
-    // Copy data from user space
-    if (copy_from_user(write_buffer, buf, count)) {
-        kfree(write_buffer);
+    // Copy data from user space straight behind it, the only copy from user space
+    if (copy_from_user(partial + used, buf, count)) {
         mutex_unlock(&dev->lock);
         return -EFAULT;
     }
     
-    // Check for newline character
-    newline_pos = memchr(write_buffer, '\n', count);
-    
-    if (newline_pos != NULL) {
-        // Found newline - complete command
-        size_t newline_offset = newline_pos - write_buffer;
-        total_size = dev->partial_write_size + newline_offset + 1; // +1 for newline
-        
-        // Allocate buffer for complete command
-        char *complete_buffer = kmalloc(total_size, GFP_KERNEL);
-        if (complete_buffer == NULL) {
-            kfree(write_buffer);
-            mutex_unlock(&dev->lock);
-            return -ENOMEM;
-        }
-        
-        // Copy partial write if exists
-        if (dev->partial_write_buffer != NULL && dev->partial_write_size > 0) {
-            memcpy(complete_buffer, dev->partial_write_buffer, dev->partial_write_size);
-        }
-        
-        // Copy new data including newline
-        memcpy(complete_buffer + dev->partial_write_size, write_buffer, newline_offset + 1);
+    // Commit every complete command under this one lock hold; the old partial
+    // data is known to hold no newline
+    start = 0;
+    scan = used;
+    while ((newline_pos = memchr(partial + scan, '\n', end - scan)) != NULL) {
+        size_t size = newline_pos - (partial + start) + 1; // +1 for newline
+        char *command;
         
-        // Free partial write buffer
-        if (dev->partial_write_buffer != NULL) {
-            kfree(dev->partial_write_buffer);
+        if (start == 0 && size == end) {
+            // The common single command write: the buffer itself becomes the entry
+            command = partial;
             dev->partial_write_buffer = NULL;
-            dev->partial_write_size = 0;
-        }
-        
-        // Prepare entry for circular buffer
-        entry.buffptr = complete_buffer;
-        entry.size = total_size;
-        
-        // Check if we need to free old entry when buffer is full
-        // The entry at in_offs will be overwritten when buffer is full
-        if (dev->circular_buffer.full) {
-            old_entry = &dev->circular_buffer.entry[dev->circular_buffer.in_offs];
-            if (old_entry->buffptr != NULL) {
-                kfree((void *)old_entry->buffptr);
+        } else {
+            // One of several: give it a buffer of its own size
+            command = aesd_buf_alloc(size);
+            if (command == NULL) {
+                aesd_stat_add(dev->stats, AESD_STAT_ALLOC_FAILURES, 1);
+                break;
             }
+            memcpy(command, partial + start, size);
         }
-        
-        // Add entry to circular buffer
-        aesd_circular_buffer_add_entry(&dev->circular_buffer, &entry);
-        
-        retval = newline_offset + 1;
-        kfree(write_buffer);
-    } else {
-        // No newline - append to partial write
-        size_t new_partial_size = dev->partial_write_size + count;
-        char *new_partial_buffer = kmalloc(new_partial_size, GFP_KERNEL);
-        if (new_partial_buffer == NULL) {
-            kfree(write_buffer);
+        aesd_add_command(dev, command, size);
+        start += size;
+        scan = start;
+    }
+    
+    if (start == 0) {
+        if (newline_pos != NULL) {
+            // Not even the first command could be stored
             mutex_unlock(&dev->lock);
             return -ENOMEM;
         }
-        
-        // Copy existing partial write if exists
-        if (dev->partial_write_buffer != NULL && dev->partial_write_size > 0) {
-            memcpy(new_partial_buffer, dev->partial_write_buffer, dev->partial_write_size);
-            kfree(dev->partial_write_buffer);
+        // No newline - keep it all as partial write
+        dev->partial_write_size = end;
+        retval = count;
+    } else if (start == end || newline_pos == NULL) {
+        // Keep only the trailing fragment as partial write
+        if (dev->partial_write_buffer != NULL) {
+            memmove(partial, partial + start, end - start);
         }
-        
-        // Append new data
-        memcpy(new_partial_buffer + dev->partial_write_size, write_buffer, count);
-        
-        dev->partial_write_buffer = new_partial_buffer;
-        dev->partial_write_size = new_partial_size;
-        
+        dev->partial_write_size = end - start;
         retval = count;
-        kfree(write_buffer);
+    } else {
+        // Out of memory part way: report what was stored, userspace writes the rest again
+        dev->partial_write_size = 0;
+        retval = start - used;
     }
     
     mutex_unlock(&dev->lock);
+    
+    // Wake readers following the stream
+    if (start > 0) {
+        wake_up_interruptible_poll(&dev->wait, EPOLLIN | EPOLLRDNORM);
+    }
     return retval;
 }
+
+ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+    ssize_t retval;
+    
+    if (dev == NULL || buf == NULL) {
+        return -EFAULT;
+    }
+    
+    if (count == 0) {
+        return 0;
+    }
+    
+    retval = aesd_write_commands(dev, buf, count);
+    
+    aesd_stat_add(dev->stats, AESD_STAT_WRITES, 1);
+    if (retval > 0) {
+        aesd_stat_add(dev->stats, AESD_STAT_BYTES_WRITTEN, retval);
+    }
+    trace_aesdchar_write(count, *f_pos, retval);
+    return retval;
+}
+
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+    
+    PDEBUG("mmap %lu bytes at page %lu", vma->vm_end - vma->vm_start, vma->vm_pgoff);
+    
+    // The mirror is allocated once at load time, no locking needed to map it
+    return aesd_mirror_mmap(&dev->mirror, vma);
+}
+
+/*
+ * Without a splice_read the kernel refuses to splice from the device
+ * (since 5.10, earlier it bounced it through a kernel read()).  It fills
+ * pipe pages through aesd_read_iter(); the helper was renamed in 6.5.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define aesd_splice_read copy_splice_read
+#else
+#define aesd_splice_read generic_file_splice_read
+#endif
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
-    .read =     aesd_read,
+    .read_iter = aesd_read_iter,
+    .splice_read = aesd_splice_read,
     .write =    aesd_write,
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
+    .unlocked_ioctl = aesd_unlocked_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+    .compat_ioctl = compat_ptr_ioctl,
+#endif
     .open =     aesd_open,
     .release =  aesd_release,
 };
@@ -238,32 +760,81 @@ int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
+    struct aesd_buffer_entry *entries;
+    size_t *entry_starts;
+    
+    if (max_entries == 0) {
+        printk(KERN_WARNING "aesdchar: max_entries must be at least 1\n");
+        return -EINVAL;
+    }
+    
+    result = aesd_buf_caches_create();
+    if (result) {
+        return result;
+    }
+    
     result = alloc_chrdev_region(&dev, aesd_minor, 1,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
+        aesd_buf_caches_destroy();
         return result;
     }
     memset(&aesd_device,0,sizeof(struct aesd_dev));
 
-    // Initialize circular buffer
-    aesd_circular_buffer_init(&aesd_device.circular_buffer);
+    // Initialize circular buffer with max_entries slots
+    entries = kvcalloc(max_entries, sizeof(*entries), GFP_KERNEL);
+    entry_starts = kvcalloc(max_entries, sizeof(*entry_starts), GFP_KERNEL);
+    if (entries == NULL || entry_starts == NULL) {
+        result = -ENOMEM;
+        goto fail_entries;
+    }
+    aesd_circular_buffer_init_storage(&aesd_device.circular_buffer, entries, entry_starts,
+                                      max_entries);
+    
+    result = init_srcu_struct(&aesd_device.srcu);
+    if (result) {
+        goto fail_entries;
+    }
+    
+    result = aesd_mirror_init(&aesd_device.mirror, mmap_size, max_entries);
+    if (result) {
+        goto fail_srcu;
+    }
     
-    // Initialize mutex
+    result = aesd_stats_init(&aesd_device);
+    if (result) {
+        goto fail_mirror;
+    }
+    
+    // Initialize mutex, and the sequence count writers bump under it
     mutex_init(&aesd_device.lock);
+    seqcount_mutex_init(&aesd_device.seq, &aesd_device.lock);
+    init_waitqueue_head(&aesd_device.wait);
     
     // Initialize partial write buffer
     aesd_device.partial_write_buffer = NULL;
     aesd_device.partial_write_size = 0;
 
     result = aesd_setup_cdev(&aesd_device);
-
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
+    if (result) {
+        goto fail_stats;
     }
-    return result;
+    return 0;
 
+fail_stats:
+    aesd_stats_free(&aesd_device);
+fail_mirror:
+    aesd_mirror_free(&aesd_device.mirror);
+fail_srcu:
+    cleanup_srcu_struct(&aesd_device.srcu);
+fail_entries:
+    kvfree(entries);
+    kvfree(entry_starts);
+    unregister_chrdev_region(dev, 1);
+    aesd_buf_caches_destroy();
+    return result;
 }
 
 void aesd_cleanup_module(void)
@@ -277,24 +848,31 @@ void aesd_cleanup_module(void)
     
     // Free partial write buffer if exists
     if (aesd_device.partial_write_buffer != NULL) {
-        kfree(aesd_device.partial_write_buffer);
+        aesd_buf_free(aesd_device.partial_write_buffer);
         aesd_device.partial_write_buffer = NULL;
         aesd_device.partial_write_size = 0;
     }
     
-    // Free all circular buffer entries
-    uint8_t index;
+    // Free all circular buffer entries, then the entry arrays
+    size_t index;
     struct aesd_buffer_entry *entry;
     AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.circular_buffer, index) {
-        if (entry->buffptr != NULL) {
-            kfree((void *)entry->buffptr);
-        }
+        aesd_buf_free(entry->buffptr);
     }
+    kvfree(aesd_device.circular_buffer.entry);
+    kvfree(aesd_device.circular_buffer.entry_start);
+    aesd_mirror_free(&aesd_device.mirror);
     
     mutex_unlock(&aesd_device.lock);
     mutex_destroy(&aesd_device.lock);
+    
+    // Run the frees still deferred for readers before the caches go away
+    srcu_barrier(&aesd_device.srcu);
+    cleanup_srcu_struct(&aesd_device.srcu);
+    aesd_stats_free(&aesd_device);
 
     unregister_chrdev_region(devno, 1);
+    aesd_buf_caches_destroy();
 }
 
 
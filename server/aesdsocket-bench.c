@@ -0,0 +1,626 @@
+/**
+ * @file aesdsocket-bench.c
+ * @brief Load generator for aesdsocket
+ *
+ * Opens a number of connections spread over worker threads, each thread
+ * driving its connections with epoll.  Every connection sends numbered
+ * packets of a fixed size, keeping up to a pipelining depth of them
+ * outstanding and optionally pacing them at a fixed rate, and looks for
+ * each of its packets in the reply stream.  A packet counts as answered,
+ * and its latency is taken, when it first shows up in a reply; packets that
+ * never do are reported as missing.
+ *
+ * Replies are whole logs by default, so their size grows with the log; -D
+ * switches the connections to delta replies (see REPLY_CMD_PREFIX), where
+ * the reply stream is the log itself.  -z asks for gzip replies instead
+ * (the server needs -z), which are inflated before matching; the received
+ * rate is then what went over the wire.
+ *
+ * With a rate, latency is measured from when a packet was due rather than
+ * when it could be sent, so a slow server isn't hidden by the client
+ * falling behind its schedule.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+
+#define DEFAULT_PORT "9000"
+#define RECV_CHUNK (64 * 1024)
+#define MAX_EVENTS 64
+// Time allowed for outstanding replies once the run is over
+#define DRAIN_NS (5ull * 1000000000)
+
+#define DELTA_COMMAND "AESD_CMD:delta\n"
+#define GZIP_COMMAND "AESD_CMD:gzip\n"
+// windowBits making inflate expect gzip members
+#define GZIP_WINDOW_BITS (15 + 16)
+
+struct options {
+    const char *host;
+    const char *port;
+    int connections;
+    int threads;
+    size_t size;            // bytes per packet, newline included
+    double rate;            // packets per second per connection, 0 for no limit
+    int depth;              // packets outstanding per connection
+    long packets;           // per connection, 0 to run for duration instead
+    double duration;        // seconds
+    int delta;
+    int gzip;
+};
+
+struct conn {
+    int fd;
+    int id;
+    long sent;              // packets queued for sending
+    long answered;          // packets found in the reply stream
+    uint64_t *due;          // send time of packet i, at due[i % depth]
+    uint64_t next_due;      // when the next packet may be sent, with a rate
+    char *out;              // bytes still to send
+    size_t out_len;
+    size_t out_off;
+    char *in;               // received bytes not yet matched
+    size_t in_len;
+    size_t in_cap;
+    z_stream inflate;       // with -z, inflating the reply stream into in
+    char *raw;              // with -z, compressed bytes received
+    int closed;
+};
+
+struct worker {
+    pthread_t thread_id;
+    const struct options *opts;
+    struct conn *conns;
+    int nconns;
+    int first_id;
+    uint64_t *latencies;
+    size_t nlatencies;
+    size_t cap_latencies;
+    unsigned long long bytes_sent;
+    unsigned long long bytes_received;
+    long missing;
+    int errors;
+};
+
+static const struct addrinfo *g_addr;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * Write the packet @param seq of connection @param id, padded to @param size
+ * bytes, into @param buf.  The "<id>:<seq>:" prefix makes every packet of a
+ * run unique.
+ */
+static void make_packet(char *buf, size_t size, int id, long seq)
+{
+    int n = snprintf(buf, size, "b%d:%ld:", id, seq);
+    if (n < 0 || (size_t)n >= size) {
+        n = size - 1;
+    }
+    memset(buf + n, 'x', size - 1 - n);
+    buf[size - 1] = '\n';
+}
+
+/**
+ * @return whether the packet at @param p, whose prefix of @param prefix_len
+ * bytes matched, has the padding make_packet() gave it
+ */
+static int packet_padding_ok(const char *p, size_t prefix_len, size_t size)
+{
+    for (size_t i = prefix_len; i < size - 1; i++) {
+        if (p[i] != 'x') {
+            return 0;
+        }
+    }
+    return p[size - 1] == '\n';
+}
+
+static int record_latency(struct worker *w, uint64_t latency)
+{
+    if (w->nlatencies == w->cap_latencies) {
+        size_t cap = w->cap_latencies ? 2 * w->cap_latencies : 4096;
+        uint64_t *grown = realloc(w->latencies, cap * sizeof(uint64_t));
+        if (!grown) {
+            return -1;
+        }
+        w->latencies = grown;
+        w->cap_latencies = cap;
+    }
+    w->latencies[w->nlatencies++] = latency;
+    return 0;
+}
+
+static int conn_open(struct conn *c, const struct options *opts)
+{
+    c->fd = socket(g_addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->fd < 0 || connect(c->fd, g_addr->ai_addr, g_addr->ai_addrlen) < 0) {
+        perror("connect");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c->due = calloc(opts->depth, sizeof(uint64_t));
+    c->out = malloc(opts->depth * opts->size + sizeof(DELTA_COMMAND) + sizeof(GZIP_COMMAND));
+    c->in_cap = RECV_CHUNK + opts->size;
+    c->in = malloc(c->in_cap);
+    if (!c->due || !c->out || !c->in) {
+        perror("malloc");
+        return -1;
+    }
+
+    // The command is answered before any packet, its reply is skipped by
+    // the matching like any other data
+    if (opts->delta) {
+        memcpy(c->out, DELTA_COMMAND, strlen(DELTA_COMMAND));
+        c->out_len = strlen(DELTA_COMMAND);
+    }
+    if (opts->gzip) {
+        c->raw = malloc(RECV_CHUNK);
+        if (!c->raw || inflateInit2(&c->inflate, GZIP_WINDOW_BITS) != Z_OK) {
+            fprintf(stderr, "connection %d: can't set up inflate\n", c->id);
+            return -1;
+        }
+        memcpy(c->out + c->out_len, GZIP_COMMAND, strlen(GZIP_COMMAND));
+        c->out_len += strlen(GZIP_COMMAND);
+    }
+    return fcntl(c->fd, F_SETFL, O_NONBLOCK);
+}
+
+/**
+ * Queue every packet that may be sent now on @param c
+ */
+static void conn_fill(struct conn *c, const struct options *opts, uint64_t now, int sending)
+{
+    if (c->out_off > 0) {
+        memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+        c->out_len -= c->out_off;
+        c->out_off = 0;
+    }
+    while (sending && c->sent - c->answered < opts->depth &&
+           (opts->packets == 0 || c->sent < opts->packets)) {
+        if (opts->rate > 0) {
+            if (now < c->next_due) {
+                break;
+            }
+            c->due[c->sent % opts->depth] = c->next_due;
+            c->next_due += (uint64_t)(1e9 / opts->rate);
+        } else {
+            c->due[c->sent % opts->depth] = now;
+        }
+        make_packet(c->out + c->out_len, opts->size, c->id, c->sent);
+        c->out_len += opts->size;
+        c->sent++;
+    }
+}
+
+static int conn_flush(struct worker *w, struct conn *c)
+{
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("send");
+            return -1;
+        }
+        c->out_off += n;
+        w->bytes_sent += n;
+    }
+    return 0;
+}
+
+/**
+ * Match the packets awaiting a reply against the received bytes, in order
+ * Only the tail that could still hold the start of a packet is kept.
+ */
+static int conn_match(struct worker *w, struct conn *c, uint64_t now)
+{
+    const struct options *opts = w->opts;
+    char expected[64];
+    size_t start = 0;
+
+    while (c->answered < c->sent) {
+        // The prefix is unique to the packet, the terminating ':' keeps
+        // packet 1 from matching the start of packet 12
+        int n = snprintf(expected, sizeof(expected), "b%d:%ld:", c->id, c->answered);
+        char *found = memmem(c->in + start, c->in_len - start, expected, n);
+        if (found == NULL) {
+            break;
+        }
+        if (found + opts->size > c->in + c->in_len) {
+            // Wait for the whole packet before checking it
+            start = found - c->in;
+            goto compact;
+        }
+        if (!packet_padding_ok(found, n, opts->size)) {
+            fprintf(stderr, "connection %d: packet %ld corrupted in reply\n", c->id, c->answered);
+            w->errors++;
+            return -1;
+        }
+        if (record_latency(w, now - c->due[c->answered % opts->depth]) != 0) {
+            return -1;
+        }
+        c->answered++;
+        start = found + opts->size - c->in;
+    }
+
+    // Nothing before the last size - 1 bytes can start a packet we look for
+    if (c->in_len - start >= opts->size) {
+        start = c->in_len - (opts->size - 1);
+    }
+compact:
+    memmove(c->in, c->in + start, c->in_len - start);
+    c->in_len -= start;
+    return 0;
+}
+
+/**
+ * Make room for at least RECV_CHUNK more received bytes in @param c
+ */
+static int conn_reserve(struct conn *c)
+{
+    if (c->in_cap - c->in_len < RECV_CHUNK) {
+        size_t cap = c->in_len + RECV_CHUNK;
+        char *grown = realloc(c->in, cap);
+        if (!grown) {
+            perror("realloc");
+            return -1;
+        }
+        c->in = grown;
+        c->in_cap = cap;
+    }
+    return 0;
+}
+
+/**
+ * Inflate @param len compressed bytes of @param c's reply stream, one gzip
+ * member per reply, and match the packets in the result
+ */
+static int conn_inflate(struct worker *w, struct conn *c, size_t len)
+{
+    c->inflate.next_in = (Bytef *)c->raw;
+    c->inflate.avail_in = len;
+    while (c->inflate.avail_in > 0) {
+        if (conn_reserve(c) != 0) {
+            return -1;
+        }
+        c->inflate.next_out = (Bytef *)c->in + c->in_len;
+        c->inflate.avail_out = c->in_cap - c->in_len;
+        int result = inflate(&c->inflate, Z_NO_FLUSH);
+        c->in_len = (char *)c->inflate.next_out - c->in;
+        if (result == Z_STREAM_END) {
+            // The next reply starts a new member
+            inflateReset(&c->inflate);
+        } else if (result != Z_OK && result != Z_BUF_ERROR) {
+            fprintf(stderr, "connection %d: bad gzip reply: %s\n", c->id,
+                    c->inflate.msg ? c->inflate.msg : zError(result));
+            w->errors++;
+            return -1;
+        }
+        if (conn_match(w, c, now_ns()) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int conn_read(struct worker *w, struct conn *c)
+{
+    for (;;) {
+        if (w->opts->gzip) {
+            ssize_t n = recv(c->fd, c->raw, RECV_CHUNK, 0);
+            if (n == 0) {
+                c->closed = 1;
+                return 0;
+            }
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return 0;
+                }
+                perror("recv");
+                return -1;
+            }
+            w->bytes_received += n;
+            if (conn_inflate(w, c, n) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (conn_reserve(c) != 0) {
+            return -1;
+        }
+        ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+        if (n == 0) {
+            c->closed = 1;
+            return 0;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("recv");
+            return -1;
+        }
+        c->in_len += n;
+        w->bytes_received += n;
+        if (conn_match(w, c, now_ns()) != 0) {
+            return -1;
+        }
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *w = arg;
+    const struct options *opts = w->opts;
+    struct epoll_event events[MAX_EVENTS];
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        w->errors++;
+        return NULL;
+    }
+
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)(opts->duration * 1e9);
+    for (int i = 0; i < w->nconns; i++) {
+        struct conn *c = &w->conns[i];
+        c->id = w->first_id + i;
+        c->next_due = start;
+        if (conn_open(c, opts) != 0) {
+            w->errors++;
+            close(epoll_fd);
+            return NULL;
+        }
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    for (;;) {
+        uint64_t now = now_ns();
+        int sending = opts->packets > 0 ? 1 : now < end;
+        int busy = 0;
+        uint64_t wake = UINT64_MAX;
+
+        for (int i = 0; i < w->nconns; i++) {
+            struct conn *c = &w->conns[i];
+            if (c->closed) {
+                continue;
+            }
+            conn_fill(c, opts, now, sending);
+            if (conn_flush(w, c) != 0) {
+                c->closed = 1;
+                w->errors++;
+                continue;
+            }
+            int more = opts->packets > 0 ? c->sent < opts->packets : sending;
+            if (c->answered < c->sent || more) {
+                busy = 1;
+            }
+            if (opts->rate > 0 && more && c->sent - c->answered < opts->depth &&
+                c->next_due < wake) {
+                wake = c->next_due;
+            }
+        }
+        if (!busy) {
+            break;
+        }
+        if (!sending && now > end + DRAIN_NS) {
+            break;
+        }
+
+        int timeout = 100;
+        if (wake != UINT64_MAX) {
+            timeout = wake > now ? (int)((wake - now) / 1000000) : 0;
+        }
+        int nready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (nready < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            w->errors++;
+            break;
+        }
+        for (int i = 0; i < nready; i++) {
+            struct conn *c = events[i].data.ptr;
+            if ((events[i].events & EPOLLIN) && !c->closed && conn_read(w, c) != 0) {
+                c->closed = 1;
+                w->errors++;
+            }
+        }
+    }
+
+    for (int i = 0; i < w->nconns; i++) {
+        struct conn *c = &w->conns[i];
+        w->missing += c->sent - c->answered;
+        if (c->fd >= 0) {
+            close(c->fd);
+        }
+        free(c->due);
+        free(c->out);
+        free(c->in);
+        if (c->raw != NULL) {
+            inflateEnd(&c->inflate);
+            free(c->raw);
+        }
+    }
+    close(epoll_fd);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, size_t n, double q)
+{
+    if (n == 0) {
+        return 0;
+    }
+    size_t index = (size_t)(q * (n - 1) + 0.5);
+    return sorted[index] / 1e3;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-H host] [-P port] [-c connections] [-t threads] [-s size]\n"
+            "          [-r rate] [-d depth] [-n packets | -T seconds] [-D | -z]\n"
+            "  -c connections  concurrent connections (default 8)\n"
+            "  -t threads      worker threads (default 4, at most one per connection)\n"
+            "  -s size         packet size in bytes, newline included (default 64)\n"
+            "  -r rate         packets per second per connection (default unlimited)\n"
+            "  -d depth        packets outstanding per connection (default 1)\n"
+            "  -n packets      send this many packets per connection\n"
+            "  -T seconds      or send for this long (default 5)\n"
+            "  -D              ask for delta replies\n"
+            "  -z              ask for gzip replies (server started with -z)\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct options opts = {
+        .host = "127.0.0.1",
+        .port = DEFAULT_PORT,
+        .connections = 8,
+        .threads = 4,
+        .size = 64,
+        .depth = 1,
+        .duration = 5,
+    };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:P:c:t:s:r:d:n:T:Dz")) != -1) {
+        switch (opt) {
+            case 'H': opts.host = optarg; break;
+            case 'P': opts.port = optarg; break;
+            case 'c': opts.connections = atoi(optarg); break;
+            case 't': opts.threads = atoi(optarg); break;
+            case 's': opts.size = strtoul(optarg, NULL, 10); break;
+            case 'r': opts.rate = atof(optarg); break;
+            case 'd': opts.depth = atoi(optarg); break;
+            case 'n': opts.packets = atol(optarg); break;
+            case 'T': opts.duration = atof(optarg); break;
+            case 'D': opts.delta = 1; break;
+            case 'z': opts.gzip = 1; break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (opts.connections < 1 || opts.threads < 1 || opts.size < 32 || opts.depth < 1 ||
+        opts.rate < 0 || opts.packets < 0 || opts.duration <= 0 || (opts.delta && opts.gzip)) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (opts.threads > opts.connections) {
+        opts.threads = opts.connections;
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *addr;
+    int rc = getaddrinfo(opts.host, opts.port, &hints, &addr);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", opts.host, gai_strerror(rc));
+        return 2;
+    }
+    g_addr = addr;
+
+    struct worker *workers = calloc(opts.threads, sizeof(struct worker));
+    struct conn *conns = calloc(opts.connections, sizeof(struct conn));
+    if (!workers || !conns) {
+        perror("calloc");
+        return 2;
+    }
+    for (int i = 0; i < opts.connections; i++) {
+        conns[i].fd = -1;
+    }
+
+    uint64_t start = now_ns();
+    int assigned = 0;
+    for (int i = 0; i < opts.threads; i++) {
+        struct worker *w = &workers[i];
+        int n = opts.connections / opts.threads + (i < opts.connections % opts.threads);
+        w->opts = &opts;
+        w->conns = &conns[assigned];
+        w->nconns = n;
+        w->first_id = assigned;
+        assigned += n;
+        if (pthread_create(&w->thread_id, NULL, worker_thread, w) != 0) {
+            perror("pthread_create");
+            return 2;
+        }
+    }
+
+    size_t total = 0;
+    unsigned long long sent = 0, received = 0;
+    long missing = 0;
+    int errors = 0;
+    for (int i = 0; i < opts.threads; i++) {
+        pthread_join(workers[i].thread_id, NULL);
+        total += workers[i].nlatencies;
+        sent += workers[i].bytes_sent;
+        received += workers[i].bytes_received;
+        missing += workers[i].missing;
+        errors += workers[i].errors;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    uint64_t *all = malloc((total ? total : 1) * sizeof(uint64_t));
+    if (!all) {
+        perror("malloc");
+        return 2;
+    }
+    size_t n = 0;
+    for (int i = 0; i < opts.threads; i++) {
+        memcpy(all + n, workers[i].latencies, workers[i].nlatencies * sizeof(uint64_t));
+        n += workers[i].nlatencies;
+        free(workers[i].latencies);
+    }
+    qsort(all, total, sizeof(uint64_t), compare_u64);
+
+    printf("packets=%zu elapsed=%.2fs rate=%.0f/s sent=%.2fMB/s received=%.2fMB/s "
+           "p50=%.0fus p99=%.0fus p999=%.0fus max=%.0fus missing=%ld errors=%d\n",
+           total, elapsed, total / elapsed, sent / elapsed / 1e6, received / elapsed / 1e6,
+           percentile_us(all, total, 0.50), percentile_us(all, total, 0.99),
+           percentile_us(all, total, 0.999), total ? all[total - 1] / 1e3 : 0.0,
+           missing, errors);
+
+    free(all);
+    free(workers);
+    free(conns);
+    freeaddrinfo(addr);
+    return errors == 0 && missing == 0 ? 0 : 1;
+}
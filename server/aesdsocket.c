@@ -14,29 +14,98 @@
 #include <sys/stat.h>
 #include <pthread.h>
 #include <time.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
 
-#define PORT 9000
-#define DATA_FILE "/var/tmp/aesdsocketdata"
-#define BUFFER_SIZE 1024
-#define TIMESTAMP_INTERVAL 10
+#include "aesdsocket.h"
+#include "thread-pool.h"
+#include "log-writer.h"
+#include "packet-buffer.h"
+#include "log-cache.h"
+#include "log-gzip.h"
+#include "stats.h"
+#include "timer.h"
+#include "buffer-pool.h"
+#include "shard.h"
+#include "storage.h"
+#include "segment-log.h"
 
-static volatile sig_atomic_t g_signal_received = 0;
-static int g_server_fd = -1;
+#define DEFAULT_POOL_QUEUE_DEPTH 64
+// Pending connections per listener; the kernel caps it at net.core.somaxconn
+#define DEFAULT_LISTEN_BACKLOG SOMAXCONN
+// Seconds a client may stay silent, take to finish a packet, or leave its
+// replies unread
+#define DEFAULT_IDLE_TIMEOUT 300
+#define DEFAULT_READ_TIMEOUT 60
+#define DEFAULT_SEND_TIMEOUT 60
+#define DEFAULT_MAX_PACKET_SIZE (16 * 1024 * 1024)
+#define DEFAULT_SEND_QUEUE_HIGH (4 * 1024 * 1024)
 
-// Mutex for synchronizing file writes
-static pthread_mutex_t g_file_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Connection engines selectable with -m
+enum engine {
+    ENGINE_THREAD,
+    ENGINE_EPOLL,
+    ENGINE_URING,
+};
+
+volatile sig_atomic_t g_signal_received = 0;
+int g_wakeup_fd = -1;
+int g_delta_replies = 0;
+size_t g_max_packet_size = DEFAULT_MAX_PACKET_SIZE;
+size_t g_send_queue_high = DEFAULT_SEND_QUEUE_HIGH;
+int g_coalesce_replies = 0;
 
-// Thread management structures
+// Mutex serializing appends to the data log; readers never take it
+pthread_mutex_t g_file_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Connection tracking structures
 struct thread_node {
     pthread_t thread_id;
     int client_fd;
     struct sockaddr_in client_addr;
+    struct deadline deadline;   // on g_timers while the connection is served
+    struct thread_node *prev;
     struct thread_node *next;
 };
 
-// Head of the thread list
+// Connections currently being served (doubly linked for O(1) removal)
 static struct thread_node *g_thread_list_head = NULL;
+// Per-connection threads that have finished and are waiting to be joined
+static struct thread_node *g_completed_list_head = NULL;
 static pthread_mutex_t g_thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Signalled whenever a connection leaves g_thread_list_head
+static pthread_cond_t g_thread_list_cond = PTHREAD_COND_INITIALIZER;
+
+// Worker pool serving connections when started with -w
+static struct thread_pool g_pool;
+static int g_pool_started = 0;
+
+// Timer wheel of the thread engine, run by the timer thread.  Connection
+// threads add and cancel their deadlines under g_timer_mutex, which timer
+// functions run under, so a connection can't close while its timer fires.
+static struct timer_wheel g_timers = { .fd = -1 };
+static pthread_mutex_t g_timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t g_timer_tid;
+static int g_timer_started = 0;
+
+// Accept threads of the thread engine besides the main thread (-n)
+static pthread_t g_accept_tids[SHARD_MAX_LISTENERS];
+static int g_accept_started = 0;
+
+static struct timer g_timestamp_timer;
+
+/**
+ * Wake every engine thread waiting on g_wakeup_fd (async-signal-safe)
+ */
+static void wake_up_loops(void)
+{
+    if (g_wakeup_fd >= 0) {
+        uint64_t one = 1;
+        ssize_t ret = write(g_wakeup_fd, &one, sizeof(one));
+        (void)ret;
+    }
+}
 
 /**
  * Signal handler for SIGINT and SIGTERM
@@ -46,11 +115,19 @@ void signal_handler(int sig)
     (void)sig;
     g_signal_received = 1;
     syslog(LOG_INFO, "Caught signal, exiting");
-    // Close server socket to wake up accept()
-    if (g_server_fd >= 0) {
-        close(g_server_fd);
-        g_server_fd = -1;
-    }
+    // Wake up the loops and the timer thread blocked in their waits
+    wake_up_loops();
+    // Wake up every thread blocked in accept()
+    shard_shutdown();
+}
+
+/**
+ * Signal handler for SIGUSR1: have the stats thread dump to syslog
+ */
+static void stats_signal_handler(int sig)
+{
+    (void)sig;
+    stats_request_dump();
 }
 
 /**
@@ -65,76 +142,111 @@ void setup_signal_handlers(void)
     
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
+    
+    // A dump request must not make blocked system calls fail
+    sa.sa_handler = stats_signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+    sa.sa_flags = 0;
+    
+    // sendfile() has no MSG_NOSIGNAL, a peer closing early must not kill us
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
 }
 
 /**
- * Add thread node to the list
+ * Add thread node to the list of live connections
+ * Returns -1 without adding it once shutdown has started, since cleanup()
+ * may already have swept the list
  */
-void add_thread_node(struct thread_node *node)
+int add_thread_node(struct thread_node *node)
 {
     pthread_mutex_lock(&g_thread_list_mutex);
+    if (g_signal_received) {
+        pthread_mutex_unlock(&g_thread_list_mutex);
+        return -1;
+    }
+    node->prev = NULL;
     node->next = g_thread_list_head;
+    if (g_thread_list_head != NULL) {
+        g_thread_list_head->prev = node;
+    }
     g_thread_list_head = node;
     pthread_mutex_unlock(&g_thread_list_mutex);
+    return 0;
 }
 
 /**
- * Remove thread node from the list
- * Note: This is called by cleanup() to remove completed threads
+ * Unlink node from the list of live connections
+ * Caller must hold g_thread_list_mutex
  */
-void remove_thread_node(pthread_t thread_id)
+static void unlink_thread_node(struct thread_node *node)
 {
-    pthread_mutex_lock(&g_thread_list_mutex);
-    struct thread_node *current = g_thread_list_head;
-    struct thread_node *prev = NULL;
-    
-    while (current != NULL) {
-        if (pthread_equal(current->thread_id, thread_id)) {
-            if (prev == NULL) {
-                g_thread_list_head = current->next;
-            } else {
-                prev->next = current->next;
-            }
-            free(current);
-            break;
-        }
-        prev = current;
-        current = current->next;
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        g_thread_list_head = node->next;
+    }
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
     }
+    node->prev = NULL;
+    node->next = NULL;
+    pthread_cond_broadcast(&g_thread_list_cond);
+}
+
+/**
+ * Remove thread node from the list of live connections in O(1)
+ */
+void remove_thread_node(struct thread_node *node)
+{
+    pthread_mutex_lock(&g_thread_list_mutex);
+    unlink_thread_node(node);
+    pthread_mutex_unlock(&g_thread_list_mutex);
+}
+
+/**
+ * Move a finished per-connection thread to the completed list so the
+ * accept loop can join it without walking every live connection
+ */
+static void complete_thread_node(struct thread_node *node)
+{
+    pthread_mutex_lock(&g_thread_list_mutex);
+    unlink_thread_node(node);
+    node->next = g_completed_list_head;
+    g_completed_list_head = node;
     pthread_mutex_unlock(&g_thread_list_mutex);
 }
 
 /**
- * Clean up completed threads (non-blocking)
- * This should be called periodically in the main loop to free completed threads
+ * Join and free threads that have finished (non-blocking)
+ * Only threads that already exited are visited, so the cost does not grow
+ * with the number of live connections
  */
 void cleanup_completed_threads(void)
 {
     pthread_mutex_lock(&g_thread_list_mutex);
-    struct thread_node *current = g_thread_list_head;
-    struct thread_node *prev = NULL;
+    struct thread_node *current = g_completed_list_head;
+    g_completed_list_head = NULL;
+    pthread_mutex_unlock(&g_thread_list_mutex);
     
     while (current != NULL) {
-        void *retval;
-        // Try to join the thread without blocking
-        int result = pthread_tryjoin_np(current->thread_id, &retval);
-        if (result == 0) {
-            // Thread has completed, remove it from the list
-            struct thread_node *next = current->next;
-            if (prev == NULL) {
-                g_thread_list_head = next;
-            } else {
-                prev->next = next;
-            }
-            free(current);
-            current = next;
-        } else {
-            // Thread is still running, move to next
-            prev = current;
-            current = current->next;
-        }
+        struct thread_node *next = current->next;
+        pthread_join(current->thread_id, NULL);
+        buffer_pool_free(current, sizeof(struct thread_node));
+        current = next;
     }
-    pthread_mutex_unlock(&g_thread_list_mutex);
+}
+
+/**
+ * Release a connection that was queued for the pool but never served
+ */
+static void drop_queued_connection(void *arg)
+{
+    struct thread_node *node = (struct thread_node *)arg;
+    close(node->client_fd);
+    stats_count(STATS_CLOSED, 1);
+    buffer_pool_free(node, sizeof(struct thread_node));
 }
 
 /**
@@ -142,241 +254,229 @@ void cleanup_completed_threads(void)
  */
 void cleanup(void)
 {
-    // Close server socket first to wake up accept() and prevent new connections
-    if (g_server_fd >= 0) {
-        close(g_server_fd);
-        g_server_fd = -1;
+    // Anything still running stops at its next check
+    g_signal_received = 1;
+    wake_up_loops();
+    
+    // Stop the listeners first to wake up accept() and prevent new
+    // connections, and wait for the other accept threads to return
+    shard_shutdown();
+    while (g_accept_started > 0) {
+        pthread_join(g_accept_tids[--g_accept_started], NULL);
     }
+    shard_close();
     
-    // Close all client sockets to wake up threads blocked in recv()
-    // This helps threads exit promptly when shutdown is requested
-    if (g_thread_list_head != NULL) {
-        if (pthread_mutex_lock(&g_thread_list_mutex) == 0) {
-            struct thread_node *current = g_thread_list_head;
-            while (current != NULL) {
-                // Close client socket to wake up thread blocked in recv()
-                // It's safe to close even if already closed by the thread
-                if (current->client_fd >= 0) {
-                    close(current->client_fd);
-                    current->client_fd = -1;  // Mark as closed
-                }
-                current = current->next;
-            }
-            pthread_mutex_unlock(&g_thread_list_mutex);
-        }
+    // Shut down all client sockets to wake up threads blocked in recv()
+    // The serving thread still owns the descriptor and closes it
+    pthread_mutex_lock(&g_thread_list_mutex);
+    for (struct thread_node *current = g_thread_list_head; current != NULL;
+         current = current->next) {
+        shutdown(current->client_fd, SHUT_RDWR);
     }
     
-    // Wait for all threads to complete (only if threads were created)
-    if (g_thread_list_head != NULL) {
-        if (pthread_mutex_lock(&g_thread_list_mutex) == 0) {
-            struct thread_node *current = g_thread_list_head;
-            while (current != NULL) {
-                struct thread_node *next = current->next;
-                void *retval;
-                pthread_join(current->thread_id, &retval);
-                free(current);
-                current = next;
-            }
-            g_thread_list_head = NULL;
-            pthread_mutex_unlock(&g_thread_list_mutex);
-        }
+    // Wait for every connection to finish
+    while (g_thread_list_head != NULL) {
+        pthread_cond_wait(&g_thread_list_cond, &g_thread_list_mutex);
     }
+    pthread_mutex_unlock(&g_thread_list_mutex);
     
-    unlink(DATA_FILE);
+    // Join per-connection threads, or the pool workers
+    cleanup_completed_threads();
+    if (g_pool_started) {
+        thread_pool_stop(&g_pool, drop_queued_connection);
+        g_pool_started = 0;
+    }
+    
+    if (g_timer_started) {
+        pthread_join(g_timer_tid, NULL);
+        g_timer_started = 0;
+    }
+    timer_wheel_destroy(&g_timers);
+    
+    // Every producer is gone, commit what is left and stop the writer
+    log_writer_stop();
+    log_cache_destroy();
+    log_gzip_destroy();
+    storage_close();
+    stats_stop();
+    
+    if (g_wakeup_fd >= 0) {
+        close(g_wakeup_fd);
+        g_wakeup_fd = -1;
+    }
     
     // Destroy mutexes (safe even if not used)
     pthread_mutex_destroy(&g_file_mutex);
     pthread_mutex_destroy(&g_thread_list_mutex);
+    pthread_mutex_destroy(&g_timer_mutex);
+    pthread_cond_destroy(&g_thread_list_cond);
     
+    buffer_pool_drain();
     closelog();
 }
 
 /**
- * Read data from socket until newline is found
- * Returns dynamically allocated buffer with the complete packet (including newline)
- * Returns NULL on error or if connection closed
+ * Return the next packet from the connection, reading from the socket only
+ * when the receive buffer holds no complete packet
+ * @param packet is set to a view of the packet (including its newline) in
+ *      @param rx, valid until the next call
+ * @param deadline is stamped each time the connection waits for input
+ * Returns 1 when a packet is returned, 0 if the connection closed or
+ * shutdown was requested, -1 on error
  */
-char *receive_packet(int sockfd)
+int receive_packet(int sockfd, struct packet_buffer *rx, struct deadline *deadline,
+                   const char **packet, size_t *len)
 {
-    char *buffer = NULL;
-    size_t buffer_size = BUFFER_SIZE;
-    size_t total_received = 0;
-    ssize_t bytes_received;
-    char *newline_pos = NULL;
-    
-    buffer = malloc(buffer_size);
-    if (!buffer) {
-        syslog(LOG_ERR, "malloc failed: %s", strerror(errno));
-        return NULL;
-    }
-    
-    while (1) {
+    while (!packet_buffer_next(rx, packet, len)) {
         if (g_signal_received) {
-            free(buffer);
-            return NULL;
+            return 0;
         }
+        deadline_update(deadline, packet_buffer_pending(rx));
         
-        if (total_received >= buffer_size - 1) {
-            size_t new_size = buffer_size * 2;
-            char *new_buffer = realloc(buffer, new_size);
-            if (!new_buffer) {
-                syslog(LOG_ERR, "realloc failed: %s", strerror(errno));
-                free(buffer);
-                return NULL;
-            }
-            buffer = new_buffer;
-            buffer_size = new_size;
+        size_t avail;
+        char *dest = packet_buffer_reserve(rx, &avail);
+        if (!dest) {
+            return -1;
         }
         
-        bytes_received = recv(sockfd, buffer + total_received, 
-                             buffer_size - total_received - 1, 0);
-        
-        if (bytes_received <= 0) {
-            if (bytes_received == 0) {
-                // Connection closed
-                free(buffer);
-                return NULL;
-            }
+        uint64_t start = stats_now();
+        ssize_t bytes_received = recv(sockfd, dest, avail, 0);
+        stats_record_since(STATS_RECV_NS, start);
+        if (bytes_received == 0) {
+            // Connection closed
+            return 0;
+        }
+        if (bytes_received < 0) {
             if (errno == EINTR) {
-                if (g_signal_received) {
-                    free(buffer);
-                    return NULL;
-                }
                 continue;
             }
             syslog(LOG_ERR, "recv failed: %s", strerror(errno));
-            free(buffer);
-            return NULL;
+            return -1;
         }
         
-        total_received += bytes_received;
-        buffer[total_received] = '\0';
-        
-        // Check for newline
-        newline_pos = strchr(buffer, '\n');
-        if (newline_pos) {
-            // Found complete packet
-            break;
-        }
+        packet_buffer_commit(rx, bytes_received);
     }
     
-    return buffer;
+    return 1;
 }
 
 /**
- * Append data to file (thread-safe with mutex)
+ * Append data to the log through the writer thread
+ * Returns once the data has been committed, so a reply sent afterwards
+ * includes it
  */
 int append_to_file(const char *data, size_t len)
 {
-    pthread_mutex_lock(&g_file_mutex);
-    
-    FILE *fp = fopen(DATA_FILE, "a");
-    if (!fp) {
-        syslog(LOG_ERR, "Failed to open %s for appending: %s", 
-               DATA_FILE, strerror(errno));
-        pthread_mutex_unlock(&g_file_mutex);
-        return -1;
-    }
+    struct log_write req;
+    uint64_t start = stats_now();
     
-    size_t written = fwrite(data, 1, len, fp);
-    fclose(fp);
-    
-    pthread_mutex_unlock(&g_file_mutex);
-    
-    if (written != len) {
-        syslog(LOG_ERR, "Failed to write complete data to %s", DATA_FILE);
-        return -1;
-    }
-    
-    return 0;
+    log_writer_submit(&req, data, len);
+    int result = log_writer_wait(&req);
+    stats_record_since(STATS_APPEND_NS, start);
+    return result;
 }
 
 /**
- * Read entire file and send to client (thread-safe with mutex)
+ * Send the data file contents to the client, stamping @param deadline as
+ * they go out
  */
-int send_file_contents(int sockfd)
+int send_file_contents(int sockfd, struct reply_state *state, struct deadline *deadline)
 {
-    pthread_mutex_lock(&g_file_mutex);
+    size_t buffer_size;
+    struct reply reply;
     
-    FILE *fp = fopen(DATA_FILE, "r");
-    if (!fp) {
-        // File doesn't exist yet - that's okay, send nothing
-        if (errno == ENOENT) {
-            pthread_mutex_unlock(&g_file_mutex);
-            return 0;
-        }
-        syslog(LOG_ERR, "Failed to open %s for reading: %s", 
-               DATA_FILE, strerror(errno));
-        pthread_mutex_unlock(&g_file_mutex);
+    // Pooled rather than on the stack, its size depends on the backend
+    char *buffer = buffer_pool_alloc(storage_send_buffer_size(), &buffer_size);
+    if (!buffer) {
+        syslog(LOG_ERR, "malloc failed for send buffer: %s", strerror(errno));
         return -1;
     }
-    
-    // Get file size
-    fseek(fp, 0, SEEK_END);
-    long file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    
-    if (file_size < 0) {
-        syslog(LOG_ERR, "Failed to get file size: %s", strerror(errno));
-        fclose(fp);
-        pthread_mutex_unlock(&g_file_mutex);
+    if (reply_open(&reply, state, -1) != 0) {
+        buffer_pool_free(buffer, buffer_size);
         return -1;
     }
+    reply.deadline = deadline;
     
-    // Handle empty file
-    if (file_size == 0) {
-        fclose(fp);
-        pthread_mutex_unlock(&g_file_mutex);
-        return 0;
-    }
+    int result = reply_send(sockfd, &reply, buffer, buffer_size);
+    reply_close(&reply);
+    buffer_pool_free(buffer, buffer_size);
     
-    // Allocate buffer for file contents
-    char *file_buffer = malloc(file_size);
-    if (!file_buffer) {
-        syslog(LOG_ERR, "malloc failed for file buffer: %s", strerror(errno));
-        fclose(fp);
-        pthread_mutex_unlock(&g_file_mutex);
-        return -1;
+    // A blocking socket never reports would-block
+    return result == 1 ? 0 : -1;
+}
+
+/**
+ * Timer function of a connection's deadline, run by the timer thread.
+ * Shutting the socket down ends the recv() its thread is blocked in.
+ */
+static void client_timeout(struct timer *timer)
+{
+    struct thread_node *node = timer_container(timer, struct thread_node, deadline.timer);
+
+    if (deadline_expired(&g_timers, &node->deadline)) {
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &node->client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+        syslog(LOG_INFO, "Connection from %s timed out", client_ip);
+        stats_count(STATS_TIMED_OUT, 1);
+        shutdown(node->client_fd, SHUT_RDWR);
     }
+}
+
+/**
+ * Serve one client connection until it closes or shutdown is requested
+ */
+void handle_client(struct thread_node *node)
+{
+    int client_fd = node->client_fd;
+    struct sockaddr_in *client_addr = &node->client_addr;
+    char client_ip[INET_ADDRSTRLEN];
     
-    size_t bytes_read = fread(file_buffer, 1, file_size, fp);
-    fclose(fp);
+    inet_ntop(AF_INET, &(client_addr->sin_addr), client_ip, INET_ADDRSTRLEN);
+    syslog(LOG_INFO, "Accepted connection from %s", client_ip);
     
-    pthread_mutex_unlock(&g_file_mutex);
+    struct packet_buffer rx;
+    struct reply_state state;
+    const char *packet;
+    size_t packet_len;
     
-    if (bytes_read != (size_t)file_size) {
-        syslog(LOG_ERR, "Failed to read complete file");
-        free(file_buffer);
-        return -1;
-    }
+    packet_buffer_init(&rx);
+    reply_state_init(&state);
     
-    // Send file contents
-    ssize_t total_sent = 0;
-    while (total_sent < file_size) {
-        if (g_signal_received) {
-            free(file_buffer);
-            return -1;
+    pthread_mutex_lock(&g_timer_mutex);
+    deadline_start(&g_timers, &node->deadline, client_timeout, NULL);
+    pthread_mutex_unlock(&g_timer_mutex);
+    
+    // Packets that arrived together are served back to back from rx
+    while (!g_signal_received &&
+           receive_packet(client_fd, &rx, &node->deadline, &packet, &packet_len) == 1) {
+        stats_count(STATS_PACKETS, 1);
+        enum reply_command command = reply_parse_command(packet, packet_len);
+        if (command != REPLY_CMD_NONE) {
+            reply_apply_command(&state, command);
+        } else if (append_to_file(packet, packet_len) != 0) {
+            // Append packet to the log
+            break;
         }
         
-        ssize_t bytes_sent = send(sockfd, file_buffer + total_sent, 
-                                  file_size - total_sent, 0);
-        if (bytes_sent < 0) {
-            if (errno == EINTR) {
-                if (g_signal_received) {
-                    free(file_buffer);
-                    return -1;
-                }
-                continue;
-            }
-            syslog(LOG_ERR, "send failed: %s", strerror(errno));
-            free(file_buffer);
-            return -1;
+        // Send the log (or what the client hasn't seen of it) back; the
+        // send timeout shuts down a reply the client stops reading
+        deadline_stalled(&node->deadline, 1);
+        int result = send_file_contents(client_fd, &state, &node->deadline);
+        deadline_stalled(&node->deadline, 0);
+        if (result != 0) {
+            break;
         }
-        total_sent += bytes_sent;
     }
     
-    free(file_buffer);
-    return 0;
+    // No timeout may shut the descriptor down once it is closed
+    pthread_mutex_lock(&g_timer_mutex);
+    timer_cancel(&node->deadline.timer);
+    pthread_mutex_unlock(&g_timer_mutex);
+    
+    packet_buffer_free(&rx);
+    syslog(LOG_INFO, "Closed connection from %s", client_ip);
+    close(client_fd);
+    stats_count(STATS_CLOSED, 1);
 }
 
 /**
@@ -385,79 +485,216 @@ int send_file_contents(int sockfd)
 void *handle_client_thread(void *arg)
 {
     struct thread_node *node = (struct thread_node *)arg;
-    int client_fd = node->client_fd;
-    struct sockaddr_in *client_addr = &node->client_addr;
-    char client_ip[INET_ADDRSTRLEN];
     
-    inet_ntop(AF_INET, &(client_addr->sin_addr), client_ip, INET_ADDRSTRLEN);
-    syslog(LOG_INFO, "Accepted connection from %s", client_ip);
+    handle_client(node);
     
+    // Thread node will be joined and freed by cleanup_completed_threads()
+    complete_thread_node(node);
+    return NULL;
+}
+
+/**
+ * Pool worker handler for a queued client connection
+ */
+void handle_client_pooled(void *arg)
+{
+    struct thread_node *node = (struct thread_node *)arg;
+    
+    if (add_thread_node(node) != 0) {
+        drop_queued_connection(node);
+        return;
+    }
+    
+    handle_client(node);
+    
+    remove_thread_node(node);
+    buffer_pool_free(node, sizeof(struct thread_node));
+}
+
+/**
+ * Thread engine: accept connections on the listener of @param shard and
+ * start a thread for each (or queue it for the pool) until shutdown
+ */
+static void accept_loop(int shard)
+{
+    int listen_fd = shard_listener(shard);
+    
+    shard_pin(shard);
     while (!g_signal_received) {
-        char *packet = receive_packet(client_fd);
-        if (!packet) {
-            // Connection closed or error
-            break;
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        
+        int client_fd = accept(listen_fd, (struct sockaddr *)&client_addr, 
+                              &client_addr_len);
+        
+        if (client_fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (g_signal_received) {
+                break;
+            }
+            syslog(LOG_ERR, "accept failed: %s", strerror(errno));
+            continue;
         }
         
-        // Append packet to file (with mutex protection)
-        size_t packet_len = strlen(packet);
-        if (append_to_file(packet, packet_len) != 0) {
-            free(packet);
-            break;
+        // Create thread node for this connection
+        struct thread_node *node = buffer_pool_alloc(sizeof(struct thread_node), NULL);
+        if (!node) {
+            syslog(LOG_ERR, "malloc failed for thread node: %s", strerror(errno));
+            close(client_fd);
+            continue;
+        }
+        
+        stats_count(STATS_ACCEPTED, 1);
+        node->client_fd = client_fd;
+        node->client_addr = client_addr;
+        node->prev = NULL;
+        node->next = NULL;
+        
+        // Pool mode: hand the connection to an idle worker, or turn it away
+        if (g_pool_started) {
+            if (thread_pool_submit(&g_pool, node) != 0) {
+                syslog(LOG_WARNING, "Connection queue full, rejecting client");
+                drop_queued_connection(node);
+            }
+            continue;
         }
         
-        // Send full file contents back to client
-        if (send_file_contents(client_fd) != 0) {
-            free(packet);
+        // Track the connection before its thread can complete
+        if (add_thread_node(node) != 0) {
+            drop_queued_connection(node);
             break;
         }
         
-        free(packet);
+        // Create thread for this connection
+        if (pthread_create(&node->thread_id, NULL, handle_client_thread, node) != 0) {
+            syslog(LOG_ERR, "Failed to create thread: %s", strerror(errno));
+            remove_thread_node(node);
+            drop_queued_connection(node);
+            continue;
+        }
+        
+        // Clean up any completed threads (as recommended by assignment)
+        // This ensures threads are freed after starting the next thread
+        cleanup_completed_threads();
     }
+}
+
+/**
+ * Thread function of the accept threads beyond the first
+ */
+static void *accept_thread(void *arg)
+{
+    accept_loop((int)(intptr_t)arg);
+    return NULL;
+}
+
+/**
+ * Format the timestamp line for the current second into @param len,
+ * reusing the previous result within the same second
+ * @return the line, valid until the next call
+ */
+static const char *timestamp_format(size_t *len)
+{
+    static time_t cached_second = -1;
+    static char cached[256];
+    static size_t cached_len;
+    time_t now = time(NULL);
     
-    syslog(LOG_INFO, "Closed connection from %s", client_ip);
-    // Close client socket (safe even if already closed by cleanup)
-    if (client_fd >= 0) {
-        close(client_fd);
+    if (now != cached_second) {
+        struct tm tm_info;
+        localtime_r(&now, &tm_info);
+        // Format: timestamp:time where time is RFC 2822 compliant
+        // RFC 2822 format: "%a, %d %b %Y %T %z"
+        cached_len = strftime(cached, sizeof(cached), "timestamp:%a, %d %b %Y %T %z\n", &tm_info);
+        cached_second = now;
     }
+    *len = cached_len;
+    return cached;
+}
+
+/**
+ * The timestamp being appended.  The timer only queues it: waiting for the
+ * commit would hold up the wheel, and with it every deadline of the thread
+ * engine or every connection of the loop running it.
+ */
+static struct {
+    struct log_write req;
+    char line[256];
+    int pending;        // req is queued, its done semaphore not consumed yet
+} g_timestamp;
+
+/**
+ * Timer function appending a timestamp every TIMESTAMP_INTERVAL seconds
+ */
+static void timestamp_timeout(struct timer *timer)
+{
+    struct timer_wheel *wheel = timer->data;
     
-    // Thread node will be removed and freed by cleanup()
-    return node;
+    if (g_timestamp.pending) {
+        if (sem_trywait(&g_timestamp.req.done) == 0) {
+            sem_destroy(&g_timestamp.req.done);
+            g_timestamp.pending = 0;
+        } else {
+            // The request still belongs to the writer, try again next time
+            syslog(LOG_WARNING, "Previous timestamp not committed yet, skipping one");
+        }
+    }
+    if (!g_signal_received && !g_timestamp.pending) {
+        size_t len;
+        const char *line = timestamp_format(&len);
+        memcpy(g_timestamp.line, line, len);
+        log_writer_submit(&g_timestamp.req, g_timestamp.line, len);
+        g_timestamp.pending = 1;
+    }
+    timer_add(wheel, timer, TIMESTAMP_INTERVAL * 1000);
+}
+
+void timestamp_start(struct timer_wheel *wheel)
+{
+    if (!storage_has(STORAGE_TIMESTAMPS)) {
+        return;
+    }
+    // Fresh each time, in case an engine retries with another wheel
+    timer_init(&g_timestamp_timer, timestamp_timeout, wheel);
+    timer_add(wheel, &g_timestamp_timer, TIMESTAMP_INTERVAL * 1000);
 }
 
 /**
- * Thread function to write timestamp every 10 seconds
+ * Thread function running the thread engine's timer wheel until shutdown
  */
-void *timestamp_thread(void *arg)
+static void *timer_thread(void *arg)
 {
     (void)arg;
+    struct epoll_event ev;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    
+    if (epoll_fd < 0) {
+        syslog(LOG_ERR, "epoll_create1 failed for timers: %s", strerror(errno));
+        return NULL;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = g_timers.fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, g_timers.fd, &ev);
+    ev.data.fd = g_wakeup_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, g_wakeup_fd, &ev);
     
+    // Shutdown wakes the wait through g_wakeup_fd, no polling interval
     while (!g_signal_received) {
-        // Use interruptible sleep - check signal every second
-        for (int i = 0; i < TIMESTAMP_INTERVAL && !g_signal_received; i++) {
-            sleep(1);
-        }
-        
-        if (g_signal_received) {
+        int nready = epoll_wait(epoll_fd, &ev, 1, -1);
+        if (nready < 0 && errno != EINTR) {
+            syslog(LOG_ERR, "epoll_wait failed for timers: %s", strerror(errno));
             break;
         }
-        
-        time_t now;
-        struct tm *tm_info;
-        char timestamp_str[256];
-        
-        time(&now);
-        tm_info = localtime(&now);
-        
-        // Format: timestamp:time where time is RFC 2822 compliant
-        // RFC 2822 format: "%a, %d %b %Y %T %z"
-        strftime(timestamp_str, sizeof(timestamp_str), "timestamp:%a, %d %b %Y %T %z\n", tm_info);
-        
-        // Append timestamp to file (with mutex protection)
-        size_t len = strlen(timestamp_str);
-        append_to_file(timestamp_str, len);
+        if (nready > 0 && ev.data.fd == g_timers.fd && !g_signal_received) {
+            pthread_mutex_lock(&g_timer_mutex);
+            timer_wheel_run(&g_timers);
+            pthread_mutex_unlock(&g_timer_mutex);
+        }
     }
     
+    close(epoll_fd);
     return NULL;
 }
 
@@ -515,137 +752,404 @@ int daemonize(void)
     return 0;
 }
 
+/**
+ * Parse a byte count with an optional k, m or g suffix
+ * Returns 0 on success, -1 if @param arg is not a positive size
+ */
+static int parse_size(const char *arg, size_t *size)
+{
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if (errno != 0 || end == arg || value == 0 || arg[0] == '-') {
+        return -1;
+    }
+
+    int shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0' || value > (SIZE_MAX >> shift)) {
+        return -1;
+    }
+    *size = (size_t)value << shift;
+    return 0;
+}
+
+/**
+ * Print command line usage
+ */
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-d] [-m thread|epoll|uring] [-n loops] [-w workers] [-q depth]"
+                    " [-c size] [-D] [-S path] [-i seconds] [-r seconds]"
+                    " [-p size] [-s seconds] [-H size] [-C] [-b backlog] [-R] [-A]"
+                    " [-B file|chardev|memory|segments] [-z level] [-g size] [-k size]"
+                    " [-a seconds]\n", prog);
+    fprintf(stderr, "  -d          run as a daemon\n");
+    fprintf(stderr, "  -m engine   connection engine: thread (default), epoll or uring\n");
+    fprintf(stderr, "  -n shards   number of epoll/io_uring loops, or of accept threads of\n"
+                    "              the thread engine (default 1)\n");
+    fprintf(stderr, "  -w workers  serve connections from a pool of this many threads\n");
+    fprintf(stderr, "  -q depth    connections waiting for a pool worker before new\n"
+                    "              ones are rejected (default %d)\n", DEFAULT_POOL_QUEUE_DEPTH);
+    fprintf(stderr, "  -c size     keep up to size bytes (k/m/g suffixes) of the log in\n"
+                    "              memory and write it to disk behind the replies\n");
+    fprintf(stderr, "  -D          reply with new data only; clients send %s<full|delta|resync>\n"
+                    "              to switch modes or get the whole log once\n", REPLY_CMD_PREFIX);
+    fprintf(stderr, "  -S path     serve statistics on this Unix socket (send \"stats\");\n"
+                    "              SIGUSR1 always logs them to syslog\n");
+    fprintf(stderr, "  -i seconds  close connections idle this long, 0 for never (default %d)\n",
+            DEFAULT_IDLE_TIMEOUT);
+    fprintf(stderr, "  -r seconds  close connections taking longer than this to finish a\n"
+                    "              packet, 0 for never (default %d)\n", DEFAULT_READ_TIMEOUT);
+    fprintf(stderr, "  -p size     close connections sending a packet longer than about size\n"
+                    "              bytes (k/m/g suffixes, default %dm)\n",
+            DEFAULT_MAX_PACKET_SIZE >> 20);
+    fprintf(stderr, "  -s seconds  close connections not reading their replies for this\n"
+                    "              long, 0 for never (default %d)\n", DEFAULT_SEND_TIMEOUT);
+    fprintf(stderr, "  -H size     epoll/io_uring: stop reading a connection whose unsent\n"
+                    "              replies exceed size bytes (k/m/g suffixes, default %dm,\n"
+                    "              0 for no limit) until they drop to a quarter of it\n",
+            DEFAULT_SEND_QUEUE_HIGH >> 20);
+    fprintf(stderr, "  -C          epoll/io_uring: replace an unsent full reply with the\n"
+                    "              next one instead of queueing both\n");
+    fprintf(stderr, "  -b backlog  pending connections per listener (default %d)\n",
+            DEFAULT_LISTEN_BACKLOG);
+    fprintf(stderr, "  -R          give each shard its own SO_REUSEPORT listener instead of\n"
+                    "              sharing one\n");
+    fprintf(stderr, "  -A          pin shard i to the i-th allowed CPU; connection threads\n"
+                    "              of the thread engine run on their accept thread's CPU\n");
+    fprintf(stderr, "  -B backend  store the log in %s (file), %s (chardev), only in\n"
+                    "              memory, or in segment files under %s kept\n"
+                    "              across restarts (segments); default %s\n",
+            DATA_FILE, CHAR_DEVICE, SEGMENT_DIR, storage_name());
+    fprintf(stderr, "  -g size     segments: start a new segment file after this many bytes\n"
+                    "              (k/m/g suffixes, default %dm)\n",
+            SEGMENT_LOG_DEFAULT_SIZE >> 20);
+    fprintf(stderr, "  -k size     segments: drop the oldest segments while the log holds\n"
+                    "              more than size bytes (k/m/g suffixes, default 0 for all)\n");
+    fprintf(stderr, "  -a seconds  segments: drop segments last written longer ago than\n"
+                    "              this, 0 for never (default 0)\n");
+    fprintf(stderr, "  -z level    keep a gzip copy of the log compressed at level 1-9, and\n"
+                    "              send full replies from it to clients sending %sgzip\n",
+            REPLY_CMD_PREFIX);
+}
+
+/**
+ * Parse a timeout in seconds, 0 included
+ * Returns 0 on success, -1 if @param arg is not a number of seconds
+ */
+static int parse_seconds(const char *arg, uint64_t *ms)
+{
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || arg[0] == '-' || value > UINT32_MAX) {
+        return -1;
+    }
+    *ms = (uint64_t)value * 1000;
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int daemon_mode = 0;
+    int engine = ENGINE_THREAD;
+    int nloops = 1;
+    int pool_workers = 0;
+    int pool_queue_depth = DEFAULT_POOL_QUEUE_DEPTH;
+    size_t cache_size = 0;
+    const char *stats_socket = NULL;
+    uint64_t idle_timeout = DEFAULT_IDLE_TIMEOUT * 1000;
+    uint64_t read_timeout = DEFAULT_READ_TIMEOUT * 1000;
+    uint64_t send_timeout = DEFAULT_SEND_TIMEOUT * 1000;
+    int backlog = DEFAULT_LISTEN_BACKLOG;
+    int reuseport = 0;
+    int pin_shards = 0;
+    int gzip_level = 0;
+    size_t segment_size = SEGMENT_LOG_DEFAULT_SIZE;
+    size_t retain_bytes = 0;
+    uint64_t retain_ms = 0;
+    int segment_options = 0;
     int opt;
     
     // Parse command line arguments
-    while ((opt = getopt(argc, argv, "d")) != -1) {
+    while ((opt = getopt(argc, argv, "dm:n:w:q:c:DS:i:r:p:s:H:Cb:RAB:z:g:k:a:")) != -1) {
         switch (opt) {
             case 'd':
                 daemon_mode = 1;
                 break;
+            case 'm':
+                if (strcmp(optarg, "epoll") == 0) {
+                    engine = ENGINE_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    engine = ENGINE_URING;
+                } else if (strcmp(optarg, "thread") == 0) {
+                    engine = ENGINE_THREAD;
+                } else {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'n':
+                nloops = atoi(optarg);
+                if (nloops < 1 || nloops > SHARD_MAX_LISTENERS) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'w':
+                pool_workers = atoi(optarg);
+                if (pool_workers < 1) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'q':
+                pool_queue_depth = atoi(optarg);
+                if (pool_queue_depth < 1) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'c':
+                if (parse_size(optarg, &cache_size) != 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'D':
+                g_delta_replies = 1;
+                break;
+            case 'S':
+                stats_socket = optarg;
+                break;
+            case 'i':
+                if (parse_seconds(optarg, &idle_timeout) != 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'r':
+                if (parse_seconds(optarg, &read_timeout) != 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'p':
+                if (parse_size(optarg, &g_max_packet_size) != 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 's':
+                if (parse_seconds(optarg, &send_timeout) != 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'H':
+                if (strcmp(optarg, "0") == 0) {
+                    g_send_queue_high = 0;
+                } else if (parse_size(optarg, &g_send_queue_high) != 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'C':
+                g_coalesce_replies = 1;
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                if (backlog < 1) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'R':
+                reuseport = 1;
+                break;
+            case 'A':
+                pin_shards = 1;
+                break;
+            case 'B':
+                if (storage_select(optarg) != 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'z':
+                gzip_level = atoi(optarg);
+                if (gzip_level < 1 || gzip_level > 9) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'g':
+                if (parse_size(optarg, &segment_size) != 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                segment_options = 1;
+                break;
+            case 'k':
+                if (strcmp(optarg, "0") == 0) {
+                    retain_bytes = 0;
+                } else if (parse_size(optarg, &retain_bytes) != 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                segment_options = 1;
+                break;
+            case 'a':
+                if (parse_seconds(optarg, &retain_ms) != 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                segment_options = 1;
+                break;
             default:
-                fprintf(stderr, "Usage: %s [-d]\n", argv[0]);
+                usage(argv[0]);
                 return -1;
         }
     }
     
+    // The driver keeps its own bounded history and drops old entries, so
+    // offsets into it shift
+    if (!storage_has(STORAGE_STABLE_OFFSETS) &&
+        (cache_size > 0 || g_delta_replies || gzip_level > 0)) {
+        fprintf(stderr, "-c, -D and -z are not supported with the %s backend\n", storage_name());
+        return -1;
+    }
+    // The memory backend caches the whole log already
+    if (storage_has(STORAGE_MEMORY) && cache_size > 0) {
+        fprintf(stderr, "-c is not supported with the %s backend\n", storage_name());
+        return -1;
+    }
+    if (segment_options && !storage_has(STORAGE_PERSISTENT)) {
+        fprintf(stderr, "-g, -k and -a are only supported with the segments backend\n");
+        return -1;
+    }
+    // The compressed copy starts from the first byte, a reopened log doesn't
+    if (storage_has(STORAGE_PERSISTENT) && gzip_level > 0) {
+        fprintf(stderr, "-z is not supported with the %s backend\n", storage_name());
+        return -1;
+    }
+    segment_log_configure(segment_size, retain_bytes, retain_ms);
+    
     // Open syslog
     openlog("aesdsocket", LOG_PID, LOG_USER);
     
-    // Delete data file if it exists (start fresh)
-    unlink(DATA_FILE);
+    deadline_configure(idle_timeout, read_timeout, send_timeout);
+    
+    // Create the shutdown wakeup eventfd before any signal can arrive
+    g_wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (g_wakeup_fd < 0) {
+        syslog(LOG_ERR, "eventfd failed: %s", strerror(errno));
+        cleanup();
+        return -1;
+    }
     
     // Setup signal handlers
     setup_signal_handlers();
     
-    // Create socket
-    g_server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (g_server_fd < 0) {
-        syslog(LOG_ERR, "socket creation failed: %s", strerror(errno));
+    // Create the listening sockets, one per shard with -R
+    if (shard_listen(reuseport ? nloops : 1, backlog) != 0) {
         cleanup();
         return -1;
     }
-    
-    // Set socket option to reuse address
-    int opt_val = 1;
-    if (setsockopt(g_server_fd, SOL_SOCKET, SO_REUSEADDR, &opt_val, 
-                   sizeof(opt_val)) < 0) {
-        syslog(LOG_ERR, "setsockopt failed: %s", strerror(errno));
+    if (pin_shards && shard_pin_enable() != 0) {
         cleanup();
         return -1;
     }
     
-    // Bind socket
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+    // Daemonize if requested
+    if (daemon_mode) {
+        if (daemonize() < 0) {
+            cleanup();
+            return -1;
+        }
+    }
     
-    if (bind(g_server_fd, (struct sockaddr *)&server_addr, 
-             sizeof(server_addr)) < 0) {
-        syslog(LOG_ERR, "bind failed: %s", strerror(errno));
+    // The stats thread has to run in the daemon, so it is started after the fork
+    if (stats_start(stats_socket) != 0) {
         cleanup();
         return -1;
     }
     
-    // Listen
-    if (listen(g_server_fd, 5) < 0) {
-        syslog(LOG_ERR, "listen failed: %s", strerror(errno));
+    if (cache_size > 0 && log_cache_init(cache_size) != 0) {
+        cleanup();
+        return -1;
+    }
+    if (gzip_level > 0 && log_gzip_init(gzip_level) != 0) {
         cleanup();
         return -1;
     }
     
-    // Daemonize if requested
-    if (daemon_mode) {
-        if (daemonize() < 0) {
-            cleanup();
-            return -1;
+    // Open the data log, then start the writer thread that appends to it
+    if (storage_open() != 0) {
+        cleanup();
+        return -1;
+    }
+    int result = log_writer_start();
+    if (result != 0) {
+        cleanup();
+        return -1;
+    }
+    
+    // Event-driven mode: the loops own the listener and run the timers
+    // until shutdown
+    if (engine != ENGINE_THREAD) {
+        if (engine == ENGINE_URING) {
+            result = uring_loop_run(nloops);
+        } else {
+            result = event_loop_run(nloops);
         }
+        cleanup();
+        return result;
     }
     
-    // Start timestamp thread
-    pthread_t timestamp_tid;
-    if (pthread_create(&timestamp_tid, NULL, timestamp_thread, NULL) != 0) {
-        syslog(LOG_ERR, "Failed to create timestamp thread: %s", strerror(errno));
+    // Thread mode: timestamps and deadlines run on the timer thread
+    if (timer_wheel_init(&g_timers) != 0) {
+        cleanup();
+        return -1;
+    }
+    timestamp_start(&g_timers);
+    if (pthread_create(&g_timer_tid, NULL, timer_thread, NULL) != 0) {
+        syslog(LOG_ERR, "Failed to create timer thread: %s", strerror(errno));
         cleanup();
         return -1;
     }
+    g_timer_started = 1;
     
-    // Main loop: accept connections
-    while (!g_signal_received) {
-        struct sockaddr_in client_addr;
-        socklen_t client_addr_len = sizeof(client_addr);
-        
-        int client_fd = accept(g_server_fd, (struct sockaddr *)&client_addr, 
-                              &client_addr_len);
-        
-        if (client_fd < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            if (g_signal_received || g_server_fd < 0) {
-                break;
-            }
-            syslog(LOG_ERR, "accept failed: %s", strerror(errno));
-            continue;
-        }
-        
-        // Create thread node for this connection
-        struct thread_node *node = malloc(sizeof(struct thread_node));
-        if (!node) {
-            syslog(LOG_ERR, "malloc failed for thread node: %s", strerror(errno));
-            close(client_fd);
-            continue;
-        }
-        
-        node->client_fd = client_fd;
-        node->client_addr = client_addr;
-        node->next = NULL;
-        
-        // Create thread for this connection
-        if (pthread_create(&node->thread_id, NULL, handle_client_thread, node) != 0) {
-            syslog(LOG_ERR, "Failed to create thread: %s", strerror(errno));
-            free(node);
-            close(client_fd);
-            continue;
+    // Pre-spawn the worker pool if requested
+    if (pool_workers > 0) {
+        if (thread_pool_start(&g_pool, pool_workers, pool_queue_depth,
+                              handle_client_pooled) != 0) {
+            cleanup();
+            return -1;
         }
-        
-        // Add thread to list
-        add_thread_node(node);
-        
-        // Clean up any completed threads (as recommended by assignment)
-        // This ensures threads are freed after starting the next thread
-        cleanup_completed_threads();
+        g_pool_started = 1;
     }
     
-    // Wait for timestamp thread to complete
-    pthread_join(timestamp_tid, NULL);
+    // Accept threads: shard 0 runs on the main thread
+    while (g_accept_started < nloops - 1) {
+        int shard = g_accept_started + 1;
+        if (pthread_create(&g_accept_tids[g_accept_started], NULL, accept_thread,
+                           (void *)(intptr_t)shard) != 0) {
+            syslog(LOG_ERR, "Failed to create accept thread: %s", strerror(errno));
+            cleanup();
+            return -1;
+        }
+        g_accept_started++;
+    }
+    accept_loop(0);
     
-    // Cleanup (will join all client threads)
+    // Cleanup (will join all client threads and the timer thread)
     cleanup();
     
     return 0;
@@ -0,0 +1,170 @@
+/**
+ * @file aesdsocket.h
+ * @brief Shared definitions for the aesdsocket server and its engines
+ *
+ * The connection engines (thread-per-connection in aesdsocket.c, the epoll
+ * event loop in event-loop.c and the io_uring loop in uring-loop.c) share
+ * the data file helpers and the global shutdown state declared here.
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "log-gzip.h"
+#include "storage.h"
+
+// Build with USE_AESD_CHAR_DEVICE=1 to store packets in the aesdchar driver
+// unless another backend is picked with -B
+#ifndef USE_AESD_CHAR_DEVICE
+#define USE_AESD_CHAR_DEVICE 0
+#endif
+
+#define PORT 9000
+#define DATA_FILE "/var/tmp/aesdsocketdata"
+#define CHAR_DEVICE "/dev/aesdchar"
+// Directory of log segment files of the segments backend
+#define SEGMENT_DIR "/var/tmp/aesdsocketdata.d"
+#define BUFFER_SIZE 1024
+#define TIMESTAMP_INTERVAL 10
+
+// Largest sendfile() request, and the bounce buffer used without zero-copy
+#define SEND_CHUNK_SIZE (1024 * 1024)
+// Bounce buffer of backends that can't be spliced, held by every event loop
+// and by every reply of the thread engine
+#define SEND_BUFFER_SIZE (16 * BUFFER_SIZE)
+// The chardev backend copies out of the driver or its mmap() mirror, where
+// each read is a lookup of its own, so it gets fewer and larger ones
+#define CHAR_DEVICE_SEND_BUFFER_SIZE (128 * BUFFER_SIZE)
+
+// Set by the signal handler once SIGINT/SIGTERM is caught
+extern volatile sig_atomic_t g_signal_received;
+
+// eventfd signalled on shutdown so epoll loops wake up promptly
+extern int g_wakeup_fd;
+
+// Mutex serializing appends to the data log; readers never take it
+extern pthread_mutex_t g_file_mutex;
+
+// Set by -D: connections start in delta reply mode
+extern int g_delta_replies;
+
+// Set by -p: longest packet a connection may send, newline included
+extern size_t g_max_packet_size;
+
+// Set by -H: unsent reply bytes past which an event-driven connection stops
+// reading, 0 for no limit
+extern size_t g_send_queue_high;
+
+// Set by -C: a queued full reply not yet started is replaced by the next one
+extern int g_coalesce_replies;
+
+struct log_chunk;
+struct timer_wheel;
+struct deadline;
+
+/**
+ * A reply still to be sent: bytes [offset, end) of the log.  Bytes below
+ * disk_end come from fd, the rest from the cached chunks.  An end and
+ * disk_end of -1 mean fd is sent until EOF.  A compressed reply sends bytes
+ * [offset, end) of the compressed stream from its chunks, then trailer.
+ */
+struct reply {
+    off_t offset;
+    off_t end;
+    off_t disk_end;
+    struct storage_extent extent; // holding offset, fetched as the reply gets there
+    int zero_copy;              // cleared if extents can't be used with sendfile()
+    struct log_chunk *chunk;    // cache snapshot reference, NULL without cache
+    struct log_chunk *cursor;   // chunk holding offset
+    struct reply *next;         // link in a connection's reply queue
+    off_t start;                // offset the reply started at, for statistics
+    uint64_t opened;            // stats_now() when the reply was opened
+    struct deadline *deadline;  // stamped as bytes go out, NULL for none
+    int compressed;             // a gzip member of the log (AESD_CMD:gzip)
+    size_t trailer_sent;
+    unsigned char trailer[LOG_GZIP_TRAILER_SIZE];
+};
+
+/**
+ * Reply mode of one connection.  In delta mode a reply starts where the
+ * previous one ended, so the client only receives bytes it hasn't seen.
+ */
+struct reply_state {
+    int delta;
+    int resync;     // next reply covers the whole log, once
+    int gzip;       // full replies are compressed
+    off_t sent;     // log offset the previous reply ended at
+};
+
+// Packets "AESD_CMD:<name>\n" control the reply mode instead of being stored
+#define REPLY_CMD_PREFIX "AESD_CMD:"
+
+enum reply_command {
+    REPLY_CMD_NONE,     // not a command, store the packet
+    REPLY_CMD_DELTA,    // reply with new bytes only
+    REPLY_CMD_FULL,     // reply with the whole log (the default)
+    REPLY_CMD_RESYNC,   // send the whole log once, then carry on
+    REPLY_CMD_GZIP,     // send full replies as gzip members (needs -z)
+    REPLY_CMD_PLAIN,    // send full replies uncompressed (the default)
+};
+
+int append_to_file(const char *data, size_t len);
+
+/**
+ * Append an RFC 2822 timestamp to the log every TIMESTAMP_INTERVAL seconds
+ * from @param wheel; each engine starts it on exactly one of its wheels
+ */
+void timestamp_start(struct timer_wheel *wheel);
+int send_file_contents(int sockfd, struct reply_state *state, struct deadline *deadline);
+
+void reply_state_init(struct reply_state *state);
+
+/**
+ * @return the command held in @param packet (newline included), or
+ * REPLY_CMD_NONE for ordinary data
+ */
+enum reply_command reply_parse_command(const char *packet, size_t len);
+
+void reply_apply_command(struct reply_state *state, enum reply_command command);
+
+/**
+ * Snapshot the committed log into @param reply, starting where
+ * @param state (NULL for a full reply) says and recording where it ends:
+ * at log offset @param end, the end of the packet it answers, or with
+ * everything committed so far if that is -1.  Backends without stable
+ * offsets always send until EOF, and a compressed reply is the newest whole
+ * gzip member.
+ * @return 0 on success (the reply may be empty), -1 on error
+ */
+int reply_open(struct reply *reply, struct reply_state *state, off_t end);
+
+/**
+ * Send what is left of @param reply, using @param buffer if the data has
+ * to be copied through user space
+ * @return 1 once everything is sent, 0 if a non-blocking socket would
+ * block, -1 on error or shutdown
+ */
+int reply_send(int sockfd, struct reply *reply, char *buffer, size_t buffer_size);
+
+void reply_close(struct reply *reply);
+
+/**
+ * Run the epoll engine with @param nloops event loop threads, loop i
+ * accepting on shard_listener(i). Returns once shutdown is requested and
+ * every loop has closed its connections, 0 on success or -1 if no loop
+ * could be started.
+ */
+int event_loop_run(int nloops);
+
+/**
+ * Run the io_uring engine with @param nloops rings, with the same contract
+ * as event_loop_run()
+ */
+int uring_loop_run(int nloops);
+
+#endif /* AESDSOCKET_H */
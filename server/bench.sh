@@ -0,0 +1,106 @@
+#!/bin/bash
+# Runs aesdsocket-bench against each aesdsocket mode and prints one result
+# line per mode, so runs on different builds or machines can be compared.
+#
+# Every mode gets a fresh server and an empty log.  The load is set through
+# the environment:
+#   CONNECTIONS  concurrent connections (default 8)
+#   THREADS      load generator threads (default 4)
+#   SIZE         packet size in bytes (default 64)
+#   RATE         packets per second per connection, 0 for no limit (default 0)
+#   DEPTH        packets in flight per connection (default 1)
+#   DURATION     seconds per mode (default 5)
+#   REPLIES      reply modes to run, "full", "delta" and/or "gzip" (default
+#                all three; gzip starts the server with -z 6)
+#   MODES        server arguments to run, separated by ';' (default below)
+#   BACKENDS     storage backends (-B) to run every mode on (default below)
+#
+# The chardev backend is benchmarked as well when /dev/aesdchar is present,
+# which needs the driver loaded and root.  Modes with -c are skipped on the
+# backends that don't support a cache, and gzip replies on the ones that
+# don't support -z.  Every run of the segments backend starts from an empty
+# segment directory.
+
+set -e
+cd "$(dirname "$0")"
+
+CONNECTIONS=${CONNECTIONS:-8}
+THREADS=${THREADS:-4}
+SIZE=${SIZE:-64}
+RATE=${RATE:-0}
+DEPTH=${DEPTH:-1}
+DURATION=${DURATION:-5}
+REPLIES=${REPLIES:-"full delta gzip"}
+MODES=${MODES:-"-m thread;-m thread -w 4;-m epoll;-m epoll -n 4;-m epoll -n 4 -R -A;-m epoll -c 64m;-m uring;-m uring -n 4;-m uring -n 4 -R -A"}
+if [ -z "${BACKENDS}" ]; then
+    BACKENDS="file memory segments"
+    if [ -e /dev/aesdchar ]; then
+        BACKENDS="${BACKENDS} chardev"
+    else
+        echo "chardev    skipped: /dev/aesdchar not present"
+    fi
+fi
+PORT=9000
+DATA_FILE=/var/tmp/aesdsocketdata
+SEGMENT_DIR=/var/tmp/aesdsocketdata.d
+
+wait_for_port() {
+    for i in $(seq 50); do
+        if (exec 3<>/dev/tcp/127.0.0.1/${PORT}) 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+# run_modes <backend>: benchmark every entry of MODES storing the log there
+run_modes() {
+    local label=$1
+    local IFS=';'
+    for mode in ${MODES}; do
+        IFS=' '
+        case "${label} ${mode} " in
+            "file "*|"segments "*) ;;
+            *" -c "*) IFS=';'; continue ;;
+        esac
+        for replies in ${REPLIES}; do
+            local client=""
+            local server=""
+            if [ "${replies}" = "delta" ]; then
+                client="-D"
+            elif [ "${replies}" = "gzip" ]; then
+                case "${label}" in chardev|segments) continue ;; esac
+                client="-z"
+                server="-z 6"
+            fi
+            rm -rf ${DATA_FILE} ${SEGMENT_DIR}
+            ./aesdsocket -B ${label} ${mode} ${server} &
+            local pid=$!
+            if ! wait_for_port; then
+                echo "${label} ${mode}: server did not start" >&2
+                kill ${pid} 2>/dev/null || true
+                wait ${pid} || true
+                continue
+            fi
+            # A mode failing its check is reported in its line, keep going
+            local result
+            result=$(./aesdsocket-bench -c ${CONNECTIONS} -t ${THREADS} -s ${SIZE} \
+                     -r ${RATE} -d ${DEPTH} -T ${DURATION} ${client}) || true
+            kill -TERM ${pid}
+            wait ${pid} || true
+            printf "%-10s %-22s %-6s %s\n" "${label}" "${mode}" "${replies}" "${result}"
+        done
+        IFS=';'
+    done
+}
+
+echo "connections=${CONNECTIONS} size=${SIZE} rate=${RATE} depth=${DEPTH} duration=${DURATION}s"
+
+make clean >/dev/null
+make aesdsocket bench >/dev/null
+for backend in ${BACKENDS}; do
+    run_modes ${backend}
+done
+# The segments backend keeps its log, drop what the runs left
+rm -rf ${SEGMENT_DIR}
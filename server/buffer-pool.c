@@ -0,0 +1,217 @@
+/**
+ * @file buffer-pool.c
+ * @brief Size-class pool recycling receive buffers, replies and connections
+ *
+ * Blocks come in power of two size classes.  Each thread keeps a free list
+ * per class, so the common allocation and free are a pop and a push on a
+ * thread-local list, with no lock and no trip into malloc().  A thread
+ * whose list runs dry takes a batch from a shared depot, and one whose list
+ * grows past its limit hands half of it back, so blocks freed by one thread
+ * (a pool worker finishing a connection the accept loop allocated, or a
+ * connection thread exiting) are reused by the others.  The depot lock is
+ * only taken once per batch.  Blocks beyond what the depot keeps are freed.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "buffer-pool.h"
+#include "stats.h"
+
+#define BUFFER_POOL_CLASSES (BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1)
+// Per class, a thread caches at most this many bytes or blocks...
+#define BUFFER_POOL_THREAD_BYTES (1024 * 1024)
+#define BUFFER_POOL_THREAD_BLOCKS 256
+// ...and the depot this many times as much
+#define BUFFER_POOL_DEPOT_FACTOR 8
+
+// A free block, linked through its first bytes
+struct pool_block {
+    struct pool_block *next;
+};
+
+struct pool_list {
+    struct pool_block *head;
+    size_t count;
+};
+
+static __thread struct pool_list t_cache[BUFFER_POOL_CLASSES];
+static __thread int t_registered;
+
+static struct {
+    pthread_mutex_t lock;
+    struct pool_list depot[BUFFER_POOL_CLASSES];
+    pthread_key_t key;  // destructor returns an exiting thread's blocks
+    pthread_once_t key_once;
+} g_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .key_once = PTHREAD_ONCE_INIT,
+};
+
+/**
+ * @return the class of a @param size byte block, -1 if it isn't pooled
+ */
+static int buffer_pool_class(size_t size)
+{
+    if (size <= ((size_t)1 << BUFFER_POOL_MIN_SHIFT)) {
+        return 0;
+    }
+    if (size > ((size_t)1 << BUFFER_POOL_MAX_SHIFT)) {
+        return -1;
+    }
+    int shift = (int)(sizeof(unsigned long) * 8) - __builtin_clzl(size - 1);
+    return shift - BUFFER_POOL_MIN_SHIFT;
+}
+
+static size_t buffer_pool_class_size(int c)
+{
+    return (size_t)1 << (c + BUFFER_POOL_MIN_SHIFT);
+}
+
+/**
+ * @return how many blocks of class @param c a thread keeps
+ */
+static size_t buffer_pool_thread_limit(int c)
+{
+    size_t limit = BUFFER_POOL_THREAD_BYTES / buffer_pool_class_size(c);
+    if (limit > BUFFER_POOL_THREAD_BLOCKS) {
+        limit = BUFFER_POOL_THREAD_BLOCKS;
+    }
+    return limit > 0 ? limit : 1;
+}
+
+static void pool_list_push(struct pool_list *list, struct pool_block *block)
+{
+    block->next = list->head;
+    list->head = block;
+    list->count++;
+}
+
+static struct pool_block *pool_list_pop(struct pool_list *list)
+{
+    struct pool_block *block = list->head;
+    if (block != NULL) {
+        list->head = block->next;
+        list->count--;
+    }
+    return block;
+}
+
+/**
+ * Move up to @param count blocks of class @param c from @param list to the
+ * depot, freeing those it has no room for
+ */
+static void buffer_pool_spill(struct pool_list *list, int c, size_t count)
+{
+    struct pool_list excess = { NULL, 0 };
+    size_t depot_limit = BUFFER_POOL_DEPOT_FACTOR * buffer_pool_thread_limit(c);
+
+    pthread_mutex_lock(&g_pool.lock);
+    while (count-- > 0 && list->head != NULL) {
+        struct pool_block *block = pool_list_pop(list);
+        if (g_pool.depot[c].count < depot_limit) {
+            pool_list_push(&g_pool.depot[c], block);
+        } else {
+            pool_list_push(&excess, block);
+        }
+    }
+    pthread_mutex_unlock(&g_pool.lock);
+
+    struct pool_block *block;
+    while ((block = pool_list_pop(&excess)) != NULL) {
+        free(block);
+    }
+}
+
+/**
+ * Thread exit: hand every cached block to the depot
+ */
+static void buffer_pool_thread_exit(void *arg)
+{
+    struct pool_list *cache = arg;
+    for (int c = 0; c < BUFFER_POOL_CLASSES; c++) {
+        buffer_pool_spill(&cache[c], c, cache[c].count);
+    }
+}
+
+static void buffer_pool_key_create(void)
+{
+    pthread_key_create(&g_pool.key, buffer_pool_thread_exit);
+}
+
+void *buffer_pool_alloc(size_t size, size_t *capacity)
+{
+    int c = buffer_pool_class(size);
+    if (c < 0) {
+        stats_count(STATS_POOL_MISSES, 1);
+        if (capacity != NULL) {
+            *capacity = size;
+        }
+        return malloc(size);
+    }
+
+    struct pool_list *cache = &t_cache[c];
+    if (cache->head == NULL) {
+        // Refill half a thread's worth at once
+        size_t batch = (buffer_pool_thread_limit(c) + 1) / 2;
+        pthread_mutex_lock(&g_pool.lock);
+        while (batch-- > 0 && g_pool.depot[c].head != NULL) {
+            pool_list_push(cache, pool_list_pop(&g_pool.depot[c]));
+        }
+        pthread_mutex_unlock(&g_pool.lock);
+    }
+
+    if (capacity != NULL) {
+        *capacity = buffer_pool_class_size(c);
+    }
+    struct pool_block *block = pool_list_pop(cache);
+    if (block != NULL) {
+        stats_count(STATS_POOL_HITS, 1);
+        return block;
+    }
+    stats_count(STATS_POOL_MISSES, 1);
+    return malloc(buffer_pool_class_size(c));
+}
+
+void buffer_pool_free(void *ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    int c = buffer_pool_class(size);
+    if (c < 0) {
+        free(ptr);
+        return;
+    }
+
+    if (!t_registered) {
+        // The destructor only runs for threads with a non-NULL value
+        pthread_once(&g_pool.key_once, buffer_pool_key_create);
+        pthread_setspecific(g_pool.key, t_cache);
+        t_registered = 1;
+    }
+
+    struct pool_list *cache = &t_cache[c];
+    pool_list_push(cache, ptr);
+    size_t limit = buffer_pool_thread_limit(c);
+    if (cache->count > limit) {
+        buffer_pool_spill(cache, c, cache->count - limit / 2);
+    }
+}
+
+void buffer_pool_drain(void)
+{
+    struct pool_block *block;
+
+    for (int c = 0; c < BUFFER_POOL_CLASSES; c++) {
+        while ((block = pool_list_pop(&t_cache[c])) != NULL) {
+            free(block);
+        }
+        pthread_mutex_lock(&g_pool.lock);
+        while ((block = pool_list_pop(&g_pool.depot[c])) != NULL) {
+            free(block);
+        }
+        pthread_mutex_unlock(&g_pool.lock);
+    }
+}
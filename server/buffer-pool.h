@@ -0,0 +1,34 @@
+/**
+ * @file buffer-pool.h
+ * @brief Size-class pool recycling receive buffers, replies and connections
+ */
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+// Smallest and largest pooled size class, 64 bytes to 1MB; larger
+// requests go straight to malloc()
+#define BUFFER_POOL_MIN_SHIFT 6
+#define BUFFER_POOL_MAX_SHIFT 20
+
+/**
+ * Allocate at least @param size bytes.  The block is rounded up to its size
+ * class, whose size is stored in @param capacity unless it is NULL.
+ * @return the block, NULL if out of memory
+ */
+void *buffer_pool_alloc(size_t size, size_t *capacity);
+
+/**
+ * Return @param ptr, allocated with a @param size (the size asked for or
+ * the capacity returned) falling in the same class
+ */
+void buffer_pool_free(void *ptr, size_t size);
+
+/**
+ * Free every block cached by the pool (calling thread and shared depot)
+ */
+void buffer_pool_drain(void);
+
+#endif /* BUFFER_POOL_H */
@@ -0,0 +1,167 @@
+/**
+ * @file char-map.c
+ * @brief Read-only mapping of the aesdchar command history
+ *
+ * When the driver is loaded with mmap_size, it mirrors its commands into a
+ * ring that can be mapped read-only (see aesd_mmap.h).  Replies are then
+ * copied straight from the mapping instead of through read(), which saves
+ * a system call and the driver's lock per chunk.  The driver updates the
+ * mapping under a generation counter, so a copy is retried if the counter
+ * changed while it ran.  The bytes are copied out rather than passed to
+ * send() directly because a torn send could not be taken back.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/mman.h>
+
+#include "aesd_mmap.h"
+#include "char-map.h"
+
+// Give up on the mapping for one read if the driver keeps updating it
+#define CHAR_MAP_RETRIES 16
+
+static struct aesd_mmap_header *g_map;
+static size_t g_map_size;
+
+int char_map_open(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // The first page tells how much there is to map
+    struct aesd_mmap_header *header = mmap(NULL, sizeof(*header), PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if (header->magic != AESD_MMAP_MAGIC || header->version != AESD_MMAP_VERSION) {
+        syslog(LOG_WARNING, "%s exports an unknown mapping layout, not using it", path);
+        munmap(header, sizeof(*header));
+        close(fd);
+        return -1;
+    }
+    size_t map_size = header->map_size;
+    munmap(header, sizeof(*header));
+
+    header = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        syslog(LOG_ERR, "Failed to map %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    g_map = header;
+    g_map_size = map_size;
+    return 0;
+}
+
+int char_map_enabled(void)
+{
+    return g_map != NULL;
+}
+
+void char_map_close(void)
+{
+    if (g_map != NULL) {
+        munmap(g_map, g_map_size);
+        g_map = NULL;
+    }
+}
+
+/**
+ * Copy bytes from one consistent view of the mapping, which may be torn
+ * @return as char_map_read(), or -2 if the view can't be trusted
+ */
+static ssize_t char_map_copy(const struct aesd_mmap_header *header, char *buf, size_t len,
+                             off_t offset)
+{
+    const volatile struct aesd_mmap_header *live = header;
+    const char *data = (const char *)header + header->data_offset;
+    uint64_t data_size = header->data_size;
+    uint32_t max_entries = header->max_entries;
+    uint32_t first = live->first;
+    uint32_t count = live->count;
+
+    if (!live->complete) {
+        errno = ENODATA;
+        return -1;
+    }
+    if (first >= max_entries || count > max_entries) {
+        return -2;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    // Last entry starting at or before the requested offset
+    uint64_t target = header->entries[first].start + offset;
+    uint32_t low = 0;
+    uint32_t high = count;
+    while (high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
+        if (header->entries[(first + mid) % max_entries].start <= target) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+
+    size_t copied = 0;
+    for (uint32_t i = low; i < count && copied < len; i++) {
+        const struct aesd_mmap_entry *entry = &header->entries[(first + i) % max_entries];
+        uint64_t pos = entry->pos;
+        uint64_t size = entry->size;
+        uint64_t skip = target > entry->start ? target - entry->start : 0;
+
+        if (pos % data_size + size > data_size) {
+            return -2;
+        }
+        if (skip >= size) {
+            continue;
+        }
+        size_t n = size - skip;
+        if (n > len - copied) {
+            n = len - copied;
+        }
+        memcpy(buf + copied, data + pos % data_size + skip, n);
+        copied += n;
+    }
+    return copied;
+}
+
+ssize_t char_map_read(char *buf, size_t len, off_t offset)
+{
+    struct aesd_mmap_header *header = g_map;
+    if (header == NULL) {
+        errno = ENODATA;
+        return -1;
+    }
+    _Atomic uint32_t *generation = (_Atomic uint32_t *)&header->generation;
+
+    for (int attempt = 0; attempt < CHAR_MAP_RETRIES; attempt++) {
+        uint32_t before = atomic_load_explicit(generation, memory_order_acquire);
+        if (before & 1) {
+            // Update in progress
+            continue;
+        }
+
+        ssize_t result = char_map_copy(header, buf, len, offset);
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(generation, memory_order_relaxed) == before && result != -2) {
+            return result;
+        }
+    }
+
+    errno = ENODATA;
+    return -1;
+}
@@ -0,0 +1,31 @@
+/**
+ * @file char-map.h
+ * @brief Read-only mapping of the aesdchar command history
+ */
+
+#ifndef CHAR_MAP_H
+#define CHAR_MAP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Map the mirror of @param path, if the driver exports one
+ * @return 0 on success, -1 if the device can't be mapped (replies are then
+ * read from the device as before)
+ */
+int char_map_open(const char *path);
+
+int char_map_enabled(void);
+
+void char_map_close(void);
+
+/**
+ * Copy up to @param len bytes of the command history starting at
+ * @param offset into @param buf, like pread() on the device would
+ * @return the number of bytes copied, 0 at the end of the history, or -1
+ * with errno ENODATA when it has to be read from the device instead
+ */
+ssize_t char_map_read(char *buf, size_t len, off_t offset);
+
+#endif /* CHAR_MAP_H */
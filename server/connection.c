@@ -0,0 +1,318 @@
+/**
+ * @file connection.c
+ * @brief Client connection state shared by the event-driven engines
+ *
+ * The epoll and io_uring engines differ in how they learn that a socket is
+ * readable or writable, but once bytes are in a connection's receive buffer
+ * both split them into packets, append them in batches and queue one reply
+ * per packet the same way.  A batch is handed to the writer without waiting
+ * for its group commit, so a slow disk doesn't hold up the other
+ * connections and the deadlines of the thread.  The writer hands each
+ * packet back through the thread's completions, and the replies are queued
+ * once the whole batch is committed.  Meanwhile the connection reads
+ * nothing, which keeps the packets in place in its receive buffer.
+ *
+ * Replies only hold a snapshot of the log, so queueing one is cheap, but a
+ * client not reading them still pins log cache chunks and keeps its loop
+ * busy.  The queue is bounded by bytes left to send: past the high water
+ * mark the connection stops processing packets and the engine stops reading
+ * its socket, letting TCP push back on the client, until it has read its
+ * replies down to the low water mark.  With -C a full reply that hasn't
+ * started yet is replaced by the next one, which covers it.  A connection
+ * that stays paused past the send timeout is closed by its deadline.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "connection.h"
+#include "log-writer.h"
+#include "stats.h"
+#include "buffer-pool.h"
+
+/**
+ * One packet of a batch.  The writer hands back &req, the first member.
+ */
+struct connection_append {
+    struct log_write req;
+    struct connection_batch *batch;
+};
+
+/**
+ * Packets of one connection appended together, with the commands among
+ * them that are only answered.  The data stays in the receive buffer.
+ */
+struct connection_batch {
+    struct connection *conn;
+    int count;
+    off_t start;            // committed log length before the batch
+    uint64_t submitted;     // stats_now() when handed to the writer
+    enum reply_command commands[CONNECTION_APPEND_BATCH];
+    struct connection_append appends[CONNECTION_APPEND_BATCH];
+};
+
+/**
+ * @return the bytes @param reply still counts for in the queue.  Char device
+ * replies are read until EOF, so they count as one bounce buffer until done.
+ */
+static size_t connection_reply_size(const struct reply *reply)
+{
+    if (reply->end < 0) {
+        return storage_send_buffer_size();
+    }
+    size_t size = reply->end > reply->offset ? (size_t)(reply->end - reply->offset) : 0;
+    if (reply->compressed) {
+        size += sizeof(reply->trailer) - reply->trailer_sent;
+    }
+    return size;
+}
+
+/**
+ * Free every queued reply of @param conn
+ */
+static void connection_free_replies(struct connection *conn)
+{
+    struct reply *reply = conn->reply_head;
+    while (reply != NULL) {
+        struct reply *next = reply->next;
+        reply_close(reply);
+        buffer_pool_free(reply, sizeof(struct reply));
+        reply = next;
+    }
+    conn->reply_head = NULL;
+    conn->reply_tail = NULL;
+    conn->queued = 0;
+}
+
+/**
+ * Queue a reply covering the log up to offset @param end, where the packet
+ * it answers ends
+ */
+static int connection_queue_reply(struct connection *conn, off_t end)
+{
+    struct reply *reply = buffer_pool_alloc(sizeof(struct reply), NULL);
+    if (!reply) {
+        syslog(LOG_ERR, "malloc failed for reply: %s", strerror(errno));
+        return -1;
+    }
+    if (reply_open(reply, &conn->state, end) != 0) {
+        buffer_pool_free(reply, sizeof(struct reply));
+        return -1;
+    }
+    reply->deadline = &conn->deadline;
+
+    struct reply *tail = conn->reply_tail;
+    if (g_coalesce_replies && tail != NULL && tail->offset == tail->start &&
+        reply->offset <= tail->start && reply->compressed == tail->compressed) {
+        // Nothing of the tail went out yet and the new reply covers it
+        conn->queued -= connection_reply_size(tail);
+        reply_close(tail);
+        *tail = *reply;
+        buffer_pool_free(reply, sizeof(struct reply));
+        conn->queued += connection_reply_size(tail);
+        stats_count(STATS_COALESCED, 1);
+        return 0;
+    }
+
+    conn->queued += connection_reply_size(reply);
+    if (conn->reply_tail != NULL) {
+        conn->reply_tail->next = reply;
+    } else {
+        conn->reply_head = reply;
+    }
+    conn->reply_tail = reply;
+    return 0;
+}
+
+/**
+ * Queue a reply for every packet of the committed batch of @param conn and
+ * free it
+ * @return 0 on success, -1 if a packet could not be appended or a reply
+ * not opened
+ */
+static int connection_queue_batch(struct connection *conn)
+{
+    struct connection_batch *batch = conn->batch;
+    off_t end = batch->start;
+    int result = 0;
+
+    // Each reply stops at its own packet, as if the packets had come one at
+    // a time; a command is answered with the log up to the one before
+    for (int i = 0; i < batch->count && result == 0; i++) {
+        if (batch->commands[i] == REPLY_CMD_NONE) {
+            if (batch->appends[i].req.result != 0) {
+                result = -1;
+                break;
+            }
+            end = batch->appends[i].req.end;
+        }
+        reply_apply_command(&conn->state, batch->commands[i]);
+        result = connection_queue_reply(conn, end);
+    }
+
+    conn->batch = NULL;
+    buffer_pool_free(batch, sizeof(struct connection_batch));
+    return result;
+}
+
+struct connection *connection_create(int fd, const struct sockaddr_in *addr,
+                                     struct log_completions *completions)
+{
+    struct connection *conn = buffer_pool_alloc(sizeof(struct connection), NULL);
+    if (!conn) {
+        syslog(LOG_ERR, "malloc failed for connection: %s", strerror(errno));
+        return NULL;
+    }
+    memset(conn, 0, sizeof(struct connection));
+    conn->fd = fd;
+    conn->completions = completions;
+    packet_buffer_init(&conn->rx);
+    reply_state_init(&conn->state);
+    inet_ntop(AF_INET, &addr->sin_addr, conn->ip, INET_ADDRSTRLEN);
+    stats_count(STATS_ACCEPTED, 1);
+    return conn;
+}
+
+void connection_destroy(struct connection *conn)
+{
+    timer_cancel(&conn->deadline.timer);
+    close(conn->fd);
+    syslog(LOG_INFO, "Closed connection from %s", conn->ip);
+    stats_count(STATS_CLOSED, 1);
+
+    connection_free_replies(conn);
+    buffer_pool_free(conn->batch, sizeof(struct connection_batch));
+    packet_buffer_free(&conn->rx);
+    buffer_pool_free(conn, sizeof(struct connection));
+}
+
+/**
+ * Stop taking packets from @param conn until its replies drain
+ */
+static void connection_pause(struct connection *conn)
+{
+    if (!conn->paused) {
+        conn->paused = 1;
+        deadline_stalled(&conn->deadline, 1);
+        stats_count(STATS_PAUSED, 1);
+    }
+}
+
+int connection_flush(struct connection *conn, char *buffer, size_t buffer_size)
+{
+    struct reply *reply;
+
+    for (;;) {
+        int blocked = 0;
+
+        while ((reply = conn->reply_head) != NULL) {
+            size_t before = connection_reply_size(reply);
+            int result = reply_send(conn->fd, reply, buffer, buffer_size);
+            if (result < 0) {
+                return -1;
+            }
+            if (result == 0) {
+                // Socket buffer is full, the engine waits for it to drain
+                conn->queued -= before - connection_reply_size(reply);
+                blocked = 1;
+                break;
+            }
+
+            conn->queued -= before;
+            conn->reply_head = reply->next;
+            if (conn->reply_head == NULL) {
+                conn->reply_tail = NULL;
+            }
+            reply_close(reply);
+            buffer_pool_free(reply, sizeof(struct reply));
+        }
+
+        if (!conn->paused || conn->queued > CONNECTION_LOW_WATER(g_send_queue_high)) {
+            return 0;
+        }
+        // Caught up: take the packets held back, which may pause it again
+        conn->paused = 0;
+        deadline_stalled(&conn->deadline, 0);
+        if (connection_process_packets(conn) != 0) {
+            return -1;
+        }
+        if (blocked || conn->reply_head == NULL) {
+            return 0;
+        }
+    }
+}
+
+int connection_process_packets(struct connection *conn)
+{
+    const char *packet;
+    size_t packet_len;
+
+    // One batch at a time, the next is taken once it is committed
+    while (conn->batch == NULL) {
+        if (g_send_queue_high > 0 && conn->queued > g_send_queue_high) {
+            connection_pause(conn);
+            break;
+        }
+
+        // The views stay valid until the next packet_buffer_reserve(),
+        // which the engine doesn't get to before the batch is done
+        struct connection_batch *batch = NULL;
+        while ((batch == NULL || batch->count < CONNECTION_APPEND_BATCH) &&
+               packet_buffer_next(&conn->rx, &packet, &packet_len)) {
+            if (batch == NULL) {
+                batch = buffer_pool_alloc(sizeof(struct connection_batch), NULL);
+                if (!batch) {
+                    syslog(LOG_ERR, "malloc failed for append batch: %s", strerror(errno));
+                    return -1;
+                }
+                batch->conn = conn;
+                batch->count = 0;
+                // Everything the connection sent before the batch is committed
+                batch->start = log_writer_committed();
+                batch->submitted = stats_now();
+                conn->batch = batch;
+            }
+            // Commands are not stored, only answered in order
+            int i = batch->count++;
+            batch->commands[i] = reply_parse_command(packet, packet_len);
+            if (batch->commands[i] == REPLY_CMD_NONE) {
+                batch->appends[i].batch = batch;
+                conn->appending++;
+                log_writer_submit_async(&batch->appends[i].req, packet, packet_len,
+                                        conn->completions);
+            }
+        }
+        if (batch == NULL) {
+            break;
+        }
+        stats_count(STATS_PACKETS, batch->count);
+        if (connection_appending(conn)) {
+            // The replies are queued by connection_append_finish()
+            break;
+        }
+        if (connection_queue_batch(conn) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct connection *connection_append_done(struct log_write *req)
+{
+    struct connection_batch *batch = ((struct connection_append *)req)->batch;
+
+    stats_record_since(STATS_APPEND_NS, batch->submitted);
+    batch->conn->appending--;
+    return connection_appending(batch->conn) ? NULL : batch->conn;
+}
+
+int connection_append_finish(struct connection *conn)
+{
+    if (connection_queue_batch(conn) != 0) {
+        return -1;
+    }
+    return connection_process_packets(conn);
+}
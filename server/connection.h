@@ -0,0 +1,137 @@
+/**
+ * @file connection.h
+ * @brief Client connection state shared by the event-driven engines
+ */
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "aesdsocket.h"
+#include "packet-buffer.h"
+#include "timer.h"
+
+// Packets handed to the writer together; the connection reads no more
+// until they are committed
+#define CONNECTION_APPEND_BATCH 32
+// Reading resumes once the queued replies drop to this share of the high
+// water mark
+#define CONNECTION_LOW_WATER(high) ((high) / 4)
+
+struct connection_batch;
+struct log_completions;
+struct log_write;
+
+/**
+ * A non-blocking client socket owned by one engine thread, with the bytes
+ * received so far and the replies still to be sent, oldest first.  Once the
+ * replies queue up past g_send_queue_high the connection stops taking
+ * packets (paused) until its client has read them down to the low water
+ * mark, so a slow reader only holds up itself.  Its packets are appended
+ * a batch at a time, handed back through the completions of its thread.
+ */
+struct connection {
+    int fd;
+    char ip[INET_ADDRSTRLEN];
+    struct packet_buffer rx;
+    struct reply_state state;
+    struct reply *reply_head;
+    struct reply *reply_tail;
+    size_t queued;      // bytes left in the queued replies, see connection_flush()
+    int paused;         // packets are left in rx until the replies drain
+    int want_read;      // the engine is waiting for input
+    int want_write;     // the engine is waiting for the socket to be writable
+    struct deadline deadline;   // on the wheel of the owning engine thread
+    struct log_completions *completions;    // of the owning engine thread
+    struct connection_batch *batch;         // packets being appended, or NULL
+    int appending;      // packets of the batch the writer still holds
+    /**
+     * io_uring only: requests in flight on the ring that refer to this
+     * connection
+     */
+    int pending;
+    int closing;        // torn down once nothing in flight refers to it
+    struct connection *prev;
+    struct connection *next;
+};
+
+/**
+ * Allocate a connection for the accepted socket @param fd, whose appends
+ * are handed back through @param completions
+ * @return the connection, NULL if out of memory (fd is left open)
+ */
+struct connection *connection_create(int fd, const struct sockaddr_in *addr,
+                                     struct log_completions *completions);
+
+/**
+ * Close the socket and free @param conn with everything it still holds,
+ * cancelling its deadline.  Not while connection_appending().
+ */
+void connection_destroy(struct connection *conn);
+
+/**
+ * Hand the next batch of complete packets held in the receive buffer to the
+ * writer, unless one is with it already.  Once it is committed,
+ * connection_append_finish() queues a reply for each and takes the next.
+ * Stops early and pauses the connection once its replies are past the high
+ * water mark.
+ * @return 0 on success, -1 if the connection has to be closed
+ */
+int connection_process_packets(struct connection *conn);
+
+/**
+ * Take back @param req, one of the appends handed back by the writer
+ * @return its connection once the whole batch is committed, NULL while the
+ * writer still holds some of it
+ */
+struct connection *connection_append_done(struct log_write *req);
+
+/**
+ * Queue the replies of the committed batch of @param conn and process the
+ * packets received since
+ * @return 0 on success, -1 if the connection has to be closed
+ */
+int connection_append_finish(struct connection *conn);
+
+/**
+ * Send queued replies until they are all out or the socket would block,
+ * using @param buffer if the data has to be copied.  A paused connection
+ * whose replies drained to the low water mark resumes and has the packets
+ * it held back processed.
+ * @return 0 on success (including would-block), -1 if the connection failed
+ */
+int connection_flush(struct connection *conn, char *buffer, size_t buffer_size);
+
+/**
+ * @return whether the writer holds packets of @param conn, which point into
+ * its receive buffer
+ */
+static inline int connection_appending(const struct connection *conn)
+{
+    return conn->appending > 0;
+}
+
+/**
+ * @return whether the engine should read from @param conn.  Not while
+ * paused, nor while its packets are with the writer: more input could move
+ * them in the receive buffer.
+ */
+static inline int connection_reading(const struct connection *conn)
+{
+    return !conn->paused && conn->batch == NULL;
+}
+
+/**
+ * @return the bytes of an unterminated packet to stamp the read deadline
+ * with; none while paused, when rx holds packets on purpose and the send
+ * timeout applies instead
+ */
+static inline size_t connection_pending_input(const struct connection *conn)
+{
+    return conn->paused ? 0 : packet_buffer_pending(&conn->rx);
+}
+
+#endif /* CONNECTION_H */
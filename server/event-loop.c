@@ -0,0 +1,465 @@
+/**
+ * @file event-loop.c
+ * @brief epoll based connection engine for aesdsocket
+ *
+ * Instead of one blocking thread per client, each event loop thread owns an
+ * epoll instance holding its listening socket (shared, or one per loop with
+ * -R, see shard.c) and the non-blocking
+ * client sockets it accepted.  Received bytes are kept in a per-connection
+ * buffer, every complete packet is appended to the data file and a reply is
+ * queued on the connection.  The writer hands appends back through an
+ * eventfd of the loop, so the loop never waits for a commit.  Replies only
+ * record which range of the log has to be sent and are streamed (see
+ * reply.c) as the socket becomes writable, so an idle connection costs its
+ * struct and receive buffer and nothing else.  Each loop also runs a timer
+ * wheel, polled through its timerfd, for the deadlines of its connections;
+ * the first loop's wheel appends the timestamps as well.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+
+#include "aesdsocket.h"
+#include "log-writer.h"
+#include "packet-buffer.h"
+#include "connection.h"
+#include "stats.h"
+#include "timer.h"
+#include "shard.h"
+#include "buffer-pool.h"
+
+#define EVENT_LOOP_MAX_EVENTS 64
+// recv() calls per wakeup before giving other connections a turn
+#define EVENT_LOOP_READ_BUDGET 16
+
+struct event_loop {
+    pthread_t thread_id;
+    int shard;
+    int epoll_fd;
+    int listen_fd;
+    struct connection *connections;
+    struct timer_wheel timers;
+    struct log_completions completions;
+    char *send_buf;                     // bounce buffer without zero-copy
+    size_t send_buf_size;
+};
+
+// Markers stored in epoll_event.data.ptr for the non-connection fds
+static char g_listen_tag;
+static char g_wakeup_tag;
+static char g_timer_tag;
+static char g_completions_tag;
+
+/**
+ * Remove @param conn from its loop, close the socket and free it.  While
+ * the writer holds packets of it, it only stops getting events and is
+ * freed once they are handed back.
+ */
+static void connection_close(struct event_loop *loop, struct connection *conn)
+{
+    if (!conn->closing) {
+        conn->closing = 1;
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    }
+    if (connection_appending(conn)) {
+        return;
+    }
+
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        loop->connections = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+
+    connection_destroy(conn);
+}
+
+/**
+ * Arm or disarm EPOLLOUT depending on whether replies are pending, and
+ * EPOLLIN depending on whether the connection takes input
+ */
+static int connection_update_events(struct event_loop *loop, struct connection *conn)
+{
+    int want_read = connection_reading(conn);
+    int want_write = conn->reply_head != NULL;
+    if (want_read == conn->want_read && want_write == conn->want_write) {
+        return 0;
+    }
+
+    struct epoll_event ev;
+    ev.events = (want_read ? EPOLLIN : 0) | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+        syslog(LOG_ERR, "epoll_ctl failed: %s", strerror(errno));
+        return -1;
+    }
+    conn->want_read = want_read;
+    conn->want_write = want_write;
+    return 0;
+}
+
+/**
+ * Read what is available on @param conn and process complete packets
+ * Returns 0 to keep the connection open, -1 to close it
+ */
+static int connection_read(struct connection *conn)
+{
+    // A paused or appending connection leaves the rest in the socket buffer
+    for (int i = 0; i < EVENT_LOOP_READ_BUDGET && connection_reading(conn); i++) {
+        size_t avail;
+        char *dest = packet_buffer_reserve(&conn->rx, &avail);
+        if (!dest) {
+            return -1;
+        }
+
+        uint64_t start = stats_now();
+        ssize_t bytes_received = recv(conn->fd, dest, avail, 0);
+        stats_record_since(STATS_RECV_NS, start);
+        if (bytes_received == 0) {
+            // Connection closed
+            return -1;
+        }
+        if (bytes_received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            syslog(LOG_ERR, "recv failed: %s", strerror(errno));
+            return -1;
+        }
+
+        packet_buffer_commit(&conn->rx, bytes_received);
+        if (connection_process_packets(conn) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Timer function of a connection's deadline
+ */
+static void event_loop_timeout(struct timer *timer)
+{
+    struct event_loop *loop = timer->data;
+    struct connection *conn = timer_container(timer, struct connection, deadline.timer);
+
+    if (!conn->closing && deadline_expired(&loop->timers, &conn->deadline)) {
+        syslog(LOG_INFO, "Connection from %s timed out", conn->ip);
+        stats_count(STATS_TIMED_OUT, 1);
+        connection_close(loop, conn);
+    }
+}
+
+/**
+ * Accept every pending connection on the listening socket
+ */
+static void event_loop_accept(struct event_loop *loop)
+{
+    while (!g_signal_received) {
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+
+        int client_fd = accept4(loop->listen_fd, (struct sockaddr *)&client_addr,
+                                &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && !g_signal_received) {
+                syslog(LOG_ERR, "accept failed: %s", strerror(errno));
+            }
+            return;
+        }
+
+        struct connection *conn = connection_create(client_fd, &client_addr,
+                                                    &loop->completions);
+        if (!conn) {
+            close(client_fd);
+            continue;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            syslog(LOG_ERR, "epoll_ctl failed: %s", strerror(errno));
+            connection_destroy(conn);
+            continue;
+        }
+        conn->want_read = 1;
+
+        conn->next = loop->connections;
+        if (loop->connections != NULL) {
+            loop->connections->prev = conn;
+        }
+        loop->connections = conn;
+        deadline_start(&loop->timers, &conn->deadline, event_loop_timeout, loop);
+
+        syslog(LOG_INFO, "Accepted connection from %s", conn->ip);
+    }
+}
+
+/**
+ * Send what @param conn has queued and rearm its events
+ */
+static void event_loop_flush(struct event_loop *loop, struct connection *conn)
+{
+    if (connection_flush(conn, loop->send_buf, loop->send_buf_size) != 0 || connection_update_events(loop, conn) != 0) {
+        connection_close(loop, conn);
+        return;
+    }
+    // Input handled or replies moving, either way the client is alive
+    deadline_update(&conn->deadline, connection_pending_input(conn));
+}
+
+/**
+ * Handle readiness on a client connection
+ */
+static void event_loop_handle_client(struct event_loop *loop, struct connection *conn,
+                                     uint32_t events)
+{
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        connection_close(loop, conn);
+        return;
+    }
+    if ((events & EPOLLIN) && connection_read(conn) != 0) {
+        connection_close(loop, conn);
+        return;
+    }
+    event_loop_flush(loop, conn);
+}
+
+/**
+ * Take back the appends the writer committed, and queue the replies of
+ * every connection whose batch is complete
+ */
+static void event_loop_complete(struct event_loop *loop)
+{
+    struct log_write *req = log_completions_take(&loop->completions);
+
+    while (req != NULL) {
+        struct log_write *next = req->completed_next;
+        struct connection *conn = connection_append_done(req);
+        if (conn != NULL) {
+            if (conn->closing || connection_append_finish(conn) != 0) {
+                connection_close(loop, conn);
+            } else {
+                event_loop_flush(loop, conn);
+            }
+        }
+        req = next;
+    }
+}
+
+/**
+ * Thread function running one event loop until shutdown
+ */
+static void *event_loop_thread(void *arg)
+{
+    struct event_loop *loop = (struct event_loop *)arg;
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+    shard_pin(loop->shard);
+    while (!g_signal_received) {
+        int nready = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, -1);
+        if (nready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        int timers_due = 0;
+        int completions_due = 0;
+        for (int i = 0; i < nready && !g_signal_received; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &g_wakeup_tag) {
+                continue;
+            }
+            if (ptr == &g_timer_tag) {
+                timers_due = 1;
+                continue;
+            }
+            if (ptr == &g_completions_tag) {
+                completions_due = 1;
+                continue;
+            }
+            if (ptr == &g_listen_tag) {
+                event_loop_accept(loop);
+                continue;
+            }
+            event_loop_handle_client(loop, (struct connection *)ptr, events[i].events);
+        }
+        // Timeouts and failed appends free their connection, which may
+        // still have an event further down the batch; handle them once all
+        // are dispatched
+        if (completions_due && !g_signal_received) {
+            event_loop_complete(loop);
+        }
+        if (timers_due && !g_signal_received) {
+            timer_wheel_run(&loop->timers);
+        }
+    }
+
+    // Shutdown: close every connection still owned by this loop, waiting
+    // for the writer to hand back the packets of those appending
+    struct connection *conn = loop->connections;
+    while (conn != NULL) {
+        struct connection *next = conn->next;
+        connection_close(loop, conn);
+        conn = next;
+    }
+    while (loop->connections != NULL) {
+        struct pollfd pfd = { .fd = loop->completions.fd, .events = POLLIN };
+        poll(&pfd, 1, -1);
+        event_loop_complete(loop);
+    }
+    return NULL;
+}
+
+/**
+ * Release the epoll instance, timer wheel, completions and send buffer of
+ * @param loop
+ */
+static void event_loop_destroy(struct event_loop *loop)
+{
+    close(loop->epoll_fd);
+    timer_wheel_destroy(&loop->timers);
+    log_completions_destroy(&loop->completions);
+    buffer_pool_free(loop->send_buf, loop->send_buf_size);
+    loop->send_buf = NULL;
+}
+
+/**
+ * Create the epoll instance and timer wheel of @param loop, shard
+ * @param shard, and register its listener and the shared fds
+ */
+static int event_loop_init(struct event_loop *loop, int shard, int shared)
+{
+    struct epoll_event ev;
+
+    loop->shard = shard;
+    loop->listen_fd = shard_listener(shard);
+    loop->connections = NULL;
+    loop->send_buf = NULL;
+    if (timer_wheel_init(&loop->timers) != 0) {
+        return -1;
+    }
+    if (log_completions_init(&loop->completions) != 0) {
+        timer_wheel_destroy(&loop->timers);
+        return -1;
+    }
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        syslog(LOG_ERR, "epoll_create1 failed: %s", strerror(errno));
+        timer_wheel_destroy(&loop->timers);
+        log_completions_destroy(&loop->completions);
+        return -1;
+    }
+
+    // With loops sharing a listener only one of them is woken per connection
+    ev.events = EPOLLIN | (shared ? EPOLLEXCLUSIVE : 0);
+    ev.data.ptr = &g_listen_tag;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev) < 0) {
+        syslog(LOG_ERR, "epoll_ctl failed for listener: %s", strerror(errno));
+        event_loop_destroy(loop);
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &g_wakeup_tag;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, g_wakeup_fd, &ev) < 0) {
+        syslog(LOG_ERR, "epoll_ctl failed for wakeup fd: %s", strerror(errno));
+        event_loop_destroy(loop);
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &g_timer_tag;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timers.fd, &ev) < 0) {
+        syslog(LOG_ERR, "epoll_ctl failed for timerfd: %s", strerror(errno));
+        event_loop_destroy(loop);
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &g_completions_tag;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->completions.fd, &ev) < 0) {
+        syslog(LOG_ERR, "epoll_ctl failed for completions: %s", strerror(errno));
+        event_loop_destroy(loop);
+        return -1;
+    }
+
+    loop->send_buf = buffer_pool_alloc(storage_send_buffer_size(), &loop->send_buf_size);
+    if (!loop->send_buf) {
+        syslog(LOG_ERR, "malloc failed for send buffer: %s", strerror(errno));
+        event_loop_destroy(loop);
+        return -1;
+    }
+    return 0;
+}
+
+int event_loop_run(int nloops)
+{
+    int started = 0;
+
+    for (int i = 0; i < shard_listeners(); i++) {
+        int listen_fd = shard_listener(i);
+        int flags = fcntl(listen_fd, F_GETFL, 0);
+        if (flags < 0 || fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            syslog(LOG_ERR, "Failed to make listener non-blocking: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    struct event_loop *loops = calloc(nloops, sizeof(struct event_loop));
+    if (!loops) {
+        syslog(LOG_ERR, "malloc failed for event loops: %s", strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < nloops; i++) {
+        if (event_loop_init(&loops[started], started, shard_listeners() < nloops) != 0) {
+            break;
+        }
+        if (started == 0) {
+            timestamp_start(&loops[0].timers);
+        }
+        if (pthread_create(&loops[started].thread_id, NULL, event_loop_thread,
+                           &loops[started]) != 0) {
+            syslog(LOG_ERR, "Failed to create event loop thread: %s", strerror(errno));
+            event_loop_destroy(&loops[started]);
+            break;
+        }
+        started++;
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(loops[i].thread_id, NULL);
+        event_loop_destroy(&loops[i]);
+    }
+
+    free(loops);
+    return started > 0 ? 0 : -1;
+}
@@ -0,0 +1,305 @@
+/**
+ * @file log-cache.c
+ * @brief In-memory mirror of the data log made of refcounted chunks
+ *
+ * With the cache enabled the writer thread copies each batch into the
+ * newest chunk and publishes it before anything touches the disk, so
+ * replies are built as an iovec over the chunks and sent with sendmsg()
+ * without reading the file.  The data file becomes a write-behind copy:
+ * chunks are written out after the producers were released, and only
+ * chunks already on disk are evicted when the cache exceeds its cap.
+ * Replies whose range starts before the oldest cached chunk send that
+ * prefix from the file.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "aesdsocket.h"
+#include "log-cache.h"
+#include "timer.h"
+
+#define LOG_CACHE_CHUNK_SIZE (64 * 1024)
+// iovec entries handed to one sendmsg()
+#define LOG_CACHE_SEND_IOVS 64
+
+static struct {
+    int enabled;
+    size_t cap;
+    /**
+     * Sum of the capacities of the chunks between head and tail
+     */
+    size_t bytes;
+    /**
+     * head is the oldest chunk the cache holds a reference on, tail the one
+     * being filled.  Both only change under lock.
+     */
+    struct log_chunk *head;
+    struct log_chunk *tail;
+    pthread_mutex_t lock;
+    /**
+     * Writer thread only: bytes copied into the cache, bytes written to
+     * disk and the chunk holding the first byte not on disk yet
+     */
+    off_t written;
+    off_t persisted;
+    struct log_chunk *persist_chunk;
+    /**
+     * Log offset the cache started at
+     */
+    off_t base;
+} g_cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+int log_cache_init(size_t cap)
+{
+    g_cache.cap = cap;
+    g_cache.enabled = 1;
+    return 0;
+}
+
+void log_cache_start(off_t offset)
+{
+    g_cache.base = offset;
+    g_cache.written = offset;
+    g_cache.persisted = offset;
+}
+
+int log_cache_full(void)
+{
+    // Everything persisted can be evicted, and log_cache_persist() does
+    return g_cache.bytes > g_cache.cap && g_cache.persisted < g_cache.written;
+}
+
+int log_cache_enabled(void)
+{
+    return g_cache.enabled;
+}
+
+void log_chunk_put(struct log_chunk *chunk)
+{
+    // Releasing the last reference drops the chunk's reference on its
+    // successor, iterate instead of recursing down the list
+    while (chunk != NULL && atomic_fetch_sub(&chunk->refcount, 1) == 1) {
+        struct log_chunk *next = atomic_load(&chunk->next);
+        free(chunk);
+        chunk = next;
+    }
+}
+
+void log_cache_destroy(void)
+{
+    pthread_mutex_lock(&g_cache.lock);
+    struct log_chunk *head = g_cache.head;
+    g_cache.head = NULL;
+    g_cache.tail = NULL;
+    g_cache.persist_chunk = NULL;
+    g_cache.bytes = 0;
+    g_cache.enabled = 0;
+    pthread_mutex_unlock(&g_cache.lock);
+
+    log_chunk_put(head);
+}
+
+/**
+ * Start a new chunk at the end of the cache
+ */
+static struct log_chunk *log_cache_add_chunk(size_t capacity)
+{
+    struct log_chunk *chunk = malloc(sizeof(struct log_chunk) + capacity);
+    if (!chunk) {
+        syslog(LOG_ERR, "malloc failed for log chunk: %s", strerror(errno));
+        return NULL;
+    }
+    // The reference held by the cache (head) or by the previous chunk
+    atomic_init(&chunk->refcount, 1);
+    chunk->offset = g_cache.written;
+    chunk->capacity = capacity;
+    chunk->len = 0;
+    atomic_init(&chunk->next, NULL);
+
+    pthread_mutex_lock(&g_cache.lock);
+    if (g_cache.tail != NULL) {
+        atomic_store_explicit(&g_cache.tail->next, chunk, memory_order_release);
+    } else {
+        g_cache.head = chunk;
+    }
+    g_cache.tail = chunk;
+    g_cache.bytes += capacity;
+    pthread_mutex_unlock(&g_cache.lock);
+
+    if (g_cache.persist_chunk == NULL) {
+        g_cache.persist_chunk = chunk;
+    }
+    return chunk;
+}
+
+int log_cache_write(const char *data, size_t len)
+{
+    while (len > 0) {
+        struct log_chunk *chunk = g_cache.tail;
+        if (chunk == NULL || chunk->len == chunk->capacity) {
+            chunk = log_cache_add_chunk(LOG_CACHE_CHUNK_SIZE);
+            if (chunk == NULL) {
+                return -1;
+            }
+        }
+
+        size_t count = chunk->capacity - chunk->len;
+        if (count > len) {
+            count = len;
+        }
+        memcpy(chunk->data + chunk->len, data, count);
+        chunk->len += count;
+        g_cache.written += count;
+        data += count;
+        len -= count;
+    }
+    return 0;
+}
+
+/**
+ * Drop persisted chunks from the head while the cache is over its cap
+ * The chunk being filled is always kept
+ */
+static void log_cache_trim(void)
+{
+    while (1) {
+        struct log_chunk *old = NULL;
+
+        pthread_mutex_lock(&g_cache.lock);
+        struct log_chunk *head = g_cache.head;
+        if (g_cache.bytes > g_cache.cap && head != g_cache.tail &&
+            head->offset + (off_t)head->capacity <= g_cache.persisted) {
+            struct log_chunk *next = atomic_load(&head->next);
+            // The cache takes its own reference on the new head
+            atomic_fetch_add(&next->refcount, 1);
+            g_cache.head = next;
+            g_cache.bytes -= head->capacity;
+            old = head;
+        }
+        pthread_mutex_unlock(&g_cache.lock);
+
+        if (old == NULL) {
+            break;
+        }
+        log_chunk_put(old);
+    }
+}
+
+int log_cache_persist(ssize_t (*append)(const struct iovec *iov, int count))
+{
+    while (g_cache.persisted < g_cache.written) {
+        struct log_chunk *chunk = g_cache.persist_chunk;
+        size_t skip = g_cache.persisted - chunk->offset;
+
+        if (skip == chunk->len) {
+            // Only a full chunk can have a successor
+            g_cache.persist_chunk = atomic_load(&chunk->next);
+            continue;
+        }
+
+        struct iovec iov = {
+            .iov_base = chunk->data + skip,
+            .iov_len = chunk->len - skip,
+        };
+        ssize_t written = append(&iov, 1);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Failed to persist cached data: %s", strerror(errno));
+            return -1;
+        }
+        g_cache.persisted += written;
+    }
+
+    log_cache_trim();
+    return 0;
+}
+
+struct log_chunk *log_cache_snapshot(off_t *start)
+{
+    pthread_mutex_lock(&g_cache.lock);
+    struct log_chunk *head = g_cache.head;
+    if (head != NULL) {
+        atomic_fetch_add(&head->refcount, 1);
+        *start = head->offset;
+    } else {
+        *start = g_cache.base;
+    }
+    pthread_mutex_unlock(&g_cache.lock);
+    return head;
+}
+
+int log_cache_send(int sockfd, struct log_chunk **cursor, off_t *offset, off_t end,
+                   struct iovec *tail, struct deadline *deadline)
+{
+    struct iovec iov[LOG_CACHE_SEND_IOVS + 1];
+
+    while (*offset < end || (tail != NULL && tail->iov_len > 0)) {
+        if (g_signal_received) {
+            return -1;
+        }
+
+        // Skip chunks that are already sent
+        struct log_chunk *chunk = *cursor;
+        while (*offset < end && chunk->offset + (off_t)chunk->capacity <= *offset) {
+            chunk = atomic_load_explicit(&chunk->next, memory_order_acquire);
+        }
+        *cursor = chunk;
+
+        int count = 0;
+        off_t pos = *offset;
+        while (chunk != NULL && count < LOG_CACHE_SEND_IOVS && pos < end) {
+            size_t skip = pos - chunk->offset;
+            size_t avail = chunk->capacity - skip;
+            if ((off_t)avail > end - pos) {
+                avail = end - pos;
+            }
+            iov[count].iov_base = chunk->data + skip;
+            iov[count].iov_len = avail;
+            count++;
+            pos += avail;
+            chunk = atomic_load_explicit(&chunk->next, memory_order_acquire);
+        }
+        // One segment for the tail instead of a small one of its own
+        if (pos == end && tail != NULL && tail->iov_len > 0) {
+            iov[count++] = *tail;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        ssize_t bytes_sent = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            syslog(LOG_ERR, "send failed: %s", strerror(errno));
+            return -1;
+        }
+        if (bytes_sent > end - *offset) {
+            size_t tail_sent = bytes_sent - (end - *offset);
+            tail->iov_base = (char *)tail->iov_base + tail_sent;
+            tail->iov_len -= tail_sent;
+            bytes_sent = end - *offset;
+        }
+        *offset += bytes_sent;
+        deadline_progress(deadline);
+    }
+    return 1;
+}
@@ -0,0 +1,98 @@
+/**
+ * @file log-cache.h
+ * @brief In-memory mirror of the data log made of refcounted chunks
+ */
+
+#ifndef LOG_CACHE_H
+#define LOG_CACHE_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+/**
+ * A block of the log.  Bytes are only ever added past the committed length
+ * and never modified, so readers can use everything below the length they
+ * snapshotted.  A chunk is filled to capacity before the next one is
+ * started, which lets readers rely on offset and capacity alone.  Each
+ * chunk holds a reference on its successor, so a reference on one chunk
+ * keeps the rest of the log after it alive.
+ */
+struct log_chunk {
+    atomic_int refcount;
+    /**
+     * Log offset of data[0]
+     */
+    off_t offset;
+    size_t capacity;
+    /**
+     * Bytes stored in data so far, only used by the writer thread
+     */
+    size_t len;
+    struct log_chunk *_Atomic next;
+    char data[];
+};
+
+/**
+ * Enable the cache, keeping at most @param cap bytes of chunks once they
+ * have been persisted
+ */
+int log_cache_init(size_t cap);
+
+void log_cache_destroy(void);
+
+int log_cache_enabled(void);
+
+/**
+ * @return whether the cache is over its cap with chunks that are not on
+ * disk yet, so nothing can be evicted (writer thread only)
+ */
+int log_cache_full(void);
+
+/**
+ * Start caching at log offset @param offset, where a log reopened with
+ * data in it ends, before the writer thread starts
+ */
+void log_cache_start(off_t offset);
+
+/**
+ * Copy @param len bytes to the end of the cache (writer thread only).  The
+ * bytes become visible to readers once the writer publishes the new
+ * committed length.
+ * @return 0 on success, -1 if no chunk could be allocated
+ */
+int log_cache_write(const char *data, size_t len);
+
+struct iovec;
+struct deadline;
+
+/**
+ * Write every cached byte not yet on disk with @param append (writer thread
+ * only) and evict persisted chunks while the cache is over its cap
+ * @return 0 on success, -1 if the write failed (it is retried next time)
+ */
+int log_cache_persist(ssize_t (*append)(const struct iovec *iov, int count));
+
+/**
+ * Take a reference on the oldest cached chunk
+ * @param start is set to the log offset where the cache begins; bytes
+ *      below it are only on disk
+ * @return the chunk, NULL if nothing is cached; release with log_chunk_put()
+ */
+struct log_chunk *log_cache_snapshot(off_t *start);
+
+void log_chunk_put(struct log_chunk *chunk);
+
+/**
+ * Send log bytes [*offset, end) from the chunks to @param sockfd with
+ * sendmsg(), advancing *offset.  @param cursor caches the chunk holding
+ * *offset between calls; set it to the snapshot chunk before the first one.
+ * @param tail, if not NULL, is sent right after the range in the same
+ * sendmsg() calls and advanced past what went out.  @param deadline, if not
+ * NULL, is stamped each time bytes go out.
+ * @return 1 once the range is sent, 0 if the socket would block, -1 on error
+ */
+int log_cache_send(int sockfd, struct log_chunk **cursor, off_t *offset, off_t end,
+                   struct iovec *tail, struct deadline *deadline);
+
+#endif /* LOG_CACHE_H */
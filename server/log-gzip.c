@@ -0,0 +1,232 @@
+/**
+ * @file log-gzip.c
+ * @brief Compressed copy of the data log, kept up to date batch by batch
+ *
+ * Full replies repeat the whole log, which is mostly timestamp lines and
+ * near-identical packets.  Clients that send AESD_CMD:gzip get them as a
+ * gzip member instead.  Compressing the history for every reply would cost
+ * far more than sending it, so with -z the writer thread runs the log
+ * through one deflate stream that never ends: every batch is compressed as
+ * it is committed and flushed with Z_SYNC_FLUSH, which ends the output on a
+ * byte boundary without resetting the dictionary.  The stream up to any
+ * flush, followed by an empty final block and the gzip trailer for the
+ * bytes so far, is a complete member, so a reply only sends a prefix of the
+ * stream and LOG_GZIP_TRAILER_SIZE bytes of its own.
+ *
+ * The stream is stored in log_chunk chunks like the log cache and sent with
+ * log_cache_send().  Every reply needs it from the start, so nothing is
+ * ever evicted; it is a fraction of the log it stands for.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "log-gzip.h"
+#include "log-cache.h"
+
+#define LOG_GZIP_CHUNK_SIZE (64 * 1024)
+// windowBits asking deflate for a gzip header instead of a zlib one
+#define LOG_GZIP_WINDOW_BITS (15 + 16)
+
+static struct {
+    int enabled;
+    /**
+     * Set once compressing failed; the stream can't skip bytes, so no
+     * snapshot is handed out from then on
+     */
+    int failed;
+    z_stream stream;
+    /**
+     * Writer thread only: log bytes compressed, their CRC-32 and the bytes
+     * of stream output
+     */
+    off_t log_len;
+    uLong crc;
+    off_t written;
+    /**
+     * head holds the reference on the first chunk, tail is being filled.
+     * They and snapshot only change under lock.
+     */
+    struct log_chunk *head;
+    struct log_chunk *tail;
+    struct log_gzip_snapshot snapshot;
+    pthread_mutex_t lock;
+} g_gzip = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * Start a new chunk at the end of the stream
+ */
+static struct log_chunk *log_gzip_add_chunk(void)
+{
+    struct log_chunk *chunk = malloc(sizeof(struct log_chunk) + LOG_GZIP_CHUNK_SIZE);
+    if (!chunk) {
+        syslog(LOG_ERR, "malloc failed for compressed log chunk: %s", strerror(errno));
+        return NULL;
+    }
+    // The reference held by head or by the previous chunk
+    atomic_init(&chunk->refcount, 1);
+    chunk->offset = g_gzip.written;
+    chunk->capacity = LOG_GZIP_CHUNK_SIZE;
+    chunk->len = 0;
+    atomic_init(&chunk->next, NULL);
+
+    pthread_mutex_lock(&g_gzip.lock);
+    if (g_gzip.tail != NULL) {
+        atomic_store_explicit(&g_gzip.tail->next, chunk, memory_order_release);
+    } else {
+        g_gzip.head = chunk;
+    }
+    g_gzip.tail = chunk;
+    pthread_mutex_unlock(&g_gzip.lock);
+    return chunk;
+}
+
+static void log_gzip_fail(const char *what)
+{
+    syslog(LOG_ERR, "Compressing the log failed (%s), replies are sent uncompressed", what);
+    pthread_mutex_lock(&g_gzip.lock);
+    g_gzip.failed = 1;
+    pthread_mutex_unlock(&g_gzip.lock);
+}
+
+/**
+ * Run deflate over the pending input with @param flush, appending its
+ * output to the chunks until it needs no more room
+ */
+static void log_gzip_deflate(int flush)
+{
+    do {
+        struct log_chunk *chunk = g_gzip.tail;
+        if (chunk == NULL || chunk->len == chunk->capacity) {
+            chunk = log_gzip_add_chunk();
+            if (chunk == NULL) {
+                log_gzip_fail("out of memory");
+                return;
+            }
+        }
+
+        size_t room = chunk->capacity - chunk->len;
+        g_gzip.stream.next_out = (Bytef *)chunk->data + chunk->len;
+        g_gzip.stream.avail_out = room;
+        int result = deflate(&g_gzip.stream, flush);
+        if (result == Z_STREAM_ERROR) {
+            log_gzip_fail("deflate");
+            return;
+        }
+        size_t produced = room - g_gzip.stream.avail_out;
+        chunk->len += produced;
+        g_gzip.written += produced;
+    } while (g_gzip.stream.avail_out == 0);
+}
+
+static void put_le32(unsigned char *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+int log_gzip_init(int level)
+{
+    memset(&g_gzip.stream, 0, sizeof(g_gzip.stream));
+    int result = deflateInit2(&g_gzip.stream, level, Z_DEFLATED, LOG_GZIP_WINDOW_BITS,
+                              8, Z_DEFAULT_STRATEGY);
+    if (result != Z_OK) {
+        syslog(LOG_ERR, "deflateInit2 failed: %s", zError(result));
+        return -1;
+    }
+    g_gzip.enabled = 1;
+    g_gzip.failed = 0;
+    g_gzip.log_len = 0;
+    g_gzip.crc = crc32(0, Z_NULL, 0);
+    g_gzip.written = 0;
+
+    // Emit the gzip header, so even the empty log has a snapshot
+    log_gzip_commit();
+    return g_gzip.failed ? -1 : 0;
+}
+
+int log_gzip_enabled(void)
+{
+    return g_gzip.enabled;
+}
+
+void log_gzip_destroy(void)
+{
+    if (!g_gzip.enabled) {
+        return;
+    }
+    pthread_mutex_lock(&g_gzip.lock);
+    struct log_chunk *head = g_gzip.head;
+    g_gzip.head = NULL;
+    g_gzip.tail = NULL;
+    g_gzip.enabled = 0;
+    pthread_mutex_unlock(&g_gzip.lock);
+
+    deflateEnd(&g_gzip.stream);
+    log_chunk_put(head);
+}
+
+void log_gzip_write(const char *data, size_t len)
+{
+    while (len > 0 && !g_gzip.failed) {
+        // zlib counts in uInt
+        size_t count = len < (1u << 30) ? len : (1u << 30);
+        g_gzip.crc = crc32(g_gzip.crc, (const Bytef *)data, count);
+        g_gzip.log_len += count;
+        g_gzip.stream.next_in = (Bytef *)data;
+        g_gzip.stream.avail_in = count;
+        log_gzip_deflate(Z_NO_FLUSH);
+        data += count;
+        len -= count;
+    }
+}
+
+void log_gzip_commit(void)
+{
+    struct log_gzip_snapshot snapshot;
+
+    if (g_gzip.failed) {
+        return;
+    }
+    log_gzip_deflate(Z_SYNC_FLUSH);
+    if (g_gzip.failed) {
+        return;
+    }
+
+    snapshot.log_end = g_gzip.log_len;
+    snapshot.stream_end = g_gzip.written;
+    // A final block with fixed codes holding nothing but the end of block
+    // code, then the CRC-32 and the length modulo 2^32 (RFC 1952)
+    snapshot.trailer[0] = 0x03;
+    snapshot.trailer[1] = 0x00;
+    put_le32(snapshot.trailer + 2, g_gzip.crc);
+    put_le32(snapshot.trailer + 6, (uint32_t)g_gzip.log_len);
+
+    pthread_mutex_lock(&g_gzip.lock);
+    g_gzip.snapshot = snapshot;
+    pthread_mutex_unlock(&g_gzip.lock);
+}
+
+struct log_chunk *log_gzip_snapshot(struct log_gzip_snapshot *snapshot)
+{
+    struct log_chunk *head = NULL;
+
+    pthread_mutex_lock(&g_gzip.lock);
+    if (g_gzip.enabled && !g_gzip.failed && g_gzip.head != NULL) {
+        head = g_gzip.head;
+        atomic_fetch_add(&head->refcount, 1);
+        *snapshot = g_gzip.snapshot;
+    }
+    pthread_mutex_unlock(&g_gzip.lock);
+    return head;
+}
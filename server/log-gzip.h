@@ -0,0 +1,59 @@
+/**
+ * @file log-gzip.h
+ * @brief Compressed copy of the data log, kept up to date batch by batch
+ */
+
+#ifndef LOG_GZIP_H
+#define LOG_GZIP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct log_chunk;
+
+// Final empty deflate block, CRC-32 and length that end a gzip member
+#define LOG_GZIP_TRAILER_SIZE 10
+
+/**
+ * The stream as it was after one batch: compressed bytes [0, stream_end)
+ * followed by trailer form a complete gzip member of the first log_end
+ * bytes of the log
+ */
+struct log_gzip_snapshot {
+    off_t log_end;
+    off_t stream_end;
+    unsigned char trailer[LOG_GZIP_TRAILER_SIZE];
+};
+
+/**
+ * Start compressing the log at zlib @param level (1 to 9) from its first
+ * byte on
+ * @return 0 on success, -1 on error
+ */
+int log_gzip_init(int level);
+
+void log_gzip_destroy(void);
+
+int log_gzip_enabled(void);
+
+/**
+ * Compress @param len bytes appended to the log (writer thread only).  They
+ * become part of snapshots at the next log_gzip_commit().
+ */
+void log_gzip_write(const char *data, size_t len);
+
+/**
+ * Flush what was written to a byte boundary and publish it as the newest
+ * snapshot (writer thread only)
+ */
+void log_gzip_commit(void);
+
+/**
+ * Take a reference on the first chunk of the stream and describe the
+ * newest snapshot in @param snapshot
+ * @return the chunk, NULL if the stream is unavailable (it stops for good
+ * when compressing fails); release with log_chunk_put()
+ */
+struct log_chunk *log_gzip_snapshot(struct log_gzip_snapshot *snapshot);
+
+#endif /* LOG_GZIP_H */
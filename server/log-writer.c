@@ -0,0 +1,453 @@
+/**
+ * @file log-writer.c
+ * @brief Single writer thread appending packets to the data log
+ *
+ * Client threads and the timestamp thread no longer open, write and close
+ * the data file themselves.  They push a request onto a lock-free
+ * multi-producer queue and wait for its completion; one writer thread
+ * drains everything queued since its last pass and commits it to the
+ * storage backend with a single writev() (group commit).  A producer only sends its reply
+ * after the completion is posted, so replies still contain its own packet.
+ * Event loop threads serve other connections meanwhile: their requests are
+ * handed back on a list of the loop's and it is woken through an eventfd.
+ *
+ * After each batch the number of bytes in the log is published with a
+ * release store.  The log is append-only, so readers can serve
+ * [0, log_writer_committed()) without taking any lock.
+ *
+ * With the log cache enabled a batch is committed as soon as it is copied
+ * into the cache, and the writer persists it to disk after posting the
+ * completions (write-behind), unless the backend is the cache itself.
+ * Only persisted chunks can be evicted, so while persisting fails with the
+ * cache over its cap, batches are failed instead of cached.
+ *
+ * With -z every committed batch is also compressed (see log-gzip.c) before
+ * the completions are posted, so a compressed reply holds its own packet.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include "aesdsocket.h"
+#include "log-writer.h"
+#include "log-cache.h"
+#include "log-gzip.h"
+#include "storage.h"
+#include "stats.h"
+
+// Requests committed by one writev()
+#define LOG_WRITER_MAX_BATCH 64
+
+static struct {
+    /**
+     * Producers exchange themselves into head; the writer pops from tail.
+     * stub keeps the queue non-empty so neither side needs a lock.
+     */
+    struct log_write *_Atomic head;
+    struct log_write *tail;
+    struct log_write stub;
+    /**
+     * Set while the writer is (about to be) sleeping on wakeup
+     */
+    atomic_int idle;
+    atomic_int stopping;
+    /**
+     * Bytes written to the log so far, published after every batch
+     */
+    _Atomic off_t committed;
+    sem_t wakeup;
+    /**
+     * Set while batches are refused because the cache can't be written out
+     */
+    int cache_full;
+    pthread_t thread_id;
+    int started;
+} g_writer;
+
+/**
+ * Link @param req at the head of the queue (producer side)
+ */
+static void log_writer_push(struct log_write *req)
+{
+    atomic_store_explicit(&req->next, NULL, memory_order_relaxed);
+    struct log_write *prev = atomic_exchange(&g_writer.head, req);
+    atomic_store_explicit(&prev->next, req, memory_order_release);
+}
+
+/**
+ * Take the oldest request off the queue (writer side)
+ * Returns NULL if the queue is empty or a producer is halfway through
+ * linking its request
+ */
+static struct log_write *log_writer_pop(void)
+{
+    struct log_write *tail = g_writer.tail;
+    struct log_write *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &g_writer.stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        g_writer.tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next != NULL) {
+        g_writer.tail = next;
+        return tail;
+    }
+    if (tail != atomic_load(&g_writer.head)) {
+        return NULL;
+    }
+
+    // tail is the last request: requeue the stub behind it
+    log_writer_push(&g_writer.stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL) {
+        g_writer.tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/**
+ * Hand @param req back to its loop thread.  The request belongs to the
+ * loop as soon as it is on the list.
+ */
+static void log_writer_complete(struct log_write *req)
+{
+    struct log_completions *completions = req->completions;
+    struct log_write *head = atomic_load_explicit(&completions->done, memory_order_relaxed);
+
+    do {
+        req->completed_next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&completions->done, &head, req,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    // The loop clears the eventfd before taking the list, so only pushing
+    // onto an empty list has to wake it
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(completions->fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            syslog(LOG_ERR, "Failed to signal log completions: %s", strerror(errno));
+        }
+    }
+}
+
+/**
+ * Returns non-zero when nothing is queued or being linked
+ */
+static int log_writer_empty(void)
+{
+    return g_writer.tail == atomic_load(&g_writer.head) &&
+           atomic_load_explicit(&g_writer.tail->next, memory_order_acquire) == NULL;
+}
+
+/**
+ * Persist whatever the cache holds that is not on disk yet
+ */
+static void log_writer_persist(void)
+{
+    // The memory backend has nowhere to write to
+    if (!storage_has(STORAGE_MEMORY)) {
+        log_cache_persist(storage_append);
+    }
+}
+
+/**
+ * Copy @param count requests into the log cache, returning 0 when all of
+ * it was stored
+ */
+static int log_writer_commit_cached(struct log_write **batch, int count)
+{
+    int result = 0;
+    off_t total_written = 0;
+
+    // Write-behind fell behind the cap.  Catch the disk up before taking
+    // more, and refuse the batch rather than grow without bound while the
+    // backend keeps failing.
+    if (log_cache_full()) {
+        log_writer_persist();
+        if (log_cache_full()) {
+            if (!g_writer.cache_full) {
+                syslog(LOG_ERR, "Log cache is over its cap and can't be written to the %s "
+                       "backend, rejecting packets", storage_name());
+                g_writer.cache_full = 1;
+            }
+            return -1;
+        }
+    }
+    if (g_writer.cache_full) {
+        syslog(LOG_INFO, "Log cache written out again, accepting packets");
+        g_writer.cache_full = 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (log_cache_write(batch[i]->data, batch[i]->len) != 0) {
+            result = -1;
+            break;
+        }
+        total_written += batch[i]->len;
+    }
+    atomic_fetch_add_explicit(&g_writer.committed, total_written, memory_order_release);
+    return result;
+}
+
+/**
+ * Write @param count requests to the log with as few writev() calls as the
+ * destination allows, returning 0 when all of it was written
+ */
+static int log_writer_commit(struct log_write **batch, int count)
+{
+    struct iovec iov[LOG_WRITER_MAX_BATCH];
+    int first = 0;
+    int result = 0;
+    off_t total_written = 0;
+
+    if (log_cache_enabled()) {
+        return log_writer_commit_cached(batch, count);
+    }
+
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = (void *)batch[i]->data;
+        iov[i].iov_len = batch[i]->len;
+    }
+
+    // Only appenders serialize on the mutex, readers rely on committed
+    uint64_t start = stats_now();
+    pthread_mutex_lock(&g_file_mutex);
+    stats_record_since(STATS_LOCK_WAIT_NS, start);
+    while (first < count) {
+        ssize_t written = storage_append(&iov[first], count - first);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Failed to write complete data to the %s backend: %s",
+                   storage_name(), strerror(errno));
+            result = -1;
+            break;
+        }
+        total_written += written;
+        // Short writes happen, e.g. the char device runs out of memory part way
+        while (first < count && (size_t)written >= iov[first].iov_len) {
+            written -= iov[first].iov_len;
+            first++;
+        }
+        if (first < count) {
+            iov[first].iov_base = (char *)iov[first].iov_base + written;
+            iov[first].iov_len -= written;
+        }
+    }
+    // Publish what reached the log, even a partial batch, so the committed
+    // length always matches the file
+    atomic_fetch_add_explicit(&g_writer.committed, total_written, memory_order_release);
+    pthread_mutex_unlock(&g_file_mutex);
+    return result;
+}
+
+/**
+ * Compress the first @param len bytes of the @param count requests, those
+ * that reached the log
+ */
+static void log_writer_compress(struct log_write **batch, int count, off_t len)
+{
+    for (int i = 0; i < count && len > 0; i++) {
+        size_t part = batch[i]->len;
+        if ((off_t)part > len) {
+            part = len;
+        }
+        log_gzip_write(batch[i]->data, part);
+        len -= part;
+    }
+    log_gzip_commit();
+}
+
+/**
+ * Writer thread: drain the queue in batches until stopped
+ */
+static void *log_writer_thread(void *arg)
+{
+    struct log_write *batch[LOG_WRITER_MAX_BATCH];
+    (void)arg;
+
+    while (1) {
+        int count = 0;
+        struct log_write *req;
+
+        while (count < LOG_WRITER_MAX_BATCH && (req = log_writer_pop()) != NULL) {
+            batch[count++] = req;
+        }
+
+        if (count > 0) {
+            uint64_t start = stats_now();
+            off_t before = atomic_load_explicit(&g_writer.committed, memory_order_relaxed);
+            int result = log_writer_commit(batch, count);
+            if (log_gzip_enabled()) {
+                off_t after = atomic_load_explicit(&g_writer.committed, memory_order_relaxed);
+                log_writer_compress(batch, count, after - before);
+            }
+            stats_record_since(STATS_COMMIT_NS, start);
+            // Requests belong to their producers again once posted
+            off_t end = before;
+            for (int i = 0; i < count; i++) {
+                end += batch[i]->len;
+                batch[i]->end = end;
+                batch[i]->result = result;
+                if (batch[i]->completions != NULL) {
+                    log_writer_complete(batch[i]);
+                } else {
+                    sem_post(&batch[i]->done);
+                }
+            }
+            if (log_cache_enabled()) {
+                // Producers got their replies going, now catch the disk up
+                log_writer_persist();
+            }
+            continue;
+        }
+
+        if (!log_writer_empty()) {
+            // A producer is between its two queue updates
+            sched_yield();
+            continue;
+        }
+        if (atomic_load(&g_writer.stopping)) {
+            if (log_cache_enabled()) {
+                log_writer_persist();
+            }
+            break;
+        }
+
+        // Announce we are going to sleep, then check once more before doing so
+        atomic_exchange(&g_writer.idle, 1);
+        if (log_writer_empty()) {
+            while (sem_wait(&g_writer.wakeup) != 0 && errno == EINTR) {
+            }
+        }
+        atomic_store(&g_writer.idle, 0);
+    }
+
+    return NULL;
+}
+
+int log_writer_start(void)
+{
+    atomic_store(&g_writer.stub.next, NULL);
+    atomic_store(&g_writer.head, &g_writer.stub);
+    g_writer.tail = &g_writer.stub;
+    atomic_store(&g_writer.idle, 0);
+    atomic_store(&g_writer.stopping, 0);
+    // A reopened log carries on where it ended
+    off_t end = storage_end();
+    atomic_store(&g_writer.committed, end);
+    if (log_cache_enabled()) {
+        log_cache_start(end);
+    }
+    sem_init(&g_writer.wakeup, 0, 0);
+
+    if (pthread_create(&g_writer.thread_id, NULL, log_writer_thread, NULL) != 0) {
+        syslog(LOG_ERR, "Failed to create writer thread: %s", strerror(errno));
+        sem_destroy(&g_writer.wakeup);
+        return -1;
+    }
+    g_writer.started = 1;
+    return 0;
+}
+
+void log_writer_stop(void)
+{
+    if (!g_writer.started) {
+        return;
+    }
+
+    atomic_store(&g_writer.stopping, 1);
+    sem_post(&g_writer.wakeup);
+    pthread_join(g_writer.thread_id, NULL);
+    g_writer.started = 0;
+    sem_destroy(&g_writer.wakeup);
+}
+
+/**
+ * Queue @param req for appending, without blocking
+ */
+static void log_writer_queue(struct log_write *req, const char *data, size_t len,
+                             struct log_completions *completions)
+{
+    req->data = data;
+    req->len = len;
+    req->result = -1;
+    req->completions = completions;
+    if (completions == NULL) {
+        sem_init(&req->done, 0, 0);
+    }
+
+    log_writer_push(req);
+
+    // Only the producer that sees the writer idle pays for the wakeup
+    if (atomic_exchange(&g_writer.idle, 0) == 1) {
+        sem_post(&g_writer.wakeup);
+    }
+}
+
+void log_writer_submit(struct log_write *req, const char *data, size_t len)
+{
+    log_writer_queue(req, data, len, NULL);
+}
+
+void log_writer_submit_async(struct log_write *req, const char *data, size_t len,
+                             struct log_completions *completions)
+{
+    log_writer_queue(req, data, len, completions);
+}
+
+int log_writer_wait(struct log_write *req)
+{
+    while (sem_wait(&req->done) != 0 && errno == EINTR) {
+    }
+    sem_destroy(&req->done);
+    return req->result;
+}
+
+int log_completions_init(struct log_completions *completions)
+{
+    atomic_init(&completions->done, NULL);
+    completions->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (completions->fd < 0) {
+        syslog(LOG_ERR, "eventfd failed for log completions: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void log_completions_destroy(struct log_completions *completions)
+{
+    if (completions->fd >= 0) {
+        close(completions->fd);
+        completions->fd = -1;
+    }
+}
+
+struct log_write *log_completions_take(struct log_completions *completions)
+{
+    uint64_t count;
+
+    // Cleared first, so a request pushed from now on signals it again
+    if (read(completions->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        syslog(LOG_ERR, "Failed to read log completions: %s", strerror(errno));
+    }
+    return atomic_exchange_explicit(&completions->done, NULL, memory_order_acquire);
+}
+
+off_t log_writer_committed(void)
+{
+    return atomic_load_explicit(&g_writer.committed, memory_order_acquire);
+}
@@ -0,0 +1,111 @@
+/**
+ * @file log-writer.h
+ * @brief Single writer thread appending packets to the data log
+ */
+
+#ifndef LOG_WRITER_H
+#define LOG_WRITER_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <semaphore.h>
+
+struct log_completions;
+
+/**
+ * One append request.  Owned by the producer, which must keep it (and the
+ * data it points to) alive until log_writer_wait() returns, or until it is
+ * handed back through its completions.
+ */
+struct log_write {
+    const char *data;
+    size_t len;
+    /**
+     * Link in the writer's multi-producer queue
+     */
+    struct log_write *_Atomic next;
+    /**
+     * 0 once the data is in the log, -1 if the write failed
+     */
+    int result;
+    /**
+     * Log offset just past the data once it is committed, so a reply can
+     * stop at the packet it answers
+     */
+    off_t end;
+    /**
+     * Where the writer hands the request back once committed, NULL if the
+     * producer waits for done instead
+     */
+    struct log_completions *completions;
+    struct log_write *completed_next;   // link in the completed list
+    /**
+     * Posted by the writer when the batch holding this request is committed
+     */
+    sem_t done;
+};
+
+/**
+ * Requests of one event loop thread, which can't block in
+ * log_writer_wait().  The writer pushes each committed request onto done
+ * and signals fd, an eventfd the loop polls with its sockets.
+ */
+struct log_completions {
+    struct log_write *_Atomic done;
+    int fd;
+};
+
+/**
+ * Start the writer thread appending to the open storage backend
+ * @return 0 on success, -1 if the thread could not be created
+ */
+int log_writer_start(void);
+
+/**
+ * Commit everything still queued and stop the writer thread
+ */
+void log_writer_stop(void);
+
+/**
+ * Queue @param len bytes at @param data for appending, without blocking
+ */
+void log_writer_submit(struct log_write *req, const char *data, size_t len);
+
+/**
+ * Queue @param req like log_writer_submit(), to be handed back through
+ * @param completions instead of waited for
+ */
+void log_writer_submit_async(struct log_write *req, const char *data, size_t len,
+                             struct log_completions *completions);
+
+/**
+ * Wait until @param req is committed to the log
+ * @return 0 on success, -1 if the data could not be written
+ */
+int log_writer_wait(struct log_write *req);
+
+/**
+ * Create the eventfd of @param completions
+ * @return 0 on success, -1 on error
+ */
+int log_completions_init(struct log_completions *completions);
+
+void log_completions_destroy(struct log_completions *completions);
+
+/**
+ * Clear the eventfd of @param completions and take the requests committed
+ * since the last call, in no particular order, linked through
+ * completed_next
+ * @return the first request, NULL if none
+ */
+struct log_write *log_completions_take(struct log_completions *completions);
+
+/**
+ * @return the number of bytes committed to the log.  Every byte below this
+ * offset is in the log and will not change, so it can be read without
+ * locking.
+ */
+off_t log_writer_committed(void);
+
+#endif /* LOG_WRITER_H */
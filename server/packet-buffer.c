@@ -0,0 +1,99 @@
+/**
+ * @file packet-buffer.c
+ * @brief Per-connection receive buffer splitting a byte stream into packets
+ *
+ * The buffer lives as long as the connection, so bytes following a
+ * newline are kept for the next packet instead of being lost, and each
+ * received byte is searched for '\n' exactly once.  Packets are handed out
+ * as views into the buffer; consumed bytes are only dropped when room is
+ * needed for the next recv().  Storage comes from the buffer pool and
+ * grows, one size class at a time, up to g_max_packet_size.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+
+#include "aesdsocket.h"
+#include "packet-buffer.h"
+#include "buffer-pool.h"
+
+void packet_buffer_init(struct packet_buffer *pb)
+{
+    memset(pb, 0, sizeof(struct packet_buffer));
+}
+
+void packet_buffer_free(struct packet_buffer *pb)
+{
+    buffer_pool_free(pb->data, pb->cap);
+    packet_buffer_init(pb);
+}
+
+int packet_buffer_next(struct packet_buffer *pb, const char **packet, size_t *len)
+{
+    char *newline_pos = NULL;
+
+    if (pb->scanned < pb->len) {
+        newline_pos = memchr(pb->data + pb->scanned, '\n', pb->len - pb->scanned);
+    }
+    if (newline_pos == NULL) {
+        pb->scanned = pb->len;
+        return 0;
+    }
+
+    size_t packet_end = newline_pos - pb->data + 1;
+    *packet = pb->data + pb->start;
+    *len = packet_end - pb->start;
+    pb->start = packet_end;
+    pb->scanned = packet_end;
+    return 1;
+}
+
+char *packet_buffer_reserve(struct packet_buffer *pb, size_t *avail)
+{
+    if (pb->start == pb->len) {
+        // Everything was consumed, start over without copying
+        pb->len = 0;
+        pb->start = 0;
+        pb->scanned = 0;
+    } else if (pb->len == pb->cap && pb->start > 0) {
+        // Move the unterminated tail to the front
+        pb->len -= pb->start;
+        pb->scanned -= pb->start;
+        memmove(pb->data, pb->data + pb->start, pb->len);
+        pb->start = 0;
+    }
+
+    if (pb->len == pb->cap) {
+        // Full of one unterminated packet: it may grow up to the limit
+        if (pb->cap >= g_max_packet_size) {
+            syslog(LOG_WARNING, "Packet exceeds %zu bytes, closing connection",
+                   g_max_packet_size);
+            return NULL;
+        }
+        size_t new_cap = pb->cap ? pb->cap * 2 : BUFFER_SIZE;
+        if (new_cap > g_max_packet_size) {
+            new_cap = g_max_packet_size;
+        }
+        char *new_data = buffer_pool_alloc(new_cap, &new_cap);
+        if (!new_data) {
+            syslog(LOG_ERR, "malloc failed for receive buffer: %s", strerror(errno));
+            return NULL;
+        }
+        if (pb->len > 0) {
+            memcpy(new_data, pb->data, pb->len);
+        }
+        buffer_pool_free(pb->data, pb->cap);
+        pb->data = new_data;
+        pb->cap = new_cap;
+    }
+
+    *avail = pb->cap - pb->len;
+    return pb->data + pb->len;
+}
+
+void packet_buffer_commit(struct packet_buffer *pb, size_t count)
+{
+    pb->len += count;
+}
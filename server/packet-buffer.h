@@ -0,0 +1,58 @@
+/**
+ * @file packet-buffer.h
+ * @brief Per-connection receive buffer splitting a byte stream into packets
+ */
+
+#ifndef PACKET_BUFFER_H
+#define PACKET_BUFFER_H
+
+#include <stddef.h>
+
+/**
+ * Bytes [start, len) of data are received but not yet returned as a packet,
+ * and [start, scanned) of those are already known not to contain '\n'.
+ */
+struct packet_buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t start;
+    size_t scanned;
+};
+
+void packet_buffer_init(struct packet_buffer *pb);
+
+void packet_buffer_free(struct packet_buffer *pb);
+
+/**
+ * Find the next complete packet, searching only bytes not scanned before.
+ * @param packet is set to the packet inside the buffer, including its
+ *      newline.  The view stays valid until the next packet_buffer_reserve().
+ * @return 1 if a packet was returned, 0 if more data is needed
+ */
+int packet_buffer_next(struct packet_buffer *pb, const char **packet, size_t *len);
+
+/**
+ * Make room to receive more data, dropping bytes of returned packets and
+ * growing the buffer if it is full of a single unterminated packet.
+ * @param avail is set to the number of bytes that can be written
+ * @return where to write received bytes, or NULL if memory ran out or the
+ * packet would exceed g_max_packet_size
+ */
+char *packet_buffer_reserve(struct packet_buffer *pb, size_t *avail);
+
+/**
+ * @return the number of received bytes not returned as a packet yet, the
+ * start of an unterminated packet once packet_buffer_next() returned 0
+ */
+static inline size_t packet_buffer_pending(const struct packet_buffer *pb)
+{
+    return pb->len - pb->start;
+}
+
+/**
+ * Account for @param count bytes written at the reserved location
+ */
+void packet_buffer_commit(struct packet_buffer *pb, size_t count);
+
+#endif /* PACKET_BUFFER_H */
@@ -0,0 +1,366 @@
+/**
+ * @file reply.c
+ * @brief Building and sending the log contents a client gets per packet
+ *
+ * A reply is a snapshot of the committed log taken once the client's packet
+ * is appended.  The bytes are streamed from the storage backend's shared
+ * descriptors with sendfile() (falling back to copying them out of the
+ * backend for sources that can't be spliced), and when the in-memory cache
+ * is enabled everything still cached is sent from its chunks with sendmsg()
+ * instead.
+ *
+ * By default a reply is the whole log.  A connection in delta mode only gets
+ * the bytes committed since its previous reply; clients switch modes with
+ * command packets that are answered but never stored.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+#include "aesdsocket.h"
+#include "log-writer.h"
+#include "log-cache.h"
+#include "log-gzip.h"
+#include "storage.h"
+#include "stats.h"
+#include "timer.h"
+
+/**
+ * Take the extent holding *offset in place of @param extent, moving *offset
+ * up to where the log now starts if retention dropped it
+ * @return 0 on success, -1 if no storage holds it
+ */
+static int refetch_extent(struct storage_extent *extent, off_t *offset)
+{
+    storage_extent_put(extent);
+    if (storage_extent_get(*offset, extent) != 0) {
+        syslog(LOG_ERR, "No storage holds log offset %lld", (long long)*offset);
+        return -1;
+    }
+    if (*offset < extent->base) {
+        *offset = extent->base;
+    }
+    return 0;
+}
+
+/**
+ * Send log bytes [*offset, end) from storage to sockfd, advancing *offset
+ * An @param end of -1 sends until EOF.  The data is streamed from the page
+ * cache of the extent holding *offset with sendfile(), taking the next one
+ * at its limit; if extents don't support it, *zero_copy is cleared and the
+ * rest is copied out with storage_read() into @param buffer and sent.
+ * @param deadline, if not NULL, is stamped whenever bytes go out.
+ * Returns 1 once the range is sent, 0 if a non-blocking socket would block,
+ * -1 on error or shutdown
+ */
+static int send_data_range(int sockfd, struct storage_extent *extent, off_t *offset,
+                           off_t end, int *zero_copy, char *buffer, size_t buffer_size,
+                           struct deadline *deadline)
+{
+    while (end < 0 || *offset < end) {
+        if (g_signal_received) {
+            return -1;
+        }
+        if (extent->fd < 0 || (extent->limit >= 0 && *offset >= extent->limit)) {
+            if (refetch_extent(extent, offset) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        
+        size_t chunk = SEND_CHUNK_SIZE;
+        if (end >= 0 && (off_t)chunk > end - *offset) {
+            chunk = end - *offset;
+        }
+        if (extent->limit >= 0 && (off_t)chunk > extent->limit - *offset) {
+            chunk = extent->limit - *offset;
+        }
+        
+        ssize_t bytes_sent;
+        if (*zero_copy) {
+            off_t position = *offset - extent->base;
+            bytes_sent = sendfile(sockfd, extent->fd, &position, chunk);
+            if (bytes_sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                // Source can't be spliced, use the copying path from now on
+                *zero_copy = 0;
+                storage_zero_copy_failed();
+                continue;
+            }
+            if (bytes_sent > 0) {
+                *offset += bytes_sent;
+            }
+        } else {
+            if (chunk > buffer_size) {
+                chunk = buffer_size;
+            }
+            ssize_t bytes_read = storage_read(buffer, chunk, *offset);
+            if (bytes_read < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                syslog(LOG_ERR, "read failed: %s", strerror(errno));
+                return -1;
+            }
+            if (bytes_read == 0) {
+                return 1;
+            }
+            bytes_sent = send(sockfd, buffer, bytes_read, MSG_NOSIGNAL);
+            if (bytes_sent > 0) {
+                // Only what was sent is consumed, the rest is read again
+                *offset += bytes_sent;
+            }
+        }
+        
+        if (bytes_sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            syslog(LOG_ERR, "send failed: %s", strerror(errno));
+            return -1;
+        }
+        if (bytes_sent == 0) {
+            if (end >= 0 && extent->limit < 0) {
+                // The segment may have been sealed since the extent was
+                // taken, the range then goes on in the next one
+                off_t base = extent->base;
+                if (refetch_extent(extent, offset) != 0) {
+                    return -1;
+                }
+                if (extent->base != base) {
+                    continue;
+                }
+            }
+            // End of data reached before end
+            return 1;
+        }
+        deadline_progress(deadline);
+    }
+    
+    return 1;
+}
+
+/**
+ * Where a reply for @param state starts in the log
+ */
+static off_t reply_start(const struct reply_state *state)
+{
+    // Retention may have dropped the oldest bytes
+    off_t start = storage_start();
+    if (state == NULL || !state->delta || state->resync) {
+        return start;
+    }
+    return state->sent > start ? state->sent : start;
+}
+
+/**
+ * reply_open() of a full reply for a connection that asked for gzip
+ * @return 0 if @param reply sends the newest compressed snapshot, -1 if
+ * there is none and it has to be sent uncompressed
+ */
+static int reply_open_compressed(struct reply *reply, struct reply_state *state)
+{
+    struct log_gzip_snapshot snapshot;
+    
+    reply->chunk = log_gzip_snapshot(&snapshot);
+    if (reply->chunk == NULL) {
+        return -1;
+    }
+    reply->cursor = reply->chunk;
+    reply->compressed = 1;
+    reply->end = snapshot.stream_end;
+    memcpy(reply->trailer, snapshot.trailer, sizeof(reply->trailer));
+    stats_count(STATS_COMPRESSED, 1);
+    
+    state->sent = snapshot.log_end;
+    state->resync = 0;
+    return 0;
+}
+
+int reply_open(struct reply *reply, struct reply_state *state, off_t end)
+{
+    memset(reply, 0, sizeof(struct reply));
+    reply->extent.fd = -1;
+    reply->zero_copy = storage_zero_copy();
+    reply->offset = reply_start(state);
+    reply->opened = stats_now();
+    
+    // Delta replies are new bytes only and stay uncompressed
+    if (state != NULL && state->gzip && reply->offset == 0 &&
+        reply_open_compressed(reply, state) == 0) {
+        return 0;
+    }
+    
+    if (log_cache_enabled()) {
+        // Length first: every chunk below it is reachable from the snapshot
+        reply->end = log_writer_committed();
+        if (end >= 0 && end < reply->end) {
+            reply->end = end;
+        }
+        reply->chunk = log_cache_snapshot(&reply->disk_end);
+        reply->cursor = reply->chunk;
+        if (reply->disk_end > reply->end) {
+            reply->disk_end = reply->end;
+        }
+        if (reply->offset < reply->disk_end) {
+            // The evicted prefix is already on disk
+            if (storage_has(STORAGE_MEMORY)) {
+                syslog(LOG_ERR, "Log bytes below %lld are not cached",
+                       (long long)reply->disk_end);
+                reply_close(reply);
+                return -1;
+            }
+        }
+    } else {
+        // No lock is taken: the log is append-only and only its committed
+        // prefix is ever sent
+        reply->end = storage_reply_end();
+        if (reply->end >= 0 && end >= 0 && end < reply->end) {
+            reply->end = end;
+        }
+        reply->disk_end = reply->end;
+    }
+    if (reply->end >= 0 && reply->offset > reply->end) {
+        // A compressed reply already went past the packet: nothing is new
+        reply->end = reply->offset;
+        reply->disk_end = reply->end;
+    }
+    
+    reply->start = reply->offset;
+    if (state != NULL) {
+        // Replies are sent in the order they are opened
+        state->sent = reply->end;
+        state->resync = 0;
+    }
+    return 0;
+}
+
+void reply_state_init(struct reply_state *state)
+{
+    state->delta = g_delta_replies;
+    state->resync = 0;
+    state->gzip = 0;
+    state->sent = 0;
+}
+
+enum reply_command reply_parse_command(const char *packet, size_t len)
+{
+    static const struct {
+        const char *name;
+        enum reply_command command;
+    } commands[] = {
+        { "delta", REPLY_CMD_DELTA },
+        { "full", REPLY_CMD_FULL },
+        { "resync", REPLY_CMD_RESYNC },
+        { "gzip", REPLY_CMD_GZIP },
+        { "plain", REPLY_CMD_PLAIN },
+    };
+    size_t prefix_len = strlen(REPLY_CMD_PREFIX);
+    
+    if (len < prefix_len + 1 || memcmp(packet, REPLY_CMD_PREFIX, prefix_len) != 0) {
+        return REPLY_CMD_NONE;
+    }
+    // Match the name exactly, without the trailing newline
+    packet += prefix_len;
+    len -= prefix_len + 1;
+    
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if (strlen(commands[i].name) == len && memcmp(packet, commands[i].name, len) == 0) {
+            return commands[i].command;
+        }
+    }
+    // Anything else is ordinary data
+    return REPLY_CMD_NONE;
+}
+
+void reply_apply_command(struct reply_state *state, enum reply_command command)
+{
+    switch (command) {
+        case REPLY_CMD_DELTA:
+            if (!storage_has(STORAGE_STABLE_OFFSETS)) {
+                // Offsets into the driver shift as it drops old entries
+                syslog(LOG_WARNING, "Delta replies are not supported with the %s backend",
+                       storage_name());
+                break;
+            }
+            state->delta = 1;
+            break;
+        case REPLY_CMD_FULL:
+            state->delta = 0;
+            break;
+        case REPLY_CMD_RESYNC:
+            state->resync = 1;
+            break;
+        case REPLY_CMD_GZIP:
+            if (!log_gzip_enabled()) {
+                syslog(LOG_WARNING, "Compressed replies are not enabled (-z)");
+                break;
+            }
+            state->gzip = 1;
+            break;
+        case REPLY_CMD_PLAIN:
+            state->gzip = 0;
+            break;
+        case REPLY_CMD_NONE:
+            break;
+    }
+}
+
+/**
+ * reply_send() without the statistics
+ */
+static int reply_send_data(int sockfd, struct reply *reply, char *buffer, size_t buffer_size)
+{
+    if (reply->compressed) {
+        // The trailer goes out with the end of the stream
+        struct iovec trailer = {
+            .iov_base = reply->trailer + reply->trailer_sent,
+            .iov_len = sizeof(reply->trailer) - reply->trailer_sent,
+        };
+        int result = log_cache_send(sockfd, &reply->cursor, &reply->offset, reply->end,
+                                    &trailer, reply->deadline);
+        reply->trailer_sent = sizeof(reply->trailer) - trailer.iov_len;
+        return result;
+    }
+    
+    if (reply->disk_end < 0 || reply->offset < reply->disk_end) {
+        int result = send_data_range(sockfd, &reply->extent, &reply->offset, reply->disk_end,
+                                     &reply->zero_copy, buffer, buffer_size, reply->deadline);
+        if (result != 1 || reply->disk_end < 0) {
+            return result;
+        }
+    }
+    
+    if (reply->chunk != NULL && reply->offset < reply->end) {
+        return log_cache_send(sockfd, &reply->cursor, &reply->offset, reply->end, NULL,
+                              reply->deadline);
+    }
+    return 1;
+}
+
+int reply_send(int sockfd, struct reply *reply, char *buffer, size_t buffer_size)
+{
+    int result = reply_send_data(sockfd, reply, buffer, buffer_size);
+    if (result == 1) {
+        stats_record(STATS_REPLY_BYTES, reply->offset - reply->start);
+        stats_record_since(STATS_REPLY_SEND_NS, reply->opened);
+    }
+    return result;
+}
+
+void reply_close(struct reply *reply)
+{
+    storage_extent_put(&reply->extent);
+    log_chunk_put(reply->chunk);
+    reply->chunk = NULL;
+    reply->cursor = NULL;
+}
@@ -0,0 +1,511 @@
+/**
+ * @file segment-log.c
+ * @brief Data log kept as a directory of segment files, with rotation,
+ * retention and warm restarts
+ *
+ * The file backend's log only ever grows, and so does every full reply.
+ * The segments backend splits the log into files named after the log
+ * offset of their first byte.  Appends go to the newest one until it holds
+ * the segment size, and then a new one is started at the next packet
+ * boundary.  Like the driver's circular buffer, retention then drops whole
+ * segments from the old end, either when the log holds more than a total
+ * size or when a segment was last written longer ago than an age.  Offsets
+ * never shift: the log just starts further on, and replies only run over
+ * what is retained.
+ *
+ * A byte's position in its segment is its offset less the segment's base,
+ * so the sorted segment table is the whole offset index: a lookup is a
+ * binary search over it.
+ *
+ * Readers take a reference on the segment they send from, so retention can
+ * unlink a segment while a reply still streams it; the descriptor closes
+ * with the last reference.  Only the writer thread appends, rotates and
+ * drops segments; the table itself changes under a lock.
+ *
+ * The files survive a restart.  Opening the directory again picks up the
+ * newest run of contiguous segments and cuts off a packet left half
+ * written by a crash, so the log and its offsets carry on where they ended.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include "segment-log.h"
+
+// Segment files are named after their base offset, zero padded to sort
+#define SEGMENT_DIGITS 20
+#define SEGMENT_SUFFIX ".log"
+// Bytes read at a time while looking for the end of the last whole packet
+#define SEGMENT_SCAN_SIZE 4096
+
+struct log_segment {
+    atomic_int refcount;        // the table's and every reader's
+    off_t base;
+    _Atomic off_t size;         // bytes in the file
+    atomic_int sealed;          // no more appends, size is final
+    int64_t written_ms;         // wall clock time of the last append
+    int fd;
+    char path[];
+};
+
+static struct {
+    size_t segment_size;
+    size_t retain_bytes;
+    uint64_t retain_ms;
+    char *dir;
+    /**
+     * Oldest first, the last one takes the appends.  Only the writer thread
+     * changes it, under lock.
+     */
+    struct log_segment **segments;
+    size_t count;
+    size_t capacity;
+    pthread_mutex_t lock;
+    _Atomic off_t start;
+    /**
+     * Writer thread only: the offset of the next append, the bytes in all
+     * segments, and whether the last append ended a packet
+     */
+    off_t end;
+    size_t bytes;
+    int newline;
+} g_segments = {
+    .segment_size = SEGMENT_LOG_DEFAULT_SIZE,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int64_t wall_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void segment_log_configure(size_t segment_size, size_t retain_bytes, uint64_t retain_ms)
+{
+    g_segments.segment_size = segment_size;
+    g_segments.retain_bytes = retain_bytes;
+    g_segments.retain_ms = retain_ms;
+}
+
+/**
+ * Open the segment starting at log offset @param base, creating its file if
+ * @param create is set
+ * @return the segment holding one reference, NULL on error
+ */
+static struct log_segment *segment_open(off_t base, int create)
+{
+    size_t path_len = strlen(g_segments.dir) + 1 + SEGMENT_DIGITS + strlen(SEGMENT_SUFFIX) + 1;
+    struct log_segment *segment = malloc(sizeof(struct log_segment) + path_len);
+    if (!segment) {
+        syslog(LOG_ERR, "malloc failed for log segment: %s", strerror(errno));
+        return NULL;
+    }
+    snprintf(segment->path, path_len, "%s/%0*lld" SEGMENT_SUFFIX, g_segments.dir,
+             SEGMENT_DIGITS, (long long)base);
+
+    int flags = O_RDWR | O_APPEND | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0);
+    segment->fd = open(segment->path, flags, 0644);
+    struct stat st;
+    if (segment->fd < 0 || fstat(segment->fd, &st) != 0) {
+        syslog(LOG_ERR, "Failed to open %s: %s", segment->path, strerror(errno));
+        if (segment->fd >= 0) {
+            close(segment->fd);
+        }
+        free(segment);
+        return NULL;
+    }
+    atomic_init(&segment->refcount, 1);
+    segment->base = base;
+    atomic_init(&segment->size, st.st_size);
+    atomic_init(&segment->sealed, 0);
+    segment->written_ms = (int64_t)st.st_mtim.tv_sec * 1000 + st.st_mtim.tv_nsec / 1000000;
+    return segment;
+}
+
+void log_segment_put(struct log_segment *segment)
+{
+    if (segment != NULL && atomic_fetch_sub(&segment->refcount, 1) == 1) {
+        close(segment->fd);
+        free(segment);
+    }
+}
+
+/**
+ * Add @param segment at the new end of the table
+ */
+static int segment_push(struct log_segment *segment)
+{
+    pthread_mutex_lock(&g_segments.lock);
+    if (g_segments.count == g_segments.capacity) {
+        size_t capacity = g_segments.capacity ? 2 * g_segments.capacity : 16;
+        struct log_segment **grown = realloc(g_segments.segments,
+                                             capacity * sizeof(struct log_segment *));
+        if (!grown) {
+            pthread_mutex_unlock(&g_segments.lock);
+            syslog(LOG_ERR, "realloc failed for the segment table: %s", strerror(errno));
+            return -1;
+        }
+        g_segments.segments = grown;
+        g_segments.capacity = capacity;
+    }
+    g_segments.segments[g_segments.count++] = segment;
+    if (g_segments.count == 1) {
+        atomic_store(&g_segments.start, segment->base);
+    }
+    pthread_mutex_unlock(&g_segments.lock);
+
+    g_segments.bytes += atomic_load(&segment->size);
+    return 0;
+}
+
+/**
+ * Remove the oldest segment from the table and delete its file.  Readers
+ * still holding it keep sending from the open descriptor.
+ */
+static void segment_drop_oldest(void)
+{
+    pthread_mutex_lock(&g_segments.lock);
+    struct log_segment *oldest = g_segments.segments[0];
+    g_segments.count--;
+    memmove(g_segments.segments, g_segments.segments + 1,
+            g_segments.count * sizeof(struct log_segment *));
+    if (g_segments.count > 0) {
+        atomic_store(&g_segments.start, g_segments.segments[0]->base);
+    }
+    pthread_mutex_unlock(&g_segments.lock);
+
+    g_segments.bytes -= atomic_load(&oldest->size);
+    if (unlink(oldest->path) != 0) {
+        syslog(LOG_WARNING, "Failed to remove %s: %s", oldest->path, strerror(errno));
+    }
+    log_segment_put(oldest);
+}
+
+/**
+ * Drop old segments past the retention caps.  The newest segment is kept
+ * whatever its size or age.
+ */
+static void segment_log_retain(void)
+{
+    int64_t now = wall_ms();
+
+    while (g_segments.count > 1) {
+        struct log_segment *oldest = g_segments.segments[0];
+        int over_size = g_segments.retain_bytes > 0 &&
+                        g_segments.bytes > g_segments.retain_bytes;
+        int too_old = g_segments.retain_ms > 0 &&
+                      now - oldest->written_ms > (int64_t)g_segments.retain_ms;
+        if (!over_size && !too_old) {
+            break;
+        }
+        segment_drop_oldest();
+    }
+}
+
+/**
+ * Start a new segment at the end of the log
+ */
+static int segment_log_rotate(void)
+{
+    struct log_segment *active = g_segments.segments[g_segments.count - 1];
+    struct log_segment *next = segment_open(g_segments.end, 1);
+    if (next == NULL) {
+        return -1;
+    }
+    if (segment_push(next) != 0) {
+        unlink(next->path);
+        log_segment_put(next);
+        return -1;
+    }
+    // Sealed only once its successor is in the table, so a reader past its
+    // end always finds where the log goes on
+    atomic_store_explicit(&active->sealed, 1, memory_order_release);
+    return 0;
+}
+
+/**
+ * @return the byte at position @param pos of the @param count buffers
+ */
+static char iov_byte(const struct iovec *iov, int count, size_t pos)
+{
+    for (int i = 0; i < count; i++) {
+        if (pos < iov[i].iov_len) {
+            return ((const char *)iov[i].iov_base)[pos];
+        }
+        pos -= iov[i].iov_len;
+    }
+    return 0;
+}
+
+ssize_t segment_log_append(const struct iovec *iov, int count)
+{
+    struct log_segment *active = g_segments.segments[g_segments.count - 1];
+
+    // Segments start on a packet, so a retained log never begins mid-line
+    if (atomic_load_explicit(&active->size, memory_order_relaxed) >=
+            (off_t)g_segments.segment_size && g_segments.newline) {
+        if (segment_log_rotate() == 0) {
+            active = g_segments.segments[g_segments.count - 1];
+        }
+        // Otherwise the current segment grows past the size
+    }
+    segment_log_retain();
+
+    ssize_t written = writev(active->fd, iov, count);
+    if (written > 0) {
+        off_t size = atomic_load_explicit(&active->size, memory_order_relaxed);
+        atomic_store_explicit(&active->size, size + written, memory_order_release);
+        active->written_ms = wall_ms();
+        g_segments.end += written;
+        g_segments.bytes += written;
+        g_segments.newline = iov_byte(iov, count, written - 1) == '\n';
+    }
+    return written;
+}
+
+off_t segment_log_start(void)
+{
+    return atomic_load(&g_segments.start);
+}
+
+off_t segment_log_end(void)
+{
+    return g_segments.end;
+}
+
+struct log_segment *segment_log_find(off_t offset)
+{
+    struct log_segment *segment = NULL;
+
+    pthread_mutex_lock(&g_segments.lock);
+    if (g_segments.count > 0) {
+        // The last segment whose base is at or below offset
+        size_t low = 0;
+        size_t high = g_segments.count - 1;
+        while (low < high) {
+            size_t mid = low + (high - low + 1) / 2;
+            if (g_segments.segments[mid]->base <= offset) {
+                low = mid;
+            } else {
+                high = mid - 1;
+            }
+        }
+        segment = g_segments.segments[low];
+        atomic_fetch_add(&segment->refcount, 1);
+    }
+    pthread_mutex_unlock(&g_segments.lock);
+    return segment;
+}
+
+int log_segment_extent(struct log_segment *segment, off_t *base, off_t *limit)
+{
+    *base = segment->base;
+    if (atomic_load_explicit(&segment->sealed, memory_order_acquire)) {
+        *limit = segment->base + atomic_load(&segment->size);
+    } else {
+        *limit = -1;
+    }
+    return segment->fd;
+}
+
+static int compare_off(const void *a, const void *b)
+{
+    off_t x = *(const off_t *)a;
+    off_t y = *(const off_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @return whether @param name is a segment file, setting @param base
+ */
+static int segment_name_base(const char *name, off_t *base)
+{
+    if (strlen(name) != SEGMENT_DIGITS + strlen(SEGMENT_SUFFIX) ||
+        strcmp(name + SEGMENT_DIGITS, SEGMENT_SUFFIX) != 0) {
+        return 0;
+    }
+    for (int i = 0; i < SEGMENT_DIGITS; i++) {
+        if (name[i] < '0' || name[i] > '9') {
+            return 0;
+        }
+    }
+    *base = strtoll(name, NULL, 10);
+    return 1;
+}
+
+/**
+ * @return the sorted base offsets of the segment files in the directory in
+ * @param bases (free it), their number in @param count; -1 on error
+ */
+static int segment_log_scan(off_t **bases, size_t *count)
+{
+    size_t capacity = 0;
+    DIR *dir = opendir(g_segments.dir);
+    if (dir == NULL) {
+        syslog(LOG_ERR, "Failed to open %s: %s", g_segments.dir, strerror(errno));
+        return -1;
+    }
+
+    *bases = NULL;
+    *count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        off_t base;
+        if (!segment_name_base(entry->d_name, &base)) {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity = capacity ? 2 * capacity : 16;
+            off_t *grown = realloc(*bases, capacity * sizeof(off_t));
+            if (!grown) {
+                syslog(LOG_ERR, "realloc failed scanning segments: %s", strerror(errno));
+                closedir(dir);
+                free(*bases);
+                return -1;
+            }
+            *bases = grown;
+        }
+        (*bases)[(*count)++] = base;
+    }
+    closedir(dir);
+    qsort(*bases, *count, sizeof(off_t), compare_off);
+    return 0;
+}
+
+/**
+ * Cut the newest segment back to the end of its last whole packet, dropping
+ * what a crash left of a batch being written
+ */
+static void segment_log_repair(void)
+{
+    struct log_segment *last = g_segments.segments[g_segments.count - 1];
+    off_t size = atomic_load(&last->size);
+    char buf[SEGMENT_SCAN_SIZE];
+    off_t keep = 0;
+
+    for (off_t pos = size; pos > 0 && keep == 0; ) {
+        size_t len = pos < SEGMENT_SCAN_SIZE ? (size_t)pos : SEGMENT_SCAN_SIZE;
+        pos -= len;
+        ssize_t n = pread(last->fd, buf, len, pos);
+        if (n != (ssize_t)len) {
+            // Leave it alone rather than guess
+            syslog(LOG_WARNING, "Failed to read the end of %s", last->path);
+            return;
+        }
+        char *newline = memrchr(buf, '\n', len);
+        if (newline != NULL) {
+            keep = pos + (newline - buf) + 1;
+        }
+    }
+    if (keep == size) {
+        return;
+    }
+    if (ftruncate(last->fd, keep) != 0) {
+        syslog(LOG_ERR, "Failed to truncate %s: %s", last->path, strerror(errno));
+        return;
+    }
+    syslog(LOG_WARNING, "Dropped %lld bytes of a partly written packet from %s",
+           (long long)(size - keep), last->path);
+    atomic_store(&last->size, keep);
+    g_segments.bytes -= size - keep;
+    g_segments.end -= size - keep;
+}
+
+int segment_log_open(const char *dir)
+{
+    off_t *bases;
+    size_t count;
+
+    g_segments.dir = strdup(dir);
+    if (g_segments.dir == NULL) {
+        syslog(LOG_ERR, "strdup failed: %s", strerror(errno));
+        return -1;
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        syslog(LOG_ERR, "Failed to create %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    if (segment_log_scan(&bases, &count) != 0) {
+        return -1;
+    }
+
+    g_segments.end = 0;
+    g_segments.bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct log_segment *segment = segment_open(bases[i], 0);
+        if (segment == NULL) {
+            free(bases);
+            return -1;
+        }
+        if (g_segments.count > 0 && segment->base != g_segments.end) {
+            // Offsets must run on, keep the newest contiguous run
+            syslog(LOG_WARNING, "Log segments before %s are not contiguous, dropping them",
+                   segment->path);
+            while (g_segments.count > 0) {
+                segment_drop_oldest();
+            }
+        }
+        if (segment_push(segment) != 0) {
+            log_segment_put(segment);
+            free(bases);
+            return -1;
+        }
+        if (g_segments.count > 1) {
+            // Only the newest segment takes appends, its predecessor is final
+            atomic_store_explicit(&g_segments.segments[g_segments.count - 2]->sealed, 1,
+                                  memory_order_release);
+        }
+        g_segments.end = segment->base + atomic_load(&segment->size);
+    }
+    free(bases);
+
+    if (g_segments.count == 0) {
+        struct log_segment *segment = segment_open(0, 1);
+        if (segment == NULL) {
+            return -1;
+        }
+        if (segment_push(segment) != 0) {
+            unlink(segment->path);
+            log_segment_put(segment);
+            return -1;
+        }
+    } else {
+        segment_log_repair();
+    }
+    g_segments.newline = 1;
+    segment_log_retain();
+
+    syslog(LOG_INFO, "Opened %zu log segments in %s holding offsets %lld to %lld",
+           g_segments.count, dir, (long long)segment_log_start(), (long long)g_segments.end);
+    return 0;
+}
+
+void segment_log_close(void)
+{
+    pthread_mutex_lock(&g_segments.lock);
+    struct log_segment **segments = g_segments.segments;
+    size_t count = g_segments.count;
+    g_segments.segments = NULL;
+    g_segments.count = 0;
+    g_segments.capacity = 0;
+    pthread_mutex_unlock(&g_segments.lock);
+
+    for (size_t i = 0; i < count; i++) {
+        log_segment_put(segments[i]);
+    }
+    free(segments);
+    free(g_segments.dir);
+    g_segments.dir = NULL;
+}
@@ -0,0 +1,76 @@
+/**
+ * @file segment-log.h
+ * @brief Data log kept as a directory of segment files, with rotation,
+ * retention and warm restarts
+ */
+
+#ifndef SEGMENT_LOG_H
+#define SEGMENT_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define SEGMENT_LOG_DEFAULT_SIZE (16 * 1024 * 1024)
+
+struct log_segment;
+
+/**
+ * Start a new segment once the current one holds @param segment_size
+ * bytes, and drop the oldest segments while the log holds more than
+ * @param retain_bytes or they were last written more than @param retain_ms
+ * ago (0 keeping them regardless).  Must be called before
+ * segment_log_open() to change the defaults.
+ */
+void segment_log_configure(size_t segment_size, size_t retain_bytes, uint64_t retain_ms);
+
+/**
+ * Reopen the segments found in @param dir, creating it if needed, so the log
+ * carries on where it ended.  A packet left half written at the end is cut
+ * off.
+ * @return 0 on success, -1 on error
+ */
+int segment_log_open(const char *dir);
+
+/**
+ * Close every segment, leaving the files for the next start
+ */
+void segment_log_close(void);
+
+/**
+ * Write @param count buffers to the end of the log (writer thread only),
+ * rotating and applying retention first
+ * @return the bytes written, which may be fewer than asked, or -1 on error
+ */
+ssize_t segment_log_append(const struct iovec *iov, int count);
+
+/**
+ * @return the offset of the oldest byte still retained
+ */
+off_t segment_log_start(void);
+
+/**
+ * @return the offset the next append goes to
+ */
+off_t segment_log_end(void);
+
+/**
+ * Take a reference on the segment holding @param offset, or on the oldest
+ * one if retention already dropped it
+ * @return the segment, NULL if the log is closed; release with
+ * log_segment_put()
+ */
+struct log_segment *segment_log_find(off_t offset);
+
+void log_segment_put(struct log_segment *segment);
+
+/**
+ * Describe @param segment: log bytes [*base, *limit) are at the same
+ * positions less *base in the returned descriptor.  *limit is -1 while the
+ * segment is still being appended to.
+ * @return a descriptor valid until the reference is released
+ */
+int log_segment_extent(struct log_segment *segment, off_t *base, off_t *limit);
+
+#endif /* SEGMENT_LOG_H */
@@ -0,0 +1,158 @@
+/**
+ * @file shard.c
+ * @brief Listening sockets of the engine shards and their CPU placement
+ *
+ * By default every loop (or the accept thread of the thread engine) takes
+ * connections from one listening socket.  When a burst of clients
+ * reconnects at once that socket's queue and lock are shared by all of
+ * them; with -R each shard gets its own socket bound with SO_REUSEPORT, and
+ * the kernel hashes each new connection to one of them.  With -A the
+ * shards are also pinned, shard i to the i-th CPU the process may use, so
+ * a connection stays on the cache of the CPU that accepted it.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "aesdsocket.h"
+#include "shard.h"
+
+static int g_listen_fds[SHARD_MAX_LISTENERS];
+static int g_listen_count;
+
+static int g_pin_enabled;
+static int g_pin_cpus[CPU_SETSIZE];
+static int g_pin_count;
+
+/**
+ * Open one listening socket, with SO_REUSEPORT if @param reuseport is set
+ * @return the socket, -1 on error
+ */
+static int shard_open_listener(int backlog, int reuseport)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "socket creation failed: %s", strerror(errno));
+        return -1;
+    }
+
+    // Set socket option to reuse address
+    int opt_val = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt_val, sizeof(opt_val)) < 0) {
+        syslog(LOG_ERR, "setsockopt failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (reuseport &&
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt_val, sizeof(opt_val)) < 0) {
+        syslog(LOG_ERR, "setsockopt SO_REUSEPORT failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(PORT);
+
+    if (bind(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        syslog(LOG_ERR, "bind failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, backlog) < 0) {
+        syslog(LOG_ERR, "listen failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int shard_listen(int count, int backlog)
+{
+    if (count < 1 || count > SHARD_MAX_LISTENERS) {
+        syslog(LOG_ERR, "Invalid number of listeners: %d", count);
+        return -1;
+    }
+    while (g_listen_count < count) {
+        int fd = shard_open_listener(backlog, count > 1);
+        if (fd < 0) {
+            return -1;
+        }
+        g_listen_fds[g_listen_count++] = fd;
+    }
+    return 0;
+}
+
+int shard_listener(int shard)
+{
+    return g_listen_fds[shard % g_listen_count];
+}
+
+int shard_listeners(void)
+{
+    return g_listen_count;
+}
+
+void shard_shutdown(void)
+{
+    // Unlike close(), shutdown() wakes a blocked accept() and leaves no
+    // descriptor number free for reuse while shards still refer to it
+    for (int i = 0; i < g_listen_count; i++) {
+        shutdown(g_listen_fds[i], SHUT_RDWR);
+    }
+}
+
+void shard_close(void)
+{
+    for (int i = 0; i < g_listen_count; i++) {
+        close(g_listen_fds[i]);
+    }
+    g_listen_count = 0;
+}
+
+int shard_pin_enable(void)
+{
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        syslog(LOG_ERR, "sched_getaffinity failed: %s", strerror(errno));
+        return -1;
+    }
+    g_pin_count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            g_pin_cpus[g_pin_count++] = cpu;
+        }
+    }
+    g_pin_enabled = g_pin_count > 0;
+    return 0;
+}
+
+void shard_pin(int shard)
+{
+    cpu_set_t set;
+
+    if (!g_pin_enabled) {
+        return;
+    }
+    int cpu = g_pin_cpus[shard % g_pin_count];
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (result != 0) {
+        // Running unpinned is still correct
+        syslog(LOG_WARNING, "Failed to pin shard %d to CPU %d: %s", shard, cpu,
+               strerror(result));
+        return;
+    }
+    syslog(LOG_INFO, "Shard %d pinned to CPU %d", shard, cpu);
+}
@@ -0,0 +1,57 @@
+/**
+ * @file shard.h
+ * @brief Listening sockets of the engine shards and their CPU placement
+ */
+
+#ifndef SHARD_H
+#define SHARD_H
+
+// Most listeners -R opens, one per loop or accept thread
+#define SHARD_MAX_LISTENERS 256
+
+/**
+ * Open @param count listening sockets on PORT, each with a backlog of
+ * @param backlog connections.  Several are bound with SO_REUSEPORT, so the
+ * kernel spreads new connections over them instead of waking every shard
+ * on one queue.
+ * @return 0 on success, -1 on error (sockets opened so far stay open)
+ */
+int shard_listen(int count, int backlog);
+
+/**
+ * @return the listening socket of shard @param shard; shards share the
+ * listeners round robin when there are fewer of them
+ */
+int shard_listener(int shard);
+
+/**
+ * @return the number of listening sockets
+ */
+int shard_listeners(void);
+
+/**
+ * Stop every listener, waking the threads blocked in accept() or waiting
+ * for new connections.  Async-signal-safe, and the descriptors stay valid
+ * until shard_close().
+ */
+void shard_shutdown(void);
+
+/**
+ * Close every listener once no shard uses them any more
+ */
+void shard_close(void);
+
+/**
+ * Pin shard threads to the CPUs the process may run on, one each in turn,
+ * from now on
+ * @return 0 on success, -1 if the CPU set can't be read
+ */
+int shard_pin_enable(void);
+
+/**
+ * Pin the calling thread, which runs shard @param shard, if pinning is
+ * enabled.  Threads it starts inherit the CPU.
+ */
+void shard_pin(int shard);
+
+#endif /* SHARD_H */
@@ -0,0 +1,482 @@
+/**
+ * @file stats.c
+ * @brief Per-thread latency and size histograms of the server stages
+ *
+ * Every thread records into its own block, found through a thread-local
+ * pointer, so updates touch no shared cacheline and need no atomic
+ * read-modify-write: the owner does relaxed loads and stores, readers
+ * relaxed loads.  Blocks are linked into a registry when a thread first
+ * records something, and folded into a retired block when it exits, so
+ * totals survive short-lived connection threads.  The registry lock is only
+ * taken on thread start and exit and when the statistics are read.
+ *
+ * A stats thread formats the aggregate on demand: to syslog when asked by
+ * SIGUSR1, and to clients of the optional Unix socket.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "aesdsocket.h"
+#include "stats.h"
+
+// Bucket 0 holds zeros, bucket i values in [2^(i-1), 2^i)
+#define STATS_BUCKETS 65
+// Room for the formatted dump
+#define STATS_DUMP_SIZE 4096
+
+struct stats_histogram {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[STATS_BUCKETS];
+};
+
+struct stats_block {
+    struct stats_histogram hists[STATS_HIST_COUNT];
+    _Atomic uint64_t counters[STATS_COUNTER_COUNT];
+    struct stats_block *next;
+};
+
+static const char *const g_hist_names[STATS_HIST_COUNT] = {
+    [STATS_RECV_NS] = "recv_ns",
+    [STATS_APPEND_NS] = "append_ns",
+    [STATS_LOCK_WAIT_NS] = "lock_wait_ns",
+    [STATS_COMMIT_NS] = "commit_ns",
+    [STATS_REPLY_BYTES] = "reply_bytes",
+    [STATS_REPLY_SEND_NS] = "reply_send_ns",
+};
+
+static const char *const g_counter_names[STATS_COUNTER_COUNT] = {
+    [STATS_ACCEPTED] = "connections_accepted",
+    [STATS_CLOSED] = "connections_closed",
+    [STATS_PACKETS] = "packets",
+    [STATS_TIMED_OUT] = "connections_timed_out",
+    [STATS_POOL_HITS] = "pool_hits",
+    [STATS_POOL_MISSES] = "pool_misses",
+    [STATS_PAUSED] = "reads_paused",
+    [STATS_COALESCED] = "replies_coalesced",
+    [STATS_COMPRESSED] = "replies_compressed",
+};
+
+static struct {
+    pthread_mutex_t lock;           // guards blocks and retired
+    struct stats_block *blocks;     // one per live thread that recorded something
+    struct stats_block retired;     // sum of the blocks of exited threads
+    pthread_key_t key;              // destructor retires a thread's block
+    pthread_once_t key_once;
+    uint64_t started;               // stats_now() at startup
+    uint64_t last_dump;             // for the accept rate between dumps
+    uint64_t last_accepted;
+    pthread_t thread_id;
+    int thread_started;
+    int event_fd;                   // wakes the stats thread
+    atomic_int dump_requested;
+    atomic_int stopping;
+    int listen_fd;
+    char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+} g_stats = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .key_once = PTHREAD_ONCE_INIT,
+    .event_fd = -1,
+    .listen_fd = -1,
+};
+
+static __thread struct stats_block *t_block;
+
+/**
+ * Add a relaxed snapshot of @param from to @param to (registry lock held)
+ */
+static void stats_block_add(struct stats_block *to, struct stats_block *from)
+{
+    for (int h = 0; h < STATS_HIST_COUNT; h++) {
+        struct stats_histogram *dst = &to->hists[h];
+        struct stats_histogram *src = &from->hists[h];
+        uint64_t max = atomic_load_explicit(&src->max, memory_order_relaxed);
+
+        atomic_fetch_add_explicit(&dst->count, atomic_load_explicit(&src->count, memory_order_relaxed),
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&dst->sum, atomic_load_explicit(&src->sum, memory_order_relaxed),
+                                  memory_order_relaxed);
+        if (max > atomic_load_explicit(&dst->max, memory_order_relaxed)) {
+            atomic_store_explicit(&dst->max, max, memory_order_relaxed);
+        }
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            atomic_fetch_add_explicit(&dst->buckets[b],
+                                      atomic_load_explicit(&src->buckets[b], memory_order_relaxed),
+                                      memory_order_relaxed);
+        }
+    }
+    for (int c = 0; c < STATS_COUNTER_COUNT; c++) {
+        atomic_fetch_add_explicit(&to->counters[c],
+                                  atomic_load_explicit(&from->counters[c], memory_order_relaxed),
+                                  memory_order_relaxed);
+    }
+}
+
+/**
+ * Thread exit: fold the block into the retired totals and free it
+ */
+static void stats_block_retire(void *arg)
+{
+    struct stats_block *block = arg;
+
+    pthread_mutex_lock(&g_stats.lock);
+    for (struct stats_block **link = &g_stats.blocks; *link != NULL; link = &(*link)->next) {
+        if (*link == block) {
+            *link = block->next;
+            break;
+        }
+    }
+    stats_block_add(&g_stats.retired, block);
+    pthread_mutex_unlock(&g_stats.lock);
+    free(block);
+}
+
+static void stats_key_create(void)
+{
+    pthread_key_create(&g_stats.key, stats_block_retire);
+}
+
+/**
+ * @return the calling thread's block, registering it on first use, or NULL
+ * if it can't be allocated (the update is then dropped)
+ */
+static struct stats_block *stats_block(void)
+{
+    struct stats_block *block = t_block;
+    if (block != NULL) {
+        return block;
+    }
+
+    block = calloc(1, sizeof(struct stats_block));
+    if (block == NULL) {
+        return NULL;
+    }
+    pthread_once(&g_stats.key_once, stats_key_create);
+    pthread_setspecific(g_stats.key, block);
+
+    pthread_mutex_lock(&g_stats.lock);
+    block->next = g_stats.blocks;
+    g_stats.blocks = block;
+    pthread_mutex_unlock(&g_stats.lock);
+
+    t_block = block;
+    return block;
+}
+
+/**
+ * Owner-only increment: no other thread writes the counter
+ */
+static inline void stats_add(_Atomic uint64_t *counter, uint64_t n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void stats_record(enum stats_hist hist, uint64_t value)
+{
+    struct stats_block *block = stats_block();
+    if (block == NULL) {
+        return;
+    }
+
+    struct stats_histogram *h = &block->hists[hist];
+    int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    stats_add(&h->count, 1);
+    stats_add(&h->sum, value);
+    stats_add(&h->buckets[bucket], 1);
+    if (value > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max, value, memory_order_relaxed);
+    }
+}
+
+void stats_record_since(enum stats_hist hist, uint64_t start)
+{
+    stats_record(hist, stats_now() - start);
+}
+
+void stats_count(enum stats_counter counter, uint64_t n)
+{
+    struct stats_block *block = stats_block();
+    if (block != NULL) {
+        stats_add(&block->counters[counter], n);
+    }
+}
+
+/**
+ * @return the upper bound of the bucket holding quantile @param q of @param h,
+ * or the maximum if that is lower
+ */
+static uint64_t stats_quantile(const struct stats_histogram *h, uint64_t count, double q)
+{
+    uint64_t target = (uint64_t)(q * count);
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    uint64_t seen = 0;
+
+    if (target == 0) {
+        target = 1;
+    }
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        if (seen >= target) {
+            uint64_t bound = b == 0 ? 0 : b == 64 ? UINT64_MAX : (1ull << b) - 1;
+            return bound < max ? bound : max;
+        }
+    }
+    return max;
+}
+
+/**
+ * Format the current totals into @param buf, one "name values" line each
+ * @return the length of the text
+ */
+static size_t stats_format(char *buf, size_t size)
+{
+    struct stats_block total;
+    size_t len = 0;
+
+    memset(&total, 0, sizeof(total));
+    pthread_mutex_lock(&g_stats.lock);
+    stats_block_add(&total, &g_stats.retired);
+    for (struct stats_block *block = g_stats.blocks; block != NULL; block = block->next) {
+        stats_block_add(&total, block);
+    }
+
+    uint64_t now = stats_now();
+    uint64_t accepted = atomic_load_explicit(&total.counters[STATS_ACCEPTED], memory_order_relaxed);
+    uint64_t closed = atomic_load_explicit(&total.counters[STATS_CLOSED], memory_order_relaxed);
+    double interval = (now - g_stats.last_dump) / 1e9;
+    double rate = interval > 0 ? (accepted - g_stats.last_accepted) / interval : 0;
+    g_stats.last_dump = now;
+    g_stats.last_accepted = accepted;
+    pthread_mutex_unlock(&g_stats.lock);
+
+#define STATS_APPEND(...) \
+    do { \
+        int n = snprintf(buf + len, size - len, __VA_ARGS__); \
+        if (n > 0) { \
+            len += (size_t)n < size - len ? (size_t)n : size - len - 1; \
+        } \
+    } while (0)
+
+    STATS_APPEND("uptime_s %.0f\n", (now - g_stats.started) / 1e9);
+    for (int c = 0; c < STATS_COUNTER_COUNT; c++) {
+        STATS_APPEND("%s %llu\n", g_counter_names[c],
+                     (unsigned long long)atomic_load_explicit(&total.counters[c], memory_order_relaxed));
+    }
+    STATS_APPEND("connections_active %llu\n", (unsigned long long)(accepted - closed));
+    STATS_APPEND("accept_rate %.1f/s over %.1fs\n", rate, interval);
+
+    for (int h = 0; h < STATS_HIST_COUNT; h++) {
+        const struct stats_histogram *hist = &total.hists[h];
+        uint64_t count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+        uint64_t sum = atomic_load_explicit(&hist->sum, memory_order_relaxed);
+        if (count == 0) {
+            STATS_APPEND("%s count=0\n", g_hist_names[h]);
+            continue;
+        }
+        STATS_APPEND("%s count=%llu mean=%llu p50<=%llu p90<=%llu p99<=%llu max=%llu\n",
+                     g_hist_names[h], (unsigned long long)count,
+                     (unsigned long long)(sum / count),
+                     (unsigned long long)stats_quantile(hist, count, 0.50),
+                     (unsigned long long)stats_quantile(hist, count, 0.90),
+                     (unsigned long long)stats_quantile(hist, count, 0.99),
+                     (unsigned long long)atomic_load_explicit(&hist->max, memory_order_relaxed));
+    }
+#undef STATS_APPEND
+    return len;
+}
+
+static void stats_dump_syslog(void)
+{
+    char buf[STATS_DUMP_SIZE];
+    stats_format(buf, sizeof(buf));
+
+    // One message per line keeps them readable in the log
+    for (char *line = strtok(buf, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+        syslog(LOG_INFO, "stats: %s", line);
+    }
+}
+
+/**
+ * Answer one admin client: "stats" or an empty request gets the dump
+ */
+static void stats_serve_client(int client_fd)
+{
+    char request[64];
+    char buf[STATS_DUMP_SIZE];
+    struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+    ssize_t n;
+    size_t len;
+
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    n = recv(client_fd, request, sizeof(request) - 1, 0);
+    if (n < 0) {
+        n = 0;
+    }
+    request[n] = '\0';
+    request[strcspn(request, "\r\n")] = '\0';
+
+    if (request[0] == '\0' || strcmp(request, "stats") == 0) {
+        len = stats_format(buf, sizeof(buf));
+    } else {
+        len = snprintf(buf, sizeof(buf), "unknown command: %s\n", request);
+    }
+    for (size_t sent = 0; sent < len; ) {
+        ssize_t bytes_sent = send(client_fd, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (bytes_sent <= 0) {
+            break;
+        }
+        sent += bytes_sent;
+    }
+}
+
+static void *stats_thread(void *arg)
+{
+    (void)arg;
+    struct pollfd fds[2] = {
+        { .fd = g_stats.event_fd, .events = POLLIN },
+        { .fd = g_stats.listen_fd, .events = POLLIN },
+    };
+    nfds_t nfds = g_stats.listen_fd >= 0 ? 2 : 1;
+
+    while (!atomic_load(&g_stats.stopping)) {
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "poll failed in stats thread: %s", strerror(errno));
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            uint64_t value;
+            ssize_t ret = read(g_stats.event_fd, &value, sizeof(value));
+            (void)ret;
+            if (atomic_exchange(&g_stats.dump_requested, 0)) {
+                stats_dump_syslog();
+            }
+        }
+        if (nfds > 1 && (fds[1].revents & POLLIN)) {
+            int client_fd = accept4(g_stats.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (client_fd >= 0) {
+                stats_serve_client(client_fd);
+                close(client_fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Create the admin socket at @param path
+ */
+static int stats_listen(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "Stats socket path too long: %s", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "socket failed for stats: %s", strerror(errno));
+        return -1;
+    }
+    // A previous instance may have left its socket behind
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        syslog(LOG_ERR, "Failed to listen on %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    strcpy(g_stats.socket_path, path);
+    return fd;
+}
+
+int stats_start(const char *socket_path)
+{
+    g_stats.started = stats_now();
+    g_stats.last_dump = g_stats.started;
+    atomic_store(&g_stats.stopping, 0);
+
+    g_stats.event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (g_stats.event_fd < 0) {
+        syslog(LOG_ERR, "eventfd failed for stats: %s", strerror(errno));
+        return -1;
+    }
+    if (socket_path != NULL) {
+        g_stats.listen_fd = stats_listen(socket_path);
+        if (g_stats.listen_fd < 0) {
+            stats_stop();
+            return -1;
+        }
+    }
+
+    if (pthread_create(&g_stats.thread_id, NULL, stats_thread, NULL) != 0) {
+        syslog(LOG_ERR, "Failed to create stats thread: %s", strerror(errno));
+        stats_stop();
+        return -1;
+    }
+    g_stats.thread_started = 1;
+    return 0;
+}
+
+void stats_stop(void)
+{
+    if (g_stats.thread_started) {
+        uint64_t one = 1;
+        atomic_store(&g_stats.stopping, 1);
+        ssize_t ret = write(g_stats.event_fd, &one, sizeof(one));
+        (void)ret;
+        pthread_join(g_stats.thread_id, NULL);
+        g_stats.thread_started = 0;
+    }
+    if (g_stats.listen_fd >= 0) {
+        close(g_stats.listen_fd);
+        unlink(g_stats.socket_path);
+        g_stats.listen_fd = -1;
+    }
+    if (g_stats.event_fd >= 0) {
+        close(g_stats.event_fd);
+        g_stats.event_fd = -1;
+    }
+}
+
+void stats_request_dump(void)
+{
+    int saved_errno = errno;
+    uint64_t one = 1;
+
+    atomic_store(&g_stats.dump_requested, 1);
+    if (g_stats.event_fd >= 0) {
+        ssize_t ret = write(g_stats.event_fd, &one, sizeof(one));
+        (void)ret;
+    }
+    errno = saved_errno;
+}
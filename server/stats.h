@@ -0,0 +1,71 @@
+/**
+ * @file stats.h
+ * @brief Per-thread latency and size histograms of the server stages
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+/**
+ * Distributions kept as log2 histograms: bucket i counts values below 2^i
+ * and at least 2^(i-1)
+ */
+enum stats_hist {
+    STATS_RECV_NS,          // one recv() call, waiting included on blocking sockets
+    STATS_APPEND_NS,        // packet submitted until committed to the log
+    STATS_LOCK_WAIT_NS,     // writer waiting for g_file_mutex
+    STATS_COMMIT_NS,        // writer committing one batch
+    STATS_REPLY_BYTES,      // bytes sent per reply
+    STATS_REPLY_SEND_NS,    // reply opened until fully sent
+    STATS_HIST_COUNT
+};
+
+enum stats_counter {
+    STATS_ACCEPTED,         // connections accepted
+    STATS_CLOSED,           // connections closed
+    STATS_PACKETS,          // packets received, commands included
+    STATS_TIMED_OUT,        // connections closed for missing a deadline
+    STATS_POOL_HITS,        // buffer pool allocations served from a free list
+    STATS_POOL_MISSES,      // buffer pool allocations that went to malloc()
+    STATS_PAUSED,           // times a connection stopped reading for its reply backlog
+    STATS_COALESCED,        // unsent full replies replaced by a later one (-C)
+    STATS_COMPRESSED,       // replies sent as gzip members (-z)
+    STATS_COUNTER_COUNT
+};
+
+/**
+ * @return a monotonic timestamp in nanoseconds
+ */
+uint64_t stats_now(void);
+
+/**
+ * Add @param value to @param hist of the calling thread.  Only the calling
+ * thread writes its histograms, so this is a few plain stores.
+ */
+void stats_record(enum stats_hist hist, uint64_t value);
+
+/**
+ * stats_record() of the time elapsed since @param start (from stats_now())
+ */
+void stats_record_since(enum stats_hist hist, uint64_t start);
+
+void stats_count(enum stats_counter counter, uint64_t n);
+
+/**
+ * Start the thread dumping the statistics to syslog on stats_request_dump()
+ * and, if @param socket_path is not NULL, to each client of the Unix
+ * socket created there that sends "stats" (or nothing)
+ * @return 0 on success, -1 on error
+ */
+int stats_start(const char *socket_path);
+
+void stats_stop(void);
+
+/**
+ * Ask for a dump to syslog; async-signal-safe, for the SIGUSR1 handler
+ */
+void stats_request_dump(void);
+
+#endif /* STATS_H */
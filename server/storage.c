@@ -0,0 +1,429 @@
+/**
+ * @file storage.c
+ * @brief Storage backends holding the data log, selected at run time
+ *
+ * Every backend is an append-only log: the writer thread appends whole
+ * batches, and replies read the committed prefix, so they can be compared
+ * (see bench.sh) and picked per deployment with -B instead of a rebuild.
+ *
+ * - file: DATA_FILE, removed on exit.  Replies are sent with sendfile().
+ * - chardev: CHAR_DEVICE.  The driver trims its history, so offsets shift
+ *   and there are no delta replies, cache or timestamps.  Replies are sent
+ *   with sendfile() when the driver can splice; older drivers are copied
+ *   from their mmap() mirror when they export one, read otherwise.
+ * - memory: the log only lives in the log cache, which grows without
+ *   bound since nothing is ever persisted and evicted.
+ * - segments: SEGMENT_DIR, split into size-capped files with retention,
+ *   kept across restarts (see segment-log.c).
+ *
+ * A backend opens its descriptors once; they are shared by every reply,
+ * which only uses positional reads and sendfile() with an explicit offset
+ * on them.  Replies get them as extents: the file and chardev backends
+ * have one descriptor for the whole log, while the segments backend hands
+ * out one segment at a time.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "aesdsocket.h"
+#include "storage.h"
+#include "log-writer.h"
+#include "log-cache.h"
+#include "char-map.h"
+#include "segment-log.h"
+
+struct storage_ops {
+    const char *name;
+    const char *path;       // NULL without a file behind it
+    unsigned flags;
+    size_t send_buffer_size;
+    int (*open)(void);
+    void (*close)(void);
+    ssize_t (*append)(const struct iovec *iov, int count);
+    off_t (*start)(void);   // NULL when the log starts at 0
+    off_t (*end)(void);     // NULL when the log starts out empty
+    off_t (*reply_end)(void);
+    int (*extent_get)(off_t offset, struct storage_extent *extent);
+    void (*extent_put)(struct storage_extent *extent);
+    ssize_t (*read)(char *buf, size_t len, off_t offset);
+};
+
+static struct {
+    const struct storage_ops *ops;
+    int write_fd;
+    int read_fd;
+    _Atomic int zero_copy;
+} g_storage = { .write_fd = -1, .read_fd = -1 };
+
+/**
+ * Open the path of the selected backend for appending and for replies
+ */
+static int storage_open_fds(int write_flags)
+{
+    const char *path = g_storage.ops->path;
+
+    g_storage.write_fd = open(path, O_WRONLY | O_CLOEXEC | write_flags, 0644);
+    if (g_storage.write_fd < 0) {
+        syslog(LOG_ERR, "Failed to open %s for appending: %s", path, strerror(errno));
+        return -1;
+    }
+    g_storage.read_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (g_storage.read_fd < 0) {
+        syslog(LOG_ERR, "Failed to open %s for reading: %s", path, strerror(errno));
+        close(g_storage.write_fd);
+        g_storage.write_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void storage_close_fds(void)
+{
+    if (g_storage.write_fd >= 0) {
+        close(g_storage.write_fd);
+        g_storage.write_fd = -1;
+    }
+    if (g_storage.read_fd >= 0) {
+        close(g_storage.read_fd);
+        g_storage.read_fd = -1;
+    }
+}
+
+static ssize_t storage_fd_append(const struct iovec *iov, int count)
+{
+    if (g_storage.write_fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    return writev(g_storage.write_fd, iov, count);
+}
+
+static int storage_fd_extent_get(off_t offset, struct storage_extent *extent)
+{
+    (void)offset;
+    extent->fd = g_storage.read_fd;
+    extent->base = 0;
+    extent->limit = -1;
+    extent->ref = NULL;
+    return extent->fd >= 0 ? 0 : -1;
+}
+
+static void storage_fd_extent_put(struct storage_extent *extent)
+{
+    // The descriptor belongs to the backend
+    (void)extent;
+}
+
+static int storage_file_open(void)
+{
+    // Start fresh
+    unlink(DATA_FILE);
+    g_storage.zero_copy = 1;
+    return storage_open_fds(O_CREAT | O_APPEND);
+}
+
+static void storage_file_close(void)
+{
+    storage_close_fds();
+    unlink(DATA_FILE);
+}
+
+static off_t storage_file_reply_end(void)
+{
+    // Whole batches only: bytes past this may still be being written
+    return log_writer_committed();
+}
+
+static ssize_t storage_file_read(char *buf, size_t len, off_t offset)
+{
+    return pread(g_storage.read_fd, buf, len, offset);
+}
+
+static int storage_chardev_open(void)
+{
+    // Drivers without splice_read fail the first sendfile() with EINVAL, and
+    // replies then copy from the driver's mmap() mirror when it has one
+    if (char_map_open(CHAR_DEVICE) == 0) {
+        syslog(LOG_INFO, "Mapped the %s history for drivers that can't splice", CHAR_DEVICE);
+    }
+    g_storage.zero_copy = 1;
+    if (storage_open_fds(0) != 0) {
+        char_map_close();
+        return -1;
+    }
+    return 0;
+}
+
+static void storage_chardev_close(void)
+{
+    storage_close_fds();
+    char_map_close();
+}
+
+static off_t storage_chardev_reply_end(void)
+{
+    // The driver keeps its own consistency and has no size, read until EOF
+    return -1;
+}
+
+static ssize_t storage_chardev_read(char *buf, size_t len, off_t offset)
+{
+    ssize_t bytes_read = char_map_read(buf, len, offset);
+    if (bytes_read >= 0 || errno != ENODATA) {
+        return bytes_read;
+    }
+    return pread(g_storage.read_fd, buf, len, offset);
+}
+
+static int storage_memory_open(void)
+{
+    // Without persisting, the cap never evicts anything
+    if (!log_cache_enabled() && log_cache_init(SIZE_MAX) != 0) {
+        return -1;
+    }
+    g_storage.zero_copy = 0;
+    return 0;
+}
+
+static void storage_memory_close(void)
+{
+}
+
+static ssize_t storage_memory_append(const struct iovec *iov, int count)
+{
+    (void)iov;
+    (void)count;
+    errno = EBADF;
+    return -1;
+}
+
+static int storage_memory_extent_get(off_t offset, struct storage_extent *extent)
+{
+    (void)offset;
+    extent->fd = -1;
+    extent->ref = NULL;
+    return -1;
+}
+
+static ssize_t storage_memory_read(char *buf, size_t len, off_t offset)
+{
+    // Replies are sent from the cache chunks, nothing is below them
+    (void)buf;
+    (void)len;
+    (void)offset;
+    return 0;
+}
+
+static int storage_segments_open(void)
+{
+    g_storage.zero_copy = 1;
+    return segment_log_open(SEGMENT_DIR);
+}
+
+static void storage_segments_close(void)
+{
+    // The segments stay for the next start
+    segment_log_close();
+}
+
+static int storage_segments_extent_get(off_t offset, struct storage_extent *extent)
+{
+    struct log_segment *segment = segment_log_find(offset);
+    if (segment == NULL) {
+        extent->fd = -1;
+        extent->ref = NULL;
+        return -1;
+    }
+    extent->fd = log_segment_extent(segment, &extent->base, &extent->limit);
+    extent->ref = segment;
+    return 0;
+}
+
+static void storage_segments_extent_put(struct storage_extent *extent)
+{
+    log_segment_put(extent->ref);
+}
+
+static ssize_t storage_segments_read(char *buf, size_t len, off_t offset)
+{
+    struct storage_extent extent;
+    if (storage_segments_extent_get(offset, &extent) != 0) {
+        return 0;
+    }
+    ssize_t bytes_read = 0;
+    if (offset >= extent.base) {
+        if (extent.limit >= 0 && (off_t)len > extent.limit - offset) {
+            len = extent.limit - offset;
+        }
+        bytes_read = pread(extent.fd, buf, len, offset - extent.base);
+    }
+    // Otherwise retention dropped the offset, the log ends there for it
+    storage_segments_extent_put(&extent);
+    return bytes_read;
+}
+
+static const struct storage_ops g_backends[] = {
+    {
+        .name = "file",
+        .path = DATA_FILE,
+        .flags = STORAGE_STABLE_OFFSETS | STORAGE_TIMESTAMPS,
+        .send_buffer_size = SEND_BUFFER_SIZE,
+        .open = storage_file_open,
+        .close = storage_file_close,
+        .append = storage_fd_append,
+        .reply_end = storage_file_reply_end,
+        .extent_get = storage_fd_extent_get,
+        .extent_put = storage_fd_extent_put,
+        .read = storage_file_read,
+    },
+    {
+        .name = "chardev",
+        .path = CHAR_DEVICE,
+        .flags = 0,
+        .send_buffer_size = CHAR_DEVICE_SEND_BUFFER_SIZE,
+        .open = storage_chardev_open,
+        .close = storage_chardev_close,
+        .append = storage_fd_append,
+        .reply_end = storage_chardev_reply_end,
+        .extent_get = storage_fd_extent_get,
+        .extent_put = storage_fd_extent_put,
+        .read = storage_chardev_read,
+    },
+    {
+        .name = "memory",
+        .path = NULL,
+        .flags = STORAGE_STABLE_OFFSETS | STORAGE_TIMESTAMPS | STORAGE_MEMORY,
+        .send_buffer_size = SEND_BUFFER_SIZE,
+        .open = storage_memory_open,
+        .close = storage_memory_close,
+        .append = storage_memory_append,
+        .reply_end = storage_file_reply_end,
+        .extent_get = storage_memory_extent_get,
+        .extent_put = storage_fd_extent_put,
+        .read = storage_memory_read,
+    },
+    {
+        .name = "segments",
+        .path = SEGMENT_DIR,
+        .flags = STORAGE_STABLE_OFFSETS | STORAGE_TIMESTAMPS | STORAGE_PERSISTENT,
+        .send_buffer_size = SEND_BUFFER_SIZE,
+        .open = storage_segments_open,
+        .close = storage_segments_close,
+        .append = segment_log_append,
+        .start = segment_log_start,
+        .end = segment_log_end,
+        .reply_end = storage_file_reply_end,
+        .extent_get = storage_segments_extent_get,
+        .extent_put = storage_segments_extent_put,
+        .read = storage_segments_read,
+    },
+};
+
+/**
+ * @return the backend in use, the build's default until one is selected
+ */
+static const struct storage_ops *storage_ops(void)
+{
+    if (g_storage.ops == NULL) {
+        g_storage.ops = &g_backends[USE_AESD_CHAR_DEVICE ? 1 : 0];
+    }
+    return g_storage.ops;
+}
+
+int storage_select(const char *name)
+{
+    for (size_t i = 0; i < sizeof(g_backends) / sizeof(g_backends[0]); i++) {
+        if (strcmp(g_backends[i].name, name) == 0) {
+            g_storage.ops = &g_backends[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *storage_name(void)
+{
+    return storage_ops()->name;
+}
+
+int storage_has(unsigned flag)
+{
+    return (storage_ops()->flags & flag) != 0;
+}
+
+int storage_open(void)
+{
+    if (storage_ops()->open() != 0) {
+        return -1;
+    }
+    syslog(LOG_INFO, "Storing the log in the %s backend", storage_name());
+    return 0;
+}
+
+void storage_close(void)
+{
+    storage_ops()->close();
+}
+
+ssize_t storage_append(const struct iovec *iov, int count)
+{
+    return storage_ops()->append(iov, count);
+}
+
+off_t storage_start(void)
+{
+    return storage_ops()->start ? storage_ops()->start() : 0;
+}
+
+off_t storage_end(void)
+{
+    return storage_ops()->end ? storage_ops()->end() : 0;
+}
+
+int storage_extent_get(off_t offset, struct storage_extent *extent)
+{
+    return storage_ops()->extent_get(offset, extent);
+}
+
+void storage_extent_put(struct storage_extent *extent)
+{
+    if (extent->fd >= 0) {
+        storage_ops()->extent_put(extent);
+    }
+    extent->fd = -1;
+    extent->ref = NULL;
+}
+
+size_t storage_send_buffer_size(void)
+{
+    return storage_ops()->send_buffer_size;
+}
+
+int storage_zero_copy(void)
+{
+    return atomic_load_explicit(&g_storage.zero_copy, memory_order_relaxed);
+}
+
+void storage_zero_copy_failed(void)
+{
+    if (atomic_exchange_explicit(&g_storage.zero_copy, 0, memory_order_relaxed)) {
+        syslog(LOG_INFO, "%s can't be spliced, copying replies", storage_ops()->path);
+    }
+}
+
+off_t storage_reply_end(void)
+{
+    return storage_ops()->reply_end();
+}
+
+ssize_t storage_read(char *buf, size_t len, off_t offset)
+{
+    return storage_ops()->read(buf, len, offset);
+}
@@ -0,0 +1,120 @@
+/**
+ * @file storage.h
+ * @brief Storage backends holding the data log, selected at run time
+ */
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Offsets into the log never shift, so delta replies and the cache work
+#define STORAGE_STABLE_OFFSETS 0x1
+// Timestamps are appended to the log
+#define STORAGE_TIMESTAMPS 0x2
+// The log only lives in the log cache, nothing is written out
+#define STORAGE_MEMORY 0x4
+// The log outlives the process and carries on when it is opened again
+#define STORAGE_PERSISTENT 0x8
+
+/**
+ * A stretch of the log a reply can send from: log bytes [base, limit) are
+ * at the same positions less base in fd.  limit is -1 when the stretch
+ * runs to the end of the log.
+ */
+struct storage_extent {
+    int fd;
+    off_t base;
+    off_t limit;
+    void *ref;      // what keeps fd open, released by storage_extent_put()
+};
+
+/**
+ * Pick the backend named @param name: "file" (DATA_FILE), "chardev"
+ * (CHAR_DEVICE), "memory" or "segments" (SEGMENT_DIR).  The default is chardev in a
+ * USE_AESD_CHAR_DEVICE build, file otherwise.
+ * @return 0 on success, -1 for an unknown name
+ */
+int storage_select(const char *name);
+
+const char *storage_name(void);
+
+/**
+ * @return whether the selected backend has @param flag (STORAGE_*)
+ */
+int storage_has(unsigned flag);
+
+/**
+ * Open the selected backend, starting from an empty log except for the
+ * segments backend, which carries on with the log it finds.  Descriptors
+ * stay open until storage_close(), so appends and replies don't reopen it.
+ * @return 0 on success, -1 on error
+ */
+int storage_open(void);
+
+/**
+ * Release the backend, removing the data file of the file backend
+ */
+void storage_close(void);
+
+/**
+ * Write @param count buffers to the end of the log (writer thread only)
+ * @return the bytes written, which may be fewer than asked, or -1 on error
+ */
+ssize_t storage_append(const struct iovec *iov, int count);
+
+/**
+ * @return the offset of the oldest byte of the log still stored; only the
+ * segments backend drops any
+ */
+off_t storage_start(void);
+
+/**
+ * @return the offset the log ended at when it was opened
+ */
+off_t storage_end(void);
+
+/**
+ * Fill @param extent with where the log byte at @param offset can be sent
+ * from.  If it was dropped already the extent starts past it.
+ * @return 0 on success, -1 if the backend has no descriptor to send from
+ */
+int storage_extent_get(off_t offset, struct storage_extent *extent);
+
+/**
+ * Release @param extent, leaving its fd at -1
+ */
+void storage_extent_put(struct storage_extent *extent);
+
+/**
+ * @return the size of the bounce buffer replies copy through when extents
+ * can't be spliced
+ */
+size_t storage_send_buffer_size(void);
+
+/**
+ * @return whether replies should try sendfile() on extents
+ */
+int storage_zero_copy(void);
+
+/**
+ * Record that sendfile() failed on an extent, so later replies go straight
+ * to the copying path
+ */
+void storage_zero_copy_failed(void);
+
+/**
+ * @return how much of the log a reply opened now covers, or -1 to read
+ * until EOF when the backend keeps its own consistency and has no size
+ */
+off_t storage_reply_end(void);
+
+/**
+ * Copy up to @param len bytes of the log at @param offset into @param buf
+ * @return the bytes copied, 0 at the end of the log, -1 on error
+ */
+ssize_t storage_read(char *buf, size_t len, off_t offset);
+
+#endif /* STORAGE_H */
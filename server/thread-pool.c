@@ -0,0 +1,121 @@
+/**
+ * @file thread-pool.c
+ * @brief Fixed size worker thread pool fed by a bounded queue
+ *
+ * Workers are created once up front, so accepting a connection only costs
+ * a queue insertion.  The queue is bounded: when every worker is busy and
+ * the queue is full, thread_pool_submit() fails and the caller decides what
+ * to do with the item (admission control) instead of spawning more threads.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+
+#include "thread-pool.h"
+
+/**
+ * Worker thread: run the handler for queued items until the pool stops
+ */
+static void *thread_pool_worker(void *arg)
+{
+    struct thread_pool *pool = (struct thread_pool *)arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->count == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        }
+        if (pool->stopping) {
+            break;
+        }
+
+        void *item = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->count--;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->handler(item);
+
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+int thread_pool_start(struct thread_pool *pool, size_t nworkers, size_t capacity,
+                      thread_pool_fn handler)
+{
+    memset(pool, 0, sizeof(struct thread_pool));
+    pool->handler = handler;
+    pool->capacity = capacity;
+
+    pool->queue = calloc(capacity, sizeof(void *));
+    pool->workers = calloc(nworkers, sizeof(pthread_t));
+    if (!pool->queue || !pool->workers) {
+        syslog(LOG_ERR, "malloc failed for thread pool: %s", strerror(errno));
+        free(pool->queue);
+        free(pool->workers);
+        return -1;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+
+    for (size_t i = 0; i < nworkers; i++) {
+        if (pthread_create(&pool->workers[i], NULL, thread_pool_worker, pool) != 0) {
+            syslog(LOG_ERR, "Failed to create worker thread: %s", strerror(errno));
+            thread_pool_stop(pool, NULL);
+            return -1;
+        }
+        pool->nworkers++;
+    }
+    return 0;
+}
+
+int thread_pool_submit(struct thread_pool *pool, void *item)
+{
+    int result = -1;
+
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->stopping && pool->count < pool->capacity) {
+        pool->queue[(pool->head + pool->count) % pool->capacity] = item;
+        pool->count++;
+        pthread_cond_signal(&pool->not_empty);
+        result = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return result;
+}
+
+void thread_pool_stop(struct thread_pool *pool, thread_pool_fn drain)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->nworkers; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    // No worker is left, items still queued never got served
+    while (pool->count > 0) {
+        void *item = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->count--;
+        if (drain) {
+            drain(item);
+        }
+    }
+
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->queue);
+    free(pool->workers);
+    pool->queue = NULL;
+    pool->workers = NULL;
+    pool->nworkers = 0;
+}
@@ -0,0 +1,57 @@
+/**
+ * @file thread-pool.h
+ * @brief Fixed size worker thread pool fed by a bounded queue
+ */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+typedef void (*thread_pool_fn)(void *item);
+
+struct thread_pool {
+    /**
+     * Called by a worker for every item taken from the queue
+     */
+    thread_pool_fn handler;
+    /**
+     * Worker threads, nworkers of which were started
+     */
+    pthread_t *workers;
+    size_t nworkers;
+    /**
+     * Ring of pending items: count items starting at head
+     */
+    void **queue;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+};
+
+/**
+ * Start @param nworkers threads running @param handler for items queued on
+ * @param pool, with room for @param capacity items waiting for a worker.
+ * @return 0 on success, -1 if the pool could not be created
+ */
+int thread_pool_start(struct thread_pool *pool, size_t nworkers, size_t capacity,
+                      thread_pool_fn handler);
+
+/**
+ * Hand @param item to the next idle worker without blocking.
+ * @return 0 if the item was queued, -1 if the queue is full or the pool is
+ * stopping; the caller keeps ownership of @param item in that case.
+ */
+int thread_pool_submit(struct thread_pool *pool, void *item);
+
+/**
+ * Stop the pool: workers finish their current item and exit, then
+ * @param drain (if not NULL) is called for every item still queued.
+ */
+void thread_pool_stop(struct thread_pool *pool, thread_pool_fn drain);
+
+#endif /* THREAD_POOL_H */
@@ -0,0 +1,305 @@
+/**
+ * @file timer.c
+ * @brief Hashed timer wheel driven by a timerfd, and connection deadlines
+ *
+ * Time is cut into TIMER_TICK_MS ticks and a timer due at tick t sits in
+ * slot t % TIMER_WHEEL_SLOTS, so adding and cancelling one are a list
+ * insert and unlink.  Running the wheel visits the slots of the ticks that
+ * went by since the last run, at most one full turn, and fires the timers
+ * in them that are due; timers due on a later turn stay where they are.
+ * The timerfd is only armed for the next occupied slot, so a wheel with
+ * nothing due soon causes no wakeups.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/timerfd.h>
+
+#include "timer.h"
+
+static uint64_t g_idle_ms;
+static uint64_t g_read_ms;
+static uint64_t g_send_ms;
+
+uint64_t timer_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @return the current tick, from the precise clock the timerfd uses
+ */
+static uint64_t timer_tick_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
+
+/**
+ * Set the timerfd to fire at @param tick, or disarm it if @param tick is 0
+ */
+static void timer_wheel_arm(struct timer_wheel *wheel, uint64_t tick)
+{
+    struct itimerspec spec;
+    uint64_t ms = tick * TIMER_TICK_MS;
+
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = ms / 1000;
+    spec.it_value.tv_nsec = (ms % 1000) * 1000000;
+    if (timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        syslog(LOG_ERR, "timerfd_settime failed: %s", strerror(errno));
+        return;
+    }
+    wheel->armed = tick;
+}
+
+/**
+ * Arm the timerfd for the first occupied slot after the current tick
+ */
+static void timer_wheel_rearm(struct timer_wheel *wheel)
+{
+    for (uint64_t tick = wheel->tick + 1; tick <= wheel->tick + TIMER_WHEEL_SLOTS; tick++) {
+        struct timer *head = &wheel->slots[tick % TIMER_WHEEL_SLOTS];
+        if (head->next != head) {
+            timer_wheel_arm(wheel, tick);
+            return;
+        }
+    }
+    timer_wheel_arm(wheel, 0);
+}
+
+static void timer_link(struct timer *head, struct timer *timer)
+{
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+int timer_wheel_init(struct timer_wheel *wheel)
+{
+    wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (wheel->fd < 0) {
+        syslog(LOG_ERR, "timerfd_create failed: %s", strerror(errno));
+        return -1;
+    }
+    wheel->tick = timer_tick_now();
+    wheel->armed = 0;
+    for (size_t i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        wheel->slots[i].next = &wheel->slots[i];
+        wheel->slots[i].prev = &wheel->slots[i];
+    }
+    return 0;
+}
+
+void timer_wheel_destroy(struct timer_wheel *wheel)
+{
+    if (wheel->fd >= 0) {
+        close(wheel->fd);
+        wheel->fd = -1;
+    }
+}
+
+void timer_init(struct timer *timer, void (*fn)(struct timer *timer), void *data)
+{
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->data = data;
+}
+
+void timer_add(struct timer_wheel *wheel, struct timer *timer, uint64_t delay_ms)
+{
+    uint64_t expires = timer_tick_now() + (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+    // Never into a slot the current run has already passed
+    if (expires <= wheel->tick) {
+        expires = wheel->tick + 1;
+    }
+    timer_cancel(timer);
+    timer->expires = expires;
+    timer_link(&wheel->slots[expires % TIMER_WHEEL_SLOTS], timer);
+
+    if (wheel->armed == 0 || expires < wheel->armed) {
+        timer_wheel_arm(wheel, expires);
+    }
+}
+
+void timer_cancel(struct timer *timer)
+{
+    if (!timer_pending(timer)) {
+        return;
+    }
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+void timer_wheel_run(struct timer_wheel *wheel)
+{
+    uint64_t expirations;
+    uint64_t now = timer_tick_now();
+    uint64_t last = wheel->tick;
+    uint64_t ticks = now > last ? now - last : 0;
+
+    // Only clears readiness, the clock says what is due
+    ssize_t ret = read(wheel->fd, &expirations, sizeof(expirations));
+    (void)ret;
+
+    if (ticks > TIMER_WHEEL_SLOTS) {
+        ticks = TIMER_WHEEL_SLOTS;
+    }
+    // Timers added from here on land after now
+    wheel->tick = now > last ? now : last;
+    wheel->armed = 0;
+
+    for (uint64_t i = 1; i <= ticks; i++) {
+        struct timer *head = &wheel->slots[(last + i) % TIMER_WHEEL_SLOTS];
+        struct timer pending;
+
+        // Detach the slot so functions can add and cancel freely
+        if (head->next == head) {
+            continue;
+        }
+        pending.next = head->next;
+        pending.prev = head->prev;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        head->next = head;
+        head->prev = head;
+
+        while (pending.next != &pending) {
+            struct timer *timer = pending.next;
+            timer_cancel(timer);
+            if (timer->expires > now) {
+                // Due on a later turn of the wheel
+                timer_link(head, timer);
+                continue;
+            }
+            timer->fn(timer);
+        }
+    }
+
+    timer_wheel_rearm(wheel);
+}
+
+void deadline_configure(uint64_t idle_ms, uint64_t read_ms, uint64_t send_ms)
+{
+    g_idle_ms = idle_ms;
+    g_read_ms = read_ms;
+    g_send_ms = send_ms;
+}
+
+int deadline_enabled(void)
+{
+    return g_idle_ms > 0 || g_read_ms > 0 || g_send_ms > 0;
+}
+
+/**
+ * @return the milliseconds left until @param since + @param timeout, if
+ * less than @param remaining
+ */
+static uint64_t deadline_earlier(uint64_t remaining, uint64_t since, uint64_t timeout,
+                                 uint64_t now)
+{
+    if (timeout == 0 || since == 0) {
+        return remaining;
+    }
+    uint64_t due = since + timeout;
+    uint64_t left = due > now ? due - now : 0;
+    return left < remaining ? left : remaining;
+}
+
+/**
+ * @return milliseconds until the earliest deadline of @param deadline
+ * (0 once it passed), or UINT64_MAX if none applies
+ */
+static uint64_t deadline_remaining(struct deadline *deadline, uint64_t now)
+{
+    uint64_t remaining = UINT64_MAX;
+    uint64_t active = atomic_load_explicit(&deadline->active, memory_order_relaxed);
+    uint64_t partial = atomic_load_explicit(&deadline->partial, memory_order_relaxed);
+    uint64_t stalled = atomic_load_explicit(&deadline->stalled, memory_order_relaxed);
+
+    remaining = deadline_earlier(remaining, active, g_idle_ms, now);
+    remaining = deadline_earlier(remaining, partial, g_read_ms, now);
+    return deadline_earlier(remaining, stalled, g_send_ms, now);
+}
+
+/**
+ * Add the timer of @param deadline for the next check.  A packet can start
+ * and the replies back up at any time, so the check is never further out
+ * than the read and send timeouts.
+ */
+static void deadline_schedule(struct timer_wheel *wheel, struct deadline *deadline,
+                              uint64_t remaining)
+{
+    if (g_read_ms > 0 && g_read_ms < remaining) {
+        remaining = g_read_ms;
+    }
+    if (g_send_ms > 0 && g_send_ms < remaining) {
+        remaining = g_send_ms;
+    }
+    timer_add(wheel, &deadline->timer, remaining);
+}
+
+void deadline_start(struct timer_wheel *wheel, struct deadline *deadline,
+                    void (*fn)(struct timer *timer), void *data)
+{
+    timer_init(&deadline->timer, fn, data);
+    atomic_store_explicit(&deadline->active, timer_now(), memory_order_relaxed);
+    atomic_store_explicit(&deadline->partial, 0, memory_order_relaxed);
+    atomic_store_explicit(&deadline->stalled, 0, memory_order_relaxed);
+    if (deadline_enabled()) {
+        deadline_schedule(wheel, deadline, g_idle_ms > 0 ? g_idle_ms : UINT64_MAX);
+    }
+}
+
+void deadline_update(struct deadline *deadline, size_t pending)
+{
+    uint64_t now = timer_now();
+
+    atomic_store_explicit(&deadline->active, now, memory_order_relaxed);
+    if (pending == 0) {
+        atomic_store_explicit(&deadline->partial, 0, memory_order_relaxed);
+    } else if (atomic_load_explicit(&deadline->partial, memory_order_relaxed) == 0) {
+        atomic_store_explicit(&deadline->partial, now, memory_order_relaxed);
+    }
+}
+
+void deadline_stalled(struct deadline *deadline, int stalled)
+{
+    atomic_store_explicit(&deadline->stalled, stalled ? timer_now() : 0, memory_order_relaxed);
+}
+
+void deadline_progress(struct deadline *deadline)
+{
+    if (deadline == NULL) {
+        return;
+    }
+    // The send timeout counts from the last progress, not from the stall
+    uint64_t now = timer_now();
+    atomic_store_explicit(&deadline->active, now, memory_order_relaxed);
+    if (atomic_load_explicit(&deadline->stalled, memory_order_relaxed) != 0) {
+        atomic_store_explicit(&deadline->stalled, now, memory_order_relaxed);
+    }
+}
+
+int deadline_expired(struct timer_wheel *wheel, struct deadline *deadline)
+{
+    uint64_t remaining = deadline_remaining(deadline, timer_now());
+    if (remaining == 0) {
+        return 1;
+    }
+    deadline_schedule(wheel, deadline, remaining);
+    return 0;
+}
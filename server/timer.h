@@ -0,0 +1,146 @@
+/**
+ * @file timer.h
+ * @brief Hashed timer wheel driven by a timerfd, and connection deadlines
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define TIMER_TICK_MS 100
+// Slots of the wheel; timers further out than one turn wait in their slot
+#define TIMER_WHEEL_SLOTS 512
+
+/**
+ * A timer, owned by whoever embeds it.  It sits in the list of its slot
+ * while pending, so adding and cancelling it take constant time.
+ */
+struct timer {
+    struct timer *next;
+    struct timer *prev;
+    uint64_t expires;       // wheel tick it fires at
+    void (*fn)(struct timer *timer);
+    void *data;
+};
+
+/**
+ * A set of timers run by one thread.  The timerfd becomes readable when the
+ * next occupied slot is due; the owner polls it with its other descriptors
+ * and calls timer_wheel_run() then.  Nothing here locks, a wheel used from
+ * several threads needs a lock around every call.
+ */
+struct timer_wheel {
+    int fd;
+    uint64_t tick;          // last tick run
+    uint64_t armed;         // tick the timerfd is set for, 0 when disarmed
+    struct timer slots[TIMER_WHEEL_SLOTS];  // list heads
+};
+
+/**
+ * @return a millisecond monotonic clock that is cheap enough to read per
+ * packet (the kernel's cached time, good to a few milliseconds)
+ */
+uint64_t timer_now(void);
+
+int timer_wheel_init(struct timer_wheel *wheel);
+
+/**
+ * Close the timerfd.  Timers still pending are left alone; their owners
+ * must not cancel them afterwards.
+ */
+void timer_wheel_destroy(struct timer_wheel *wheel);
+
+void timer_init(struct timer *timer, void (*fn)(struct timer *timer), void *data);
+
+/**
+ * Run @param timer in @param delay_ms (rounded up to the next tick).  A
+ * pending timer is moved.
+ */
+void timer_add(struct timer_wheel *wheel, struct timer *timer, uint64_t delay_ms);
+
+/**
+ * Stop @param timer if it is pending
+ */
+void timer_cancel(struct timer *timer);
+
+/**
+ * @return the structure of @param type whose @param member is the timer
+ * (or deadline) at @param ptr
+ */
+#define timer_container(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+static inline int timer_pending(const struct timer *timer)
+{
+    return timer->next != NULL;
+}
+
+/**
+ * Run every timer that is due and rearm the timerfd.  Timers may add or
+ * cancel timers, themselves included, from their function.
+ */
+void timer_wheel_run(struct timer_wheel *wheel);
+
+/**
+ * Idle, read and send deadlines of a client connection.  The connection
+ * closes when nothing arrived for the idle timeout, when an unterminated
+ * packet was started longer than the read timeout ago, or when its replies
+ * have been backed up for longer than the send timeout.  The serving thread
+ * only stamps the connection (see deadline_update()); the timer checks the
+ * stamps when it fires and sleeps again if the connection was busy, so the
+ * wheel is only touched when connections come, go or time out.
+ */
+struct deadline {
+    struct timer timer;
+    _Atomic uint64_t active;    // timer_now() when input was last handled or replies moved
+    _Atomic uint64_t partial;   // timer_now() when an unterminated packet began, 0 for none
+    _Atomic uint64_t stalled;   // timer_now() when reading was paused for backlog, 0 if not
+};
+
+/**
+ * Set the timeouts used by every deadline, 0 disabling one
+ */
+void deadline_configure(uint64_t idle_ms, uint64_t read_ms, uint64_t send_ms);
+
+/**
+ * @return whether any timeout is enabled
+ */
+int deadline_enabled(void);
+
+/**
+ * Start watching a new connection, calling @param fn with @param data
+ * set in the timer when its deadline may have passed
+ */
+void deadline_start(struct timer_wheel *wheel, struct deadline *deadline,
+                    void (*fn)(struct timer *timer), void *data);
+
+/**
+ * Record that the connection handled its input and waits for more, with
+ * @param pending bytes of an unterminated packet left over.  Any thread may
+ * call this, it only stores the stamps.
+ */
+void deadline_update(struct deadline *deadline, size_t pending);
+
+/**
+ * Record that the connection stopped (@param stalled set) or resumed reading
+ * because of its reply backlog
+ */
+void deadline_stalled(struct deadline *deadline, int stalled);
+
+/**
+ * Record that reply bytes went out: the client is alive, and a backlog that
+ * is still being read is not stalled.  Does nothing for a NULL
+ * @param deadline.
+ */
+void deadline_progress(struct deadline *deadline);
+
+/**
+ * Called from the timer function: @return 1 if a deadline has passed,
+ * otherwise add the timer again for the next check and return 0
+ */
+int deadline_expired(struct timer_wheel *wheel, struct deadline *deadline);
+
+#endif /* TIMER_H */
@@ -0,0 +1,800 @@
+/**
+ * @file uring-loop.c
+ * @brief io_uring based connection engine for aesdsocket
+ *
+ * Every loop thread owns a ring.  A multishot accept keeps producing new
+ * connections, and each connection keeps one recv queued whose destination
+ * the kernel picks from a group of provided buffers, so idle connections
+ * hold no receive memory inside the kernel.  Completions are reaped in
+ * batches and the follow-up requests of a whole batch (re-armed recvs,
+ * returned buffers, POLLOUT waits) go in with the next io_uring_enter(),
+ * which also waits for the next completions.
+ *
+ * Appends still go through the writer thread, which is the only appender
+ * of the log and publishes its committed length.  It hands them back
+ * through an eventfd the ring polls, and a closing connection waits for its
+ * batch like for its requests in flight on the ring.  Replies are
+ * streamed inline with the zero-copy reply path and only fall back to a
+ * POLLOUT request on the ring when the socket buffer fills up.
+ *
+ * A poll on the timerfd of the loop's timer wheel stays queued like the
+ * wakeup poll, so connection deadlines and, on the first ring, timestamps
+ * run between completions.
+ *
+ * The ring is driven with the raw system calls so no liburing is needed.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+
+#include "aesdsocket.h"
+#include "connection.h"
+#include "stats.h"
+#include "timer.h"
+#include "shard.h"
+#include "buffer-pool.h"
+#include "log-writer.h"
+
+#define URING_LOOP_ENTRIES 256
+// Receive buffers provided to the kernel per ring
+#define URING_RECV_BUFFERS 256
+#define URING_RECV_BUFFER_SIZE (4 * BUFFER_SIZE)
+#define URING_BUFFER_GROUP 0
+
+/**
+ * What a completion belongs to, kept in the low bits of user_data next to
+ * the connection pointer (connections are at least 8 byte aligned)
+ */
+enum uring_op {
+    URING_OP_ACCEPT = 1,
+    URING_OP_WAKEUP,
+    URING_OP_PROVIDE,
+    URING_OP_RECV,
+    URING_OP_POLLOUT,
+    URING_OP_TIMER,
+    URING_OP_COMPLETIONS,
+};
+#define URING_OP_MASK 7
+
+struct uring_loop {
+    pthread_t thread_id;
+    int shard;
+    int ring_fd;
+    int listen_fd;
+    int multishot_accept;   // cleared if the kernel rejects multishot accept
+    struct connection *connections;
+    struct timer_wheel timers;
+    struct log_completions completions;
+
+    // Submission queue, shared with the kernel
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;     // tail including entries not yet published
+    unsigned to_submit;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    // Completion queue, shared with the kernel
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    char *recv_buffers;
+    char *send_buf;                     // bounce buffer without zero-copy
+    size_t send_buf_size;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+/**
+ * Hand every prepared request to the kernel and, if @param wait is set,
+ * block until at least one completion is available
+ * Returns 0 on success, -1 if the ring failed
+ */
+static int uring_loop_submit(struct uring_loop *loop, int wait)
+{
+    // Make the new entries visible before the kernel looks at the tail
+    __atomic_store_n(loop->sq_tail, loop->sq_local_tail, __ATOMIC_RELEASE);
+
+    while (1) {
+        int submitted = uring_enter(loop->ring_fd, loop->to_submit, wait ? 1 : 0,
+                                    wait ? IORING_ENTER_GETEVENTS : 0);
+        if (submitted >= 0) {
+            loop->to_submit -= submitted;
+            if (loop->to_submit == 0 || !wait) {
+                return 0;
+            }
+            continue;
+        }
+        if (errno == EINTR) {
+            // Woken by a signal: let the caller check for shutdown
+            return 0;
+        }
+        if (errno == EBUSY || errno == EAGAIN) {
+            // Completions have to be reaped before more can be submitted
+            return 0;
+        }
+        syslog(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+        return -1;
+    }
+}
+
+/**
+ * Get a cleared submission entry, flushing the queue to the kernel first
+ * if it is full
+ */
+static struct io_uring_sqe *uring_loop_get_sqe(struct uring_loop *loop)
+{
+    while (loop->sq_local_tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE) >=
+           loop->sq_entries) {
+        if (uring_loop_submit(loop, 0) != 0) {
+            return NULL;
+        }
+    }
+
+    unsigned index = loop->sq_local_tail & *loop->sq_mask;
+    struct io_uring_sqe *sqe = &loop->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    loop->sq_array[index] = index;
+    loop->sq_local_tail++;
+    loop->to_submit++;
+    return sqe;
+}
+
+static uint64_t uring_tag(struct connection *conn, enum uring_op op)
+{
+    return (uint64_t)(uintptr_t)conn | op;
+}
+
+/**
+ * Queue the (multishot if possible) accept on the listening socket
+ */
+static int uring_loop_arm_accept(struct uring_loop *loop)
+{
+    struct io_uring_sqe *sqe = uring_loop_get_sqe(loop);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listen_fd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if (loop->multishot_accept) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    sqe->user_data = uring_tag(NULL, URING_OP_ACCEPT);
+    return 0;
+}
+
+/**
+ * Wait for the shutdown eventfd so a signal ends the wait.  It is never
+ * read, so every loop sees it readable.
+ */
+static int uring_loop_arm_wakeup(struct uring_loop *loop)
+{
+    struct io_uring_sqe *sqe = uring_loop_get_sqe(loop);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = g_wakeup_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = uring_tag(NULL, URING_OP_WAKEUP);
+    return 0;
+}
+
+/**
+ * Wait for the timerfd, which is readable when the wheel has timers due
+ */
+static int uring_loop_arm_timer(struct uring_loop *loop)
+{
+    struct io_uring_sqe *sqe = uring_loop_get_sqe(loop);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->timers.fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = uring_tag(NULL, URING_OP_TIMER);
+    return 0;
+}
+
+/**
+ * Wait for the writer to hand back appends
+ */
+static int uring_loop_arm_completions(struct uring_loop *loop)
+{
+    struct io_uring_sqe *sqe = uring_loop_get_sqe(loop);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->completions.fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = uring_tag(NULL, URING_OP_COMPLETIONS);
+    return 0;
+}
+
+/**
+ * Give @param count receive buffers starting at @param bid (back) to the
+ * kernel
+ */
+static int uring_loop_provide(struct uring_loop *loop, unsigned bid, unsigned count)
+{
+    struct io_uring_sqe *sqe = uring_loop_get_sqe(loop);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (uint64_t)(uintptr_t)(loop->recv_buffers + (size_t)bid * URING_RECV_BUFFER_SIZE);
+    sqe->len = URING_RECV_BUFFER_SIZE;
+    sqe->off = bid;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = uring_tag(NULL, URING_OP_PROVIDE);
+    return 0;
+}
+
+/**
+ * Queue a recv on @param conn into whichever provided buffer is free
+ */
+static int uring_loop_arm_recv(struct uring_loop *loop, struct connection *conn)
+{
+    struct io_uring_sqe *sqe = uring_loop_get_sqe(loop);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->len = URING_RECV_BUFFER_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = uring_tag(conn, URING_OP_RECV);
+    conn->pending++;
+    conn->want_read = 1;
+    return 0;
+}
+
+/**
+ * Wait for @param conn to become writable again
+ */
+static int uring_loop_arm_pollout(struct uring_loop *loop, struct connection *conn)
+{
+    struct io_uring_sqe *sqe = uring_loop_get_sqe(loop);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = uring_tag(conn, URING_OP_POLLOUT);
+    conn->pending++;
+    conn->want_write = 1;
+    return 0;
+}
+
+/**
+ * Start tearing down @param conn.  Shutting the socket down completes the
+ * requests still queued on it; the connection is freed with the last one.
+ */
+static void uring_loop_close(struct connection *conn)
+{
+    if (!conn->closing) {
+        conn->closing = 1;
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+}
+
+/**
+ * Remove @param conn from its loop and free it
+ */
+static void uring_loop_destroy_connection(struct uring_loop *loop, struct connection *conn)
+{
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        loop->connections = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    connection_destroy(conn);
+}
+
+/**
+ * Free @param conn if it is closing and nothing in flight refers to it
+ */
+static void uring_loop_reap(struct uring_loop *loop, struct connection *conn)
+{
+    if (conn->closing && conn->pending == 0 && !connection_appending(conn)) {
+        uring_loop_destroy_connection(loop, conn);
+    }
+}
+
+/**
+ * Send what can be sent now and wait for POLLOUT if replies are left, then
+ * queue the next recv if the connection takes input
+ */
+static void uring_loop_flush(struct uring_loop *loop, struct connection *conn)
+{
+    if (connection_flush(conn, loop->send_buf, loop->send_buf_size) != 0) {
+        uring_loop_close(conn);
+        return;
+    }
+    if (conn->reply_head != NULL && !conn->want_write &&
+        uring_loop_arm_pollout(loop, conn) != 0) {
+        uring_loop_close(conn);
+        return;
+    }
+    if (!conn->closing && connection_reading(conn) && !conn->want_read &&
+        uring_loop_arm_recv(loop, conn) != 0) {
+        uring_loop_close(conn);
+    }
+}
+
+/**
+ * Timer function of a connection's deadline
+ */
+static void uring_loop_timeout(struct timer *timer)
+{
+    struct uring_loop *loop = timer->data;
+    struct connection *conn = timer_container(timer, struct connection, deadline.timer);
+
+    if (!conn->closing && deadline_expired(&loop->timers, &conn->deadline)) {
+        syslog(LOG_INFO, "Connection from %s timed out", conn->ip);
+        stats_count(STATS_TIMED_OUT, 1);
+        uring_loop_close(conn);
+    }
+}
+
+static void uring_loop_handle_accept(struct uring_loop *loop, struct io_uring_cqe *cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !g_signal_received) {
+        if (cqe->res == -EINVAL && loop->multishot_accept) {
+            // Older kernel: fall back to one accept request per connection
+            loop->multishot_accept = 0;
+            uring_loop_arm_accept(loop);
+            return;
+        }
+        uring_loop_arm_accept(loop);
+    }
+
+    if (cqe->res < 0) {
+        if (cqe->res != -ECONNABORTED && cqe->res != -EINTR && !g_signal_received) {
+            syslog(LOG_ERR, "accept failed: %s", strerror(-cqe->res));
+        }
+        return;
+    }
+
+    int client_fd = cqe->res;
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    if (getpeername(client_fd, (struct sockaddr *)&client_addr, &client_addr_len) < 0) {
+        memset(&client_addr, 0, sizeof(client_addr));
+    }
+
+    struct connection *conn = connection_create(client_fd, &client_addr, &loop->completions);
+    if (!conn) {
+        close(client_fd);
+        return;
+    }
+    if (uring_loop_arm_recv(loop, conn) != 0) {
+        connection_destroy(conn);
+        return;
+    }
+
+    conn->next = loop->connections;
+    if (loop->connections != NULL) {
+        loop->connections->prev = conn;
+    }
+    loop->connections = conn;
+    deadline_start(&loop->timers, &conn->deadline, uring_loop_timeout, loop);
+
+    syslog(LOG_INFO, "Accepted connection from %s", conn->ip);
+}
+
+/**
+ * Move the bytes of a completed recv into the connection's packet buffer,
+ * returning the provided buffer to the kernel
+ * Returns 0 on success, -1 if the connection has to be closed
+ */
+static int uring_loop_receive(struct uring_loop *loop, struct connection *conn,
+                              struct io_uring_cqe *cqe)
+{
+    unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    const char *data = loop->recv_buffers + (size_t)bid * URING_RECV_BUFFER_SIZE;
+    size_t len = cqe->res;
+    int result = 0;
+
+    while (len > 0) {
+        size_t avail;
+        char *dest = packet_buffer_reserve(&conn->rx, &avail);
+        if (!dest) {
+            result = -1;
+            break;
+        }
+        if (avail > len) {
+            avail = len;
+        }
+        memcpy(dest, data, avail);
+        packet_buffer_commit(&conn->rx, avail);
+        data += avail;
+        len -= avail;
+    }
+
+    if (uring_loop_provide(loop, bid, 1) != 0) {
+        return -1;
+    }
+    return result;
+}
+
+static void uring_loop_handle_recv(struct uring_loop *loop, struct connection *conn,
+                                   struct io_uring_cqe *cqe)
+{
+    conn->want_read = 0;
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        if (uring_loop_receive(loop, conn, cqe) != 0) {
+            uring_loop_close(conn);
+            return;
+        }
+    } else if (cqe->flags & IORING_CQE_F_BUFFER) {
+        // A buffer was picked but nothing landed in it
+        uring_loop_provide(loop, cqe->flags >> IORING_CQE_BUFFER_SHIFT, 1);
+        uring_loop_close(conn);
+        return;
+    } else if (cqe->res == -ENOBUFS || cqe->res == -EAGAIN || cqe->res == -EINTR) {
+        // Every buffer was in use; the ones being returned will serve it
+        if (!conn->closing && uring_loop_arm_recv(loop, conn) != 0) {
+            uring_loop_close(conn);
+        }
+        return;
+    } else {
+        if (cqe->res < 0 && !conn->closing && !g_signal_received) {
+            syslog(LOG_ERR, "recv failed: %s", strerror(-cqe->res));
+        }
+        // Connection closed
+        uring_loop_close(conn);
+        return;
+    }
+
+    if (conn->closing) {
+        return;
+    }
+    if (connection_process_packets(conn) != 0) {
+        uring_loop_close(conn);
+        return;
+    }
+    uring_loop_flush(loop, conn);
+    deadline_update(&conn->deadline, connection_pending_input(conn));
+}
+
+static void uring_loop_handle_pollout(struct uring_loop *loop, struct connection *conn,
+                                      struct io_uring_cqe *cqe)
+{
+    conn->want_write = 0;
+    if (conn->closing) {
+        return;
+    }
+    if (cqe->res < 0 || (cqe->res & (POLLERR | POLLHUP))) {
+        uring_loop_close(conn);
+        return;
+    }
+    uring_loop_flush(loop, conn);
+    // Replies moving keep the client alive like input does
+    deadline_update(&conn->deadline, connection_pending_input(conn));
+}
+
+/**
+ * Take back the appends the writer committed, and queue the replies of
+ * every connection whose batch is complete
+ */
+static void uring_loop_complete(struct uring_loop *loop)
+{
+    struct log_write *req = log_completions_take(&loop->completions);
+
+    while (req != NULL) {
+        struct log_write *next = req->completed_next;
+        struct connection *conn = connection_append_done(req);
+        if (conn != NULL) {
+            if (conn->closing) {
+                uring_loop_reap(loop, conn);
+            } else if (connection_append_finish(conn) != 0) {
+                uring_loop_close(conn);
+            } else {
+                uring_loop_flush(loop, conn);
+                deadline_update(&conn->deadline, connection_pending_input(conn));
+            }
+        }
+        req = next;
+    }
+}
+
+/**
+ * Dispatch one completion
+ */
+static void uring_loop_handle(struct uring_loop *loop, struct io_uring_cqe *cqe)
+{
+    enum uring_op op = cqe->user_data & URING_OP_MASK;
+    struct connection *conn = (struct connection *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+
+    switch (op) {
+        case URING_OP_ACCEPT:
+            uring_loop_handle_accept(loop, cqe);
+            return;
+        case URING_OP_WAKEUP:
+            // Shutdown flag is checked by the loop, keep listening otherwise
+            if (!g_signal_received) {
+                uring_loop_arm_wakeup(loop);
+            }
+            return;
+        case URING_OP_TIMER:
+            // Running the wheel reads the timerfd, so the poll can be rearmed
+            timer_wheel_run(&loop->timers);
+            if (!g_signal_received) {
+                uring_loop_arm_timer(loop);
+            }
+            return;
+        case URING_OP_COMPLETIONS:
+            uring_loop_complete(loop);
+            if (!g_signal_received) {
+                uring_loop_arm_completions(loop);
+            }
+            return;
+        case URING_OP_PROVIDE:
+            if (cqe->res < 0) {
+                syslog(LOG_ERR, "Failed to provide receive buffers: %s", strerror(-cqe->res));
+            }
+            return;
+        case URING_OP_RECV:
+            conn->pending--;
+            uring_loop_handle_recv(loop, conn, cqe);
+            break;
+        case URING_OP_POLLOUT:
+            conn->pending--;
+            uring_loop_handle_pollout(loop, conn, cqe);
+            break;
+    }
+
+    // A closing connection goes away with its last request
+    uring_loop_reap(loop, conn);
+}
+
+/**
+ * Thread function running one ring until shutdown
+ */
+static void *uring_loop_thread(void *arg)
+{
+    struct uring_loop *loop = (struct uring_loop *)arg;
+
+    shard_pin(loop->shard);
+    while (!g_signal_received) {
+        if (uring_loop_submit(loop, 1) != 0) {
+            break;
+        }
+
+        unsigned head = *loop->cq_head;
+        unsigned tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail && !g_signal_received) {
+            uring_loop_handle(loop, &loop->cqes[head & *loop->cq_mask]);
+            head++;
+        }
+        // Entries are only consumed once handled
+        __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // Shutdown: the connections are freed with the ring, but not before the
+    // writer hands back the packets it still holds
+    for (;;) {
+        struct connection *conn = loop->connections;
+        while (conn != NULL && !connection_appending(conn)) {
+            conn = conn->next;
+        }
+        if (conn == NULL) {
+            break;
+        }
+        struct pollfd pfd = { .fd = loop->completions.fd, .events = POLLIN };
+        poll(&pfd, 1, -1);
+        struct log_write *req = log_completions_take(&loop->completions);
+        while (req != NULL) {
+            struct log_write *next = req->completed_next;
+            connection_append_done(req);
+            req = next;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Release the ring of @param loop, then every connection it still owns
+ */
+static void uring_loop_destroy(struct uring_loop *loop)
+{
+    // Closing the ring cancels whatever is still queued on it
+    munmap(loop->sqes, loop->sqes_size);
+    if (loop->cq_ring != loop->sq_ring) {
+        munmap(loop->cq_ring, loop->cq_ring_size);
+    }
+    munmap(loop->sq_ring, loop->sq_ring_size);
+    close(loop->ring_fd);
+
+    while (loop->connections != NULL) {
+        struct connection *conn = loop->connections;
+        loop->connections = conn->next;
+        connection_destroy(conn);
+    }
+    free(loop->recv_buffers);
+    buffer_pool_free(loop->send_buf, loop->send_buf_size);
+    loop->send_buf = NULL;
+    log_completions_destroy(&loop->completions);
+    timer_wheel_destroy(&loop->timers);
+}
+
+/**
+ * Create and map the ring of @param loop, shard @param shard, and queue the
+ * initial requests
+ */
+static int uring_loop_init(struct uring_loop *loop, int shard)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    loop->shard = shard;
+    loop->listen_fd = shard_listener(shard);
+    loop->multishot_accept = 1;
+    loop->completions.fd = -1;
+    if (timer_wheel_init(&loop->timers) != 0) {
+        return -1;
+    }
+    loop->ring_fd = uring_setup(URING_LOOP_ENTRIES, &params);
+    if (loop->ring_fd < 0) {
+        syslog(LOG_ERR, "io_uring_setup failed: %s", strerror(errno));
+        timer_wheel_destroy(&loop->timers);
+        return -1;
+    }
+
+    loop->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    loop->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (loop->cq_ring_size > loop->sq_ring_size) {
+            loop->sq_ring_size = loop->cq_ring_size;
+        }
+        loop->cq_ring_size = loop->sq_ring_size;
+    }
+
+    loop->sq_ring = mmap(NULL, loop->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_SQ_RING);
+    if (loop->sq_ring == MAP_FAILED) {
+        syslog(LOG_ERR, "Failed to map submission ring: %s", strerror(errno));
+        close(loop->ring_fd);
+        timer_wheel_destroy(&loop->timers);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        loop->cq_ring = loop->sq_ring;
+    } else {
+        loop->cq_ring = mmap(NULL, loop->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_CQ_RING);
+        if (loop->cq_ring == MAP_FAILED) {
+            syslog(LOG_ERR, "Failed to map completion ring: %s", strerror(errno));
+            munmap(loop->sq_ring, loop->sq_ring_size);
+            close(loop->ring_fd);
+            timer_wheel_destroy(&loop->timers);
+            return -1;
+        }
+    }
+    loop->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    loop->sqes = mmap(NULL, loop->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_SQES);
+    if (loop->sqes == MAP_FAILED) {
+        syslog(LOG_ERR, "Failed to map submission entries: %s", strerror(errno));
+        if (loop->cq_ring != loop->sq_ring) {
+            munmap(loop->cq_ring, loop->cq_ring_size);
+        }
+        munmap(loop->sq_ring, loop->sq_ring_size);
+        close(loop->ring_fd);
+        timer_wheel_destroy(&loop->timers);
+        return -1;
+    }
+
+    char *sq = loop->sq_ring;
+    char *cq = loop->cq_ring;
+    loop->sq_head = (unsigned *)(sq + params.sq_off.head);
+    loop->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    loop->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    loop->sq_array = (unsigned *)(sq + params.sq_off.array);
+    loop->sq_entries = params.sq_entries;
+    loop->sq_local_tail = *loop->sq_tail;
+    loop->to_submit = 0;
+    loop->cq_head = (unsigned *)(cq + params.cq_off.head);
+    loop->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    loop->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    loop->connections = NULL;
+
+    if (log_completions_init(&loop->completions) != 0) {
+        uring_loop_destroy(loop);
+        return -1;
+    }
+    loop->send_buf = buffer_pool_alloc(storage_send_buffer_size(), &loop->send_buf_size);
+    loop->recv_buffers = malloc((size_t)URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+    if (!loop->recv_buffers || !loop->send_buf) {
+        syslog(LOG_ERR, "malloc failed for receive and send buffers: %s", strerror(errno));
+        uring_loop_destroy(loop);
+        return -1;
+    }
+
+    if (uring_loop_provide(loop, 0, URING_RECV_BUFFERS) != 0 ||
+        uring_loop_arm_wakeup(loop) != 0 ||
+        uring_loop_arm_timer(loop) != 0 ||
+        uring_loop_arm_completions(loop) != 0 ||
+        uring_loop_arm_accept(loop) != 0) {
+        uring_loop_destroy(loop);
+        return -1;
+    }
+    return 0;
+}
+
+int uring_loop_run(int nloops)
+{
+    int started = 0;
+
+    struct uring_loop *loops = calloc(nloops, sizeof(struct uring_loop));
+    if (!loops) {
+        syslog(LOG_ERR, "malloc failed for io_uring loops: %s", strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < nloops; i++) {
+        if (uring_loop_init(&loops[started], started) != 0) {
+            break;
+        }
+        if (started == 0) {
+            timestamp_start(&loops[0].timers);
+        }
+        if (pthread_create(&loops[started].thread_id, NULL, uring_loop_thread,
+                           &loops[started]) != 0) {
+            syslog(LOG_ERR, "Failed to create io_uring loop thread: %s", strerror(errno));
+            uring_loop_destroy(&loops[started]);
+            break;
+        }
+        started++;
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(loops[i].thread_id, NULL);
+        uring_loop_destroy(&loops[i]);
+    }
+
+    free(loops);
+    return started > 0 ? 0 : -1;
+}